@@ -43,6 +43,25 @@
 #     x-bytes:  raw file data
 # All values are little-endian ("<" in the struct.pack calls)
 #
+# Specifying version 2 a read only image is created, with a directory table at the beginning (sorted by filename hash)
+# and 4 bytes aligned fields and data:
+#   header:
+#     uint32_t: MAGIC_V2 = 0x93841A02
+#     uint32_t: files count
+#     uint32_t: image size
+#     uint32_t: reserved (0)
+#   directory entries (one for each file):
+#     uint32_t: filename hash (FNV-1a)
+#     uint32_t: file content hash (FNV-1a)
+#     uint32_t: filename offset (zero terminated)
+#     uint32_t: mime type offset (zero terminated)
+#     uint32_t: file content offset (4 bytes aligned)
+#     uint32_t: file content length
+#     uint32_t: precomputed HTTP headers offset (zero terminated), 0 = no headers
+#     uint32_t: flags (bit 0: template file)
+#   strings and file contents
+# Offsets start from the image beginning. See FlashFileSystem in fdvcollections.h
+#
 # To optimize html, css, js this script can use "slimmer". Just install it with:
 #   easy_install slimmer
 
@@ -64,49 +83,27 @@ if do_slimmer:
     import slimmer
 
 
-if len(sys.argv) != 4:
-    print "usage:"
-    print "  binarydir.py dirpath outfilename maxsize"
-    exit()
+MAGIC    = 0x93841A03
+MAGIC_V2 = 0x93841A02
 
-dirpath = sys.argv[1]
-files = glob.glob(os.path.join(dirpath, "*.*"))
-#print files
-dirname = os.path.basename(dirpath)
-outfilename = sys.argv[2]
+ENTRYFLAG_TEMPLATE = 0x00000001
 
-with open(outfilename, "wb") as fw:
+# precomputed headers of static files (version 2)
+CACHE_MAXAGE = 86400
+
+
+# same of t_hash() in fdvstrings.h
+def fnv1a(data):
+    h = 2166136261
+    for c in data:
+        h = ((h ^ ord(c)) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def write_v1(fw, entries):
     # magic
-    fw.write(struct.pack("<I", 0x93841A03))
-    # loop among files
-    for filepath in files:
-        filename = os.path.basename(filepath)
-        mimetype = mimetypes.guess_type(filepath, strict = False)[0].encode('ascii','ignore')
-        fileext = os.path.splitext(filename)[1].lower()     
-        if not mimetype:
-            # try to handle additional types unknown to mimetypes.guess_type()          
-            if fileext == ".tpl":
-                mimetype = "text/html"
-            else:
-                mimetype = "application/octet-stream"
-                
-        # get raw file data
-        with open(filepath, "rb") as fr:
-            filedata = fr.read()
-        
-        oldfilesize = len(filedata)
-        
-        # can I remove CR, LF, Tabs?
-        if do_slimmer:          
-            if fileext in [".tpl", ".html", ".htm"]:
-                filedata = slimmer.html_slimmer(filedata)
-            elif fileext in [".css"]:
-                filedata = slimmer.css_slimmer(filedata)
-            elif fileext in [".js"]:
-                filedata = slimmer.js_slimmer(filedata)         
-
-        print "Adding {} mimetype = ({}) size = {}  reduced size = {}".format(filename, mimetype, oldfilesize, len(filedata))
-                
+    fw.write(struct.pack("<I", MAGIC))
+    for (filename, mimetype, filedata) in entries:
         # flags
         fw.write(struct.pack("B", 0))
                 
@@ -124,6 +121,92 @@ with open(outfilename, "wb") as fw:
         
     # end of files flags
     fw.write(struct.pack("B", 1))
+
+
+def write_v2(fw, entries):
+    entries = sorted(entries, key = lambda e: fnv1a(e[0]))
+    data = [""]     # strings and file contents (after header and directory)
+    base = 16 + 32 * len(entries)
+    
+    def add(blob, align = 1):
+        pos = base + len(data[0])
+        pad = (align - pos % align) % align
+        data[0] += "\0" * pad + blob
+        return pos + pad
+        
+    mimeoffsets = {}
+    directory = ""
+    for (filename, mimetype, filedata) in entries:
+        contenthash = fnv1a(filedata)
+        flags = 0
+        headersoffset = 0
+        if os.path.splitext(filename)[1].lower() == ".tpl":
+            flags |= ENTRYFLAG_TEMPLATE
+        else:
+            headers = "Cache-Control: max-age={}\r\nETag: \"{:08x}\"\r\n".format(CACHE_MAXAGE, contenthash)
+            headersoffset = add(headers + "\0")
+        nameoffset = add(filename + "\0")
+        if mimetype not in mimeoffsets:
+            mimeoffsets[mimetype] = add(mimetype + "\0")
+        dataoffset = add(filedata, 4)
+        directory += struct.pack("<8I", fnv1a(filename), contenthash, nameoffset, mimeoffsets[mimetype], dataoffset, len(filedata), headersoffset, flags)
+        
+    fw.write(struct.pack("<4I", MAGIC_V2, len(entries), base + len(data[0]), 0))
+    fw.write(directory)
+    fw.write(data[0])
+
+
+if len(sys.argv) != 4 and len(sys.argv) != 5:
+    print "usage:"
+    print "  binarydir.py dirpath outfilename maxsize [version]"
+    print "    version: 1 (default) or 2 (read only, indexed)"
+    exit()
+
+dirpath = sys.argv[1]
+files = glob.glob(os.path.join(dirpath, "*.*"))
+#print files
+dirname = os.path.basename(dirpath)
+outfilename = sys.argv[2]
+version = int(sys.argv[4]) if len(sys.argv) == 5 else 1
+
+entries = []
+
+# loop among files
+for filepath in files:
+    filename = os.path.basename(filepath)
+    mimetype = mimetypes.guess_type(filepath, strict = False)[0].encode('ascii','ignore')
+    fileext = os.path.splitext(filename)[1].lower()     
+    if not mimetype:
+        # try to handle additional types unknown to mimetypes.guess_type()          
+        if fileext == ".tpl":
+            mimetype = "text/html"
+        else:
+            mimetype = "application/octet-stream"
+            
+    # get raw file data
+    with open(filepath, "rb") as fr:
+        filedata = fr.read()
+    
+    oldfilesize = len(filedata)
+    
+    # can I remove CR, LF, Tabs?
+    if do_slimmer:          
+        if fileext in [".tpl", ".html", ".htm"]:
+            filedata = slimmer.html_slimmer(filedata)
+        elif fileext in [".css"]:
+            filedata = slimmer.css_slimmer(filedata)
+        elif fileext in [".js"]:
+            filedata = slimmer.js_slimmer(filedata)         
+
+    print "Adding {} mimetype = ({}) size = {}  reduced size = {}".format(filename, mimetype, oldfilesize, len(filedata))
+    
+    entries.append((filename, mimetype, filedata))
+
+with open(outfilename, "wb") as fw:
+    if version == 2:
+        write_v2(fw, entries)
+    else:
+        write_v1(fw, entries)
     
 outsize = os.path.getsize(outfilename)
 maxsize = int(sys.argv[3])
@@ -72,6 +72,7 @@ extern "C"
 #include "fdvnetwork.h"
 #include "fdvdatetime.h"
 #include "fdvserialserv.h"
+#include "fdvmqtt.h"
 #include "fdvconfmanager.h"
 
 
@@ -56,23 +56,29 @@ MTD_FLASHMEM VectorBase::~VectorBase()
 void MTD_FLASHMEM VectorBase::operator=(VectorBase const& c)
 {
     clear();
-    m_itemSize   = c.m_itemSize;
-    m_itemsCount = c.m_itemsCount;
-    allocate(m_itemsCount);
-    memcpy(m_data, c.m_data, m_itemSize * m_itemsCount); 
+    m_itemSize = c.m_itemSize;
+    if (allocate(c.m_itemsCount))
+    {
+        m_itemsCount = c.m_itemsCount;
+        memcpy(m_data, c.m_data, m_itemSize * m_itemsCount);
+    }
 }
 
 
-void MTD_FLASHMEM VectorBase::allocate(uint32_t itemsCount)
+// returns false (vector unchanged) when out of memory
+bool MTD_FLASHMEM VectorBase::allocate(uint32_t itemsCount)
 {
     void* newbuf = itemsCount > 0? Memory::malloc(m_itemSize * itemsCount) : NULL;
+    if (newbuf == NULL && itemsCount > 0)
+        return false;
     if (m_data)
     {
-        memcpy(newbuf, m_data, m_itemSize * itemsCount);
+        memcpy(newbuf, m_data, m_itemSize * m_itemsCount);
         Memory::free(m_data);
     }
     m_data = newbuf;
     m_itemsAllocated = itemsCount;
+    return true;
 }
 
 
@@ -82,25 +88,32 @@ void* MTD_FLASHMEM VectorBase::getItem(uint32_t position)
 }
 
 
-void MTD_FLASHMEM VectorBase::add(void const* item)
+bool MTD_FLASHMEM VectorBase::add(void const* item)
 {
-    insert(m_itemsCount, item);
+    return insert(m_itemsCount, item);
 }
 
 
-void MTD_FLASHMEM VectorBase::insert(uint32_t position, void const* item)
+bool MTD_FLASHMEM VectorBase::insert(uint32_t position, void const* item)
 {
-    if (m_itemsCount == m_itemsAllocated)
-        allocate(max(1, m_itemsAllocated * 2));
+    if (m_itemsCount == m_itemsAllocated && !allocate(max(1, m_itemsAllocated * 2)))
+        return false;
     memmove(getItem(position + 1), getItem(position), m_itemSize * (m_itemsCount - position));
     memcpy(getItem(position), item, m_itemSize);
     ++m_itemsCount;
+    return true;
 }
 
 
 void MTD_FLASHMEM VectorBase::remove(uint32_t position)
 {
-    memmove(getItem(position), getItem(position + 1), m_itemSize);
+    memmove(getItem(position), getItem(position + 1), m_itemSize * (m_itemsCount - position - 1));
+    --m_itemsCount;
+}
+
+
+void MTD_FLASHMEM VectorBase::removeLast()
+{
     --m_itemsCount;
 }
 
@@ -133,6 +146,204 @@ uint32_t MTD_FLASHMEM VectorBase::size()
 
 
 
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// ByteRing
+
+MTD_FLASHMEM ByteRing::ByteRing(uint32_t size)
+    : m_head(0), m_tail(0)
+{
+    uint32_t ringSize = 1;
+    while (ringSize < size)
+        ringSize <<= 1;
+    m_buffer = (uint8_t*)Memory::malloc(ringSize);
+    m_mask   = ringSize - 1;
+}
+
+
+MTD_FLASHMEM ByteRing::~ByteRing()
+{
+    Memory::free(m_buffer);
+}
+
+
+// copies up to two contiguous blocks
+uint32_t MTD_FLASHMEM ByteRing::put(uint8_t const* buffer, uint32_t length)
+{
+    uint32_t head = m_head;
+    uint32_t freeSpace = m_mask + 1 - (head - m_tail);
+    if (length > freeSpace)
+        length = freeSpace;
+    uint32_t pos = head & m_mask;
+    uint32_t firstLen = m_mask + 1 - pos;
+    if (firstLen > length)
+        firstLen = length;
+    memcpy(m_buffer + pos, buffer, firstLen);
+    memcpy(m_buffer, buffer + firstLen, length - firstLen);
+    barrier();
+    m_head = head + length;
+    return length;
+}
+
+
+// copies up to two contiguous blocks
+uint32_t MTD_FLASHMEM ByteRing::get(uint8_t* buffer, uint32_t length)
+{
+    uint32_t tail = m_tail;
+    uint32_t count = m_head - tail;
+    if (length > count)
+        length = count;
+    uint32_t pos = tail & m_mask;
+    uint32_t firstLen = m_mask + 1 - pos;
+    if (firstLen > length)
+        firstLen = length;
+    memcpy(buffer, m_buffer + pos, firstLen);
+    memcpy(buffer + firstLen, m_buffer, length - firstLen);
+    barrier();
+    m_tail = tail + length;
+    return length;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// SharedBuffer
+
+SharedBuffer* STC_FLASHMEM SharedBuffer::create(uint32_t size)
+{
+    SharedBuffer* buffer = (SharedBuffer*)Slab::alloc(sizeof(SharedBuffer) + size);
+    if (buffer == NULL)
+        return NULL;
+    buffer->m_refCount = 1;
+    buffer->m_size     = size;
+    return buffer;
+}
+
+
+void MTD_FLASHMEM SharedBuffer::addRef()
+{
+    Critical critical;
+    ++m_refCount;
+}
+
+
+// memory is freed outside of the critical section
+void MTD_FLASHMEM SharedBuffer::release()
+{
+    bool last;
+    {
+        Critical critical;
+        last = (--m_refCount == 0);
+    }
+    if (last)
+        Slab::free(this, sizeof(SharedBuffer) + m_size);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// CharSlice
+
+MTD_FLASHMEM CharSlice::CharSlice(char const* str)
+    : m_buffer(NULL), m_data(str), m_length(str? f_strlen(str) : 0)
+{
+}
+
+
+MTD_FLASHMEM CharSlice::CharSlice(char const* data, uint32_t length)
+    : m_buffer(NULL), m_data(data), m_length(length)
+{
+}
+
+
+MTD_FLASHMEM CharSlice::CharSlice(SharedBuffer* buffer, char const* data, uint32_t length)
+    : m_buffer(buffer), m_data(data), m_length(length)
+{
+    if (m_buffer)
+        m_buffer->addRef();
+}
+
+
+MTD_FLASHMEM CharSlice::CharSlice(CharSlice const& c)
+    : m_buffer(c.m_buffer), m_data(c.m_data), m_length(c.m_length)
+{
+    if (m_buffer)
+        m_buffer->addRef();
+}
+
+
+MTD_FLASHMEM CharSlice::~CharSlice()
+{
+    if (m_buffer)
+        m_buffer->release();
+}
+
+
+CharSlice& MTD_FLASHMEM CharSlice::operator=(CharSlice const& c)
+{
+    if (c.m_buffer)
+        c.m_buffer->addRef();
+    if (m_buffer)
+        m_buffer->release();
+    m_buffer = c.m_buffer;
+    m_data   = c.m_data;
+    m_length = c.m_length;
+    return *this;
+}
+
+
+CharSlice STC_FLASHMEM CharSlice::alloc(uint32_t length)
+{
+    CharSlice slice;
+    slice.m_buffer = SharedBuffer::create(length + 1);
+    if (slice.m_buffer == NULL)
+        return slice;
+    slice.m_data   = slice.m_buffer->getData();
+    slice.m_length = length;
+    slice.m_buffer->getData()[length] = 0;
+    return slice;
+}
+
+
+// data can stay in RAM or Flash
+CharSlice STC_FLASHMEM CharSlice::copy(char const* data, uint32_t length)
+{
+    CharSlice slice = alloc(length);
+    if (slice.m_buffer)
+        f_memcpy(slice.m_buffer->getData(), data, length);
+    return slice;
+}
+
+
+// fmt and "strings" of args can stay in RAM or Flash
+CharSlice STC_FLASHMEM CharSlice::format(char const* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    uint16_t length = vsprintf(NULL, fmt, args);
+    va_end(args);
+    
+    CharSlice slice = alloc(length);
+    if (slice.m_buffer)
+    {
+        va_start(args, fmt);
+        vsprintf(slice.m_buffer->getData(), fmt, args);
+        va_end(args);
+    }
+    return slice;
+}
+
+
+CharSlice MTD_FLASHMEM CharSlice::sub(uint32_t start, uint32_t length) const
+{
+    return CharSlice(m_buffer, m_data + start, length);
+}
+
+
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // CharChunkBase
@@ -161,6 +372,8 @@ uint32_t MTD_FLASHMEM CharChunkBase::getItems()
             return static_cast<CharChunkAllocated32*>(this)->items;
         case CharChunkLink::TYPE:
             return static_cast<CharChunkLink*>(this)->items;
+        case CharChunkShared::TYPE:
+            return static_cast<CharChunkShared*>(this)->items;
     }
 }
 
@@ -206,6 +419,8 @@ uint32_t MTD_FLASHMEM CharChunkBase::getCapacity()
             return static_cast<CharChunkAllocated32*>(this)->capacity;
         case CharChunkLink::TYPE:
             return static_cast<CharChunkLink*>(this)->items;
+        case CharChunkShared::TYPE:
+            return static_cast<CharChunkShared*>(this)->items;
     }
 }
 
@@ -254,6 +469,15 @@ CharChunkBase* MTD_FLASHMEM CharChunkFactory::createCharChunkLink(LinkedCharChun
 }
 
 
+// slices of static data become simple references
+CharChunkBase* MTD_FLASHMEM CharChunkFactory::createCharChunkShared(CharSlice const& slice)
+{
+    if (slice.getBuffer())
+        return new CharChunkShared(slice);
+    return createCharChunkReference((char*)slice.getData(), slice.getLength());
+}
+
+
 void MTD_FLASHMEM CharChunkFactory::deleteCharChunk(CharChunkBase* chunk)
 {
     switch (chunk->type)
@@ -288,6 +512,9 @@ void MTD_FLASHMEM CharChunkFactory::deleteCharChunk(CharChunkBase* chunk)
         case CharChunkLink::TYPE:
             delete static_cast<CharChunkLink*>(chunk);
             break;
+        case CharChunkShared::TYPE:
+            delete static_cast<CharChunkShared*>(chunk);
+            break;
     }
 }
 
@@ -302,19 +529,19 @@ MTD_FLASHMEM CharChunksIterator::CharChunksIterator(CharChunkBase* chunk)
     checkLinkedChunks();
 }
 
+// source is already positioned on a data chunk: no need to call checkLinkedChunks()
+// the links stack allocates only when c has more than INLINEDEPTH items
 MTD_FLASHMEM CharChunksIterator::CharChunksIterator(CharChunksIterator const& c)
-    : m_chunk(c.m_chunk), m_pos(c.m_pos), m_absPos(c.m_absPos), m_linkedNext(c.m_linkedNext)
+    : m_chunk(c.m_chunk), m_pos(c.m_pos), m_absPos(c.m_absPos), m_linked(c.m_linked)
 {
-    checkLinkedChunks();
 }
 
 CharChunksIterator& MTD_FLASHMEM CharChunksIterator::operator=(CharChunksIterator const& c)
 {
-    m_chunk      = c.m_chunk;
-    m_pos        = c.m_pos;
-    m_absPos     = c.m_absPos;
-    m_linkedNext = c.m_linkedNext;
-    checkLinkedChunks();
+    m_chunk  = c.m_chunk;
+    m_pos    = c.m_pos;
+    m_absPos = c.m_absPos;
+    m_linked = c.m_linked;
     return *this;
 }
 
@@ -376,7 +603,7 @@ uint32_t MTD_FLASHMEM CharChunksIterator::getPosition()
 
 bool MTD_FLASHMEM CharChunksIterator::isLast()
 {
-    return m_chunk->next == NULL && m_pos + 1 >= m_chunk->getItems() && (m_linkedNext.size() == 0 || m_linkedNext[0] == NULL);
+    return m_chunk->next == NULL && m_pos + 1 >= m_chunk->getItems() && (m_linked.size() == 0 || m_linked[0] == NULL);
 }
 
 bool MTD_FLASHMEM CharChunksIterator::isValid()
@@ -396,15 +623,21 @@ void MTD_FLASHMEM CharChunksIterator::checkLinkedChunks()
 {
     while (true)
     {
-        if (m_chunk == NULL && m_linkedNext.size() > 0)
+        if (m_chunk == NULL && m_linked.size() > 0)
         {
-            m_chunk = m_linkedNext.pop();
+            m_chunk = m_linked.last();
+            m_linked.removeLast();
         }
         else if (m_chunk != NULL && m_chunk->type == CharChunkLink::TYPE)
         {
-            m_linkedNext.push(m_chunk->next);
+            m_linked.add(m_chunk->next);
             m_chunk = static_cast<CharChunkLink*>(m_chunk)->link;
         }
+        else if (m_chunk != NULL && m_chunk->getItems() == 0)
+        {
+            // skip empty chunks (ie reserved, not yet filled)
+            m_chunk = m_chunk->next;
+        }
         else
             break;           
     }
@@ -441,6 +674,7 @@ void MTD_FLASHMEM LinkedCharChunks::clear()
 		chunk = next;
 	}
 	m_chunks = m_current = NULL;
+	m_itemsBeforeCurrent = 0;
 }
 
 
@@ -449,7 +683,10 @@ CharChunkBase* MTD_FLASHMEM LinkedCharChunks::addChunk(CharChunkBase* chunk)
     if (m_chunks == NULL)
 		m_current = m_chunks = chunk;
 	else
+	{
+		m_itemsBeforeCurrent += m_current->getItems();
 		m_current = m_current->next = chunk;
+	}
 	return chunk;
 }
 
@@ -479,6 +716,13 @@ void MTD_FLASHMEM LinkedCharChunks::addChunk(char const* str, bool freeOnDestroy
 }
 
 
+// data is shared (no copy), the chunk keeps a reference to the slice buffer
+CharChunkBase* MTD_FLASHMEM LinkedCharChunks::addChunk(CharSlice const& slice)
+{
+    return addChunk(CharChunkFactory::createCharChunkShared(slice));
+}
+
+
 // adds all chunks of src
 // Only a reference to source LinkedCharChunks is maintained (not owned)
 void MTD_FLASHMEM LinkedCharChunks::addChunks(LinkedCharChunks* src)
@@ -487,22 +731,63 @@ void MTD_FLASHMEM LinkedCharChunks::addChunks(LinkedCharChunks* src)
 }
 
 
+// free items in the last chunk (only allocated chunks have capacity greater than items)
+uint32_t MTD_FLASHMEM LinkedCharChunks::getFreeSpace()
+{
+    return m_current? m_current->getCapacity() - m_current->getItems() : 0;
+}
+
+
+// doubles the size of last chunk, limited to MINCHUNKSIZE..MAXCHUNKSIZE, but never less than minSize
+uint32_t MTD_FLASHMEM LinkedCharChunks::getNextChunkSize(uint32_t minSize)
+{
+    uint32_t size = m_current? m_current->getCapacity() * 2 : MINCHUNKSIZE;
+    if (size < MINCHUNKSIZE)
+        size = MINCHUNKSIZE;
+    else if (size > MAXCHUNKSIZE)
+        size = MAXCHUNKSIZE;
+    return size < minSize? minSize : size;
+}
+
+
+// newChunkSize = 0 : new chunks size grows geometrically (see getNextChunkSize())
 void MTD_FLASHMEM LinkedCharChunks::append(char value, uint32_t newChunkSize)
 {    
-	if (m_current && m_current->getItems() < m_current->getCapacity())
-	{
-		// can use current chunk
+	if (getFreeSpace() == 0)
+		addChunk(newChunkSize? newChunkSize : getNextChunkSize(1));  // need another chunk
+    uint32_t items = m_current->getItems();
+    m_current->data[items++] = value;
+    m_current->setItems(items);
+}
+
+
+// data can stay in RAM or Flash
+// Fills last chunk, then allocates a chunk large enough to contain the remaining data
+void MTD_FLASHMEM LinkedCharChunks::append(char const* data, uint32_t length)
+{
+    while (length > 0)
+    {
+        uint32_t freeSpace = getFreeSpace();
+        if (freeSpace == 0)
+        {
+            addChunk(getNextChunkSize(length));
+            freeSpace = m_current->getCapacity();
+        }
+        uint32_t count = length < freeSpace? length : freeSpace;
         uint32_t items = m_current->getItems();
-		m_current->data[items++] = value;
-        m_current->setItems(items);
-	}
-	else
-	{
-		// need another chunk
-		CharChunkBase* chunk = addChunk(newChunkSize);
-		chunk->data[0] = value;
-		chunk->setItems(1);
-	}
+        f_memcpy(m_current->data + items, data, count);
+        m_current->setItems(items + count);
+        data   += count;
+        length -= count;
+    }
+}
+
+
+// ensures last chunk can contain at least "length" more items, without adding any item
+void MTD_FLASHMEM LinkedCharChunks::reserve(uint32_t length)
+{
+    if (getFreeSpace() < length)
+        addChunk(getNextChunkSize(length));
 }
 
 
@@ -520,14 +805,8 @@ CharChunksIterator MTD_FLASHMEM LinkedCharChunks::getIterator()
 
 uint32_t MTD_FLASHMEM LinkedCharChunks::getItemsCount() const
 {
-	uint32_t len = 0;
-	CharChunkBase* chunk = m_chunks;
-	while (chunk)
-	{
-		len += chunk->getItems();
-		chunk = chunk->next;
-	}
-	return len;
+	// last chunk items are not cached because callers may fill it directly (using setItems())
+	return m_itemsBeforeCurrent + (m_current? m_current->getItems() : 0);
 }
 
 
@@ -563,6 +842,142 @@ void MTD_FLASHMEM LinkedCharChunks::operator=(LinkedCharChunks& c)
 }
 
 
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// HashIndex
+
+MTD_FLASHMEM HashIndex::HashIndex()
+    : m_hashes(NULL), m_slots(NULL), m_count(0), m_hashesAllocated(0), m_slotsCount(0)
+{
+}
+
+
+MTD_FLASHMEM HashIndex::~HashIndex()
+{
+    clear();
+}
+
+
+void MTD_FLASHMEM HashIndex::clear()
+{
+    if (m_hashes)
+        Memory::free(m_hashes);
+    if (m_slots)
+        Memory::free(m_slots);
+    m_hashes = NULL;
+    m_slots = NULL;
+    m_count = 0;
+    m_hashesAllocated = 0;
+    m_slotsCount = 0;
+}
+
+
+uint32_t MTD_FLASHMEM HashIndex::size()
+{
+    return m_count;
+}
+
+
+bool MTD_FLASHMEM HashIndex::add(uint32_t hash)
+{
+    if (m_count == m_hashesAllocated)
+    {
+        uint32_t newAllocated = m_hashesAllocated? m_hashesAllocated * 2 : 4;
+        uint32_t* newHashes = (uint32_t*)Memory::malloc(sizeof(uint32_t) * newAllocated);
+        if (newHashes == NULL)
+            return false;
+        if (m_hashes)
+        {
+            memcpy(newHashes, m_hashes, sizeof(uint32_t) * m_count);
+            Memory::free(m_hashes);
+        }
+        m_hashes = newHashes;
+        m_hashesAllocated = newAllocated;
+    }
+    m_hashes[m_count] = hash;
+    ++m_count;
+    
+    if (m_count > SMALLSIZE)
+    {
+        // keep load factor <= 3/4
+        if (m_count * 4 > m_slotsCount * 3)
+        {
+            if (!rebuildSlots(m_slotsCount? m_slotsCount * 2 : 32))
+            {
+                --m_count;  // the old slots are still valid without the new entry
+                return false;
+            }
+        }
+        else
+            insertSlot(m_count - 1);
+    }
+    return true;
+}
+
+
+void MTD_FLASHMEM HashIndex::insertSlot(uint32_t index)
+{
+    uint32_t mask = m_slotsCount - 1;
+    uint32_t slot = m_hashes[index] & mask;
+    while (m_slots[slot] != 0)
+        slot = (slot + 1) & mask;
+    m_slots[slot] = index + 1;
+}
+
+
+// returns false (slots unchanged) when out of memory
+bool MTD_FLASHMEM HashIndex::rebuildSlots(uint32_t slotsCount)
+{
+    uint16_t* newSlots = (uint16_t*)Memory::malloc(sizeof(uint16_t) * slotsCount);
+    if (newSlots == NULL)
+        return false;
+    if (m_slots)
+        Memory::free(m_slots);
+    m_slots = newSlots;
+    m_slotsCount = slotsCount;
+    memset(m_slots, 0, sizeof(uint16_t) * slotsCount);
+    for (uint32_t i = 0; i != m_count; ++i)
+        insertSlot(i);
+    return true;
+}
+
+
+// returns entries with the specified hash, in insertion order (there are no removals, so probe order is insertion order).
+// Returns NOTFOUND when there are no more candidates.
+// small index: *cursor is the next entry to check
+// hashed index: *cursor is the number of probed slots
+uint32_t MTD_FLASHMEM HashIndex::find(uint32_t hash, uint32_t* cursor)
+{
+    if (m_count <= SMALLSIZE)
+    {
+        for (uint32_t i = *cursor; i < m_count; ++i)
+            if (m_hashes[i] == hash)
+            {
+                *cursor = i + 1;
+                return i;
+            }
+        *cursor = m_count;
+        return NOTFOUND;
+    }
+    uint32_t mask = m_slotsCount - 1;
+    for (; *cursor != m_slotsCount; ++*cursor)
+    {
+        uint32_t entry = m_slots[(hash + *cursor) & mask];
+        if (entry == 0)
+            break;  // empty slot: end of probe sequence
+        if (m_hashes[entry - 1] == hash)
+        {
+            ++*cursor;
+            return entry - 1;
+        }
+    }
+    *cursor = m_slotsCount;
+    return NOTFOUND;
+}
+
+
+
+
 //////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 // FlashFileSystem
@@ -580,9 +995,23 @@ char const* MTD_FLASHMEM FlashFileSystem::getBase()
 }
 
 
+uint32_t MTD_FLASHMEM FlashFileSystem::getVersion()
+{
+    uint32_t magic = *((uint32_t const*)(FLASH_MAP_START + FLASHFILESYSTEM_POS));
+    if (magic == MAGIC)
+        return 1;
+    if (magic == MAGIC_V2)
+        return 2;
+    return 0;
+}
+
+
 // item->nextpos=NULL -> get the first item
 bool MTD_FLASHMEM FlashFileSystem::getNext(Item* item)
 {
+    if (getVersion() == 2)
+        return getNextV2(item);
+        
     // first item?
     if (item->nextpos == NULL)
         item->nextpos = getBase();
@@ -606,9 +1035,12 @@ bool MTD_FLASHMEM FlashFileSystem::getNext(Item* item)
     item->datalength = getDWord(item->nextpos); 
     item->nextpos += sizeof(item->datalength);
     // calc pointers
-    item->filename   = item->nextpos;
-    item->mimetype   = item->nextpos + filenamelen;
-    item->data       = (void const*)(item->mimetype + mimetypelen);
+    item->filename    = item->nextpos;
+    item->mimetype    = item->nextpos + filenamelen;
+    item->data        = (void const*)(item->mimetype + mimetypelen);
+    item->contenthash = 0;
+    item->headers     = NULL;
+    item->flags       = 0;
     // move to next file
     item->nextpos += item->datalength + filenamelen + mimetypelen;
     
@@ -616,9 +1048,194 @@ bool MTD_FLASHMEM FlashFileSystem::getNext(Item* item)
 }
 
 
+// Version 2 images: fields are 4 bytes aligned, so they are read directly from the flash map
+void MTD_FLASHMEM FlashFileSystem::getEntryV2(EntryV2 const* entry, Item* item)
+{
+    char const* image = (char const*)(FLASH_MAP_START + FLASHFILESYSTEM_POS);
+    item->thispos     = (char const*)entry;
+    item->nextpos     = (char const*)(entry + 1);
+    item->filename    = image + entry->nameOffset;
+    item->mimetype    = image + entry->mimeOffset;
+    item->datalength  = entry->dataLength;
+    item->data        = image + entry->dataOffset;
+    item->contenthash = entry->contentHash;
+    item->headers     = entry->headersOffset? image + entry->headersOffset : NULL;
+    item->flags       = entry->flags;
+}
+
+
+// files are returned in directory order (sorted by filename hash)
+bool MTD_FLASHMEM FlashFileSystem::getNextV2(Item* item)
+{
+    ImageHeaderV2 const* header = (ImageHeaderV2 const*)(FLASH_MAP_START + FLASHFILESYSTEM_POS);
+    EntryV2 const* first = (EntryV2 const*)(header + 1);
+    EntryV2 const* entry = item->nextpos? (EntryV2 const*)item->nextpos : first;
+    if (entry >= first + header->filesCount)
+        return false;   // end of directory
+    getEntryV2(entry, item);
+    return true;
+}
+
+
+// binary search of the filename hash into the directory, no RAM index required
+bool MTD_FLASHMEM FlashFileSystem::findV2(char const* filename, Item* item)
+{
+    ImageHeaderV2 const* header = (ImageHeaderV2 const*)(FLASH_MAP_START + FLASHFILESYSTEM_POS);
+    EntryV2 const* entries = (EntryV2 const*)(header + 1);
+    uint32_t count = header->filesCount;
+    uint32_t hash = getFilenameHash(filename);
+    uint32_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (entries[mid].nameHash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // check all files having the same hash
+    for (; lo < count && entries[lo].nameHash == hash; ++lo)
+    {
+        getEntryV2(&entries[lo], item);
+        if (f_strcmp(filename, item->filename) == 0)
+            return true;    // found
+    }
+    return false;   // not found
+}
+
+
+// Lookup index: filename hashes and header positions of all files, in files order
+// refCount (protected by Critical) counts s_index and readers: the index is freed by the last one
+struct FlashFileSystem::Index
+{
+    HashIndex           hashes;
+    Vector<char const*> positions;
+    uint32_t            refCount;
+};
+
+
+FlashFileSystem::Index* FlashFileSystem::s_index = NULL;
+
+uint32_t FlashFileSystem::s_indexGeneration = 0;
+
+
 // filename can stay in Ram or Flash
+uint32_t MTD_FLASHMEM FlashFileSystem::getFilenameHash(char const* filename)
+{
+    return t_hash(CharIterator(filename), CharIterator(filename + f_strlen(filename)));
+}
+
+
+// builds the index at first call (one scan of all files)
+// returns NULL when there isn't memory for the index or files changed while building it (callers scan all files)
+// returned index must be released calling releaseIndex()
+FlashFileSystem::Index* MTD_FLASHMEM FlashFileSystem::getIndex()
+{
+    uint32_t generation;
+    {
+        Critical critical;
+        if (s_index)
+        {
+            ++s_index->refCount;
+            return s_index;
+        }
+        generation = s_indexGeneration;
+    }
+    
+    Index* index = new Index;
+    if (index == NULL)
+        return NULL;
+    Item item;
+    while (getNext(&item))
+    {
+        if (!index->positions.add(item.thispos) || !index->hashes.add(getFilenameHash(item.filename)))
+        {
+            // out of memory, an incomplete index would miss files
+            delete index;
+            return NULL;
+        }
+    }
+    
+    // another task could have built it meanwhile, or invalidated it while it was built
+    Index* result = NULL;
+    Index* discarded = NULL;
+    {
+        Critical critical;
+        if (s_index)
+        {
+            ++s_index->refCount;
+            result = s_index;
+            discarded = index;
+        }
+        else if (s_indexGeneration == generation)
+        {
+            index->refCount = 2;    // s_index and the caller
+            s_index = index;
+            result = index;
+        }
+        else
+            discarded = index;
+    }
+    delete discarded;
+    return result;
+}
+
+
+void MTD_FLASHMEM FlashFileSystem::releaseIndex(Index* index)
+{
+    bool unused;
+    {
+        Critical critical;
+        unused = (--index->refCount == 0);
+    }
+    if (unused)
+        delete index;
+}
+
+
+// must be called whenever files are added or removed
+// the index is freed when the tasks still using it release it
+void MTD_FLASHMEM FlashFileSystem::invalidateIndex()
+{
+    Index* index;
+    {
+        Critical critical;
+        index = s_index;
+        s_index = NULL;
+        ++s_indexGeneration;    // indexes being built are not published
+    }
+    if (index)
+        releaseIndex(index);
+}
+
+
+// filename can stay in Ram or Flash
+// Searches all files, whatever item contains. Only the file headers having the same filename hash are read.
 bool MTD_FLASHMEM FlashFileSystem::find(char const* filename, Item* item)
 {	
+    if (getVersion() == 2)
+        return findV2(filename, item);
+    
+    Index* index = getIndex();
+    if (index)
+    {
+        bool found = false;
+        uint32_t cursor = 0;
+        uint32_t hash = getFilenameHash(filename);
+        for (uint32_t i = index->hashes.find(hash, &cursor); i != HashIndex::NOTFOUND; i = index->hashes.find(hash, &cursor))
+        {
+            item->nextpos = index->positions[i];
+            if (getNext(item) && f_strcmp(filename, item->filename) == 0)
+            {
+                found = true;
+                break;
+            }
+        }
+        releaseIndex(index);
+        return found;
+    }
+    // no memory for the index, scan all files
+    item->reset();
 	while (getNext(item))
         if (f_strcmp(filename, item->filename) == 0)
             return true;    // found
@@ -627,16 +1244,18 @@ bool MTD_FLASHMEM FlashFileSystem::find(char const* filename, Item* item)
 
 
 // Other threads should not call any FlashFileSystem method while one thread is inside "remove"
+// version 2 images are read only
 bool MTD_FLASHMEM FlashFileSystem::remove(char const* filename)
 {
     Item item;
-    if (find(filename, &item))
+    if (getVersion() != 2 && find(filename, &item))
     {
         char const* pos = item.thispos;
         char const* nextPos = item.nextpos;
         while (getNext(&item))
             ;
         FlashWriter((void*)pos).write(nextPos, item.thispos - nextPos + 1);
+        invalidateIndex();
         return true;
     }
     return false;
@@ -654,8 +1273,11 @@ char const* MTD_FLASHMEM FlashFileSystem::getFreePos()
 
 
 // return free space in bytes
+// version 2 images are read only (no free space)
 uint32_t MTD_FLASHMEM FlashFileSystem::getFreeSpace()
 {
+    if (getVersion() == 2)
+        return 0;
     return getBeginOfSDKSettings() - (uint8_t const*)getFreePos();
 }
 
@@ -670,8 +1292,12 @@ MTD_FLASHMEM FlashFile::FlashFile()
 {
 }
 
+// does nothing on version 2 images (read only), next write() calls will fail
 MTD_FLASHMEM void FlashFile::create(char const* filename, char const* mimetype)
 {
+    if (FlashFileSystem::getVersion() == 2)
+        return;
+        
     // remove the file if already exists
     FlashFileSystem::remove(filename);
 
@@ -714,13 +1340,13 @@ MTD_FLASHMEM FlashFile::~FlashFile()
 
 bool MTD_FLASHMEM FlashFile::write(void const* data, uint32_t size)
 {
-    return m_writer.write(data, size);
+    return m_startPosition && m_writer.write(data, size);
 }
 
 
 bool MTD_FLASHMEM FlashFile::write(char const* string)
 {
-    return m_writer.write(string, f_strlen(string));
+    return m_startPosition && m_writer.write(string, f_strlen(string));
 }
 
 
@@ -749,100 +1375,151 @@ void MTD_FLASHMEM FlashFile::close()
         
         // file closed
         m_startPosition = NULL;  
+        FlashFileSystem::invalidateIndex();
     }
 }
 
 
 
 
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// FlashDictionaryWriter
+// Writes a stream of bytes to erased flash through a small aligned buffer
+// Each field can be padded to 4 bytes with 0xFF (erased value)
+
+class FlashDictionaryWriter
+{
+public:
+    FlashDictionaryWriter(uint32_t address)
+        : m_address(address), m_length(0)
+    {
+    }
+    
+    ~FlashDictionaryWriter()
+    {
+        flush();
+    }
+    
+    // source can be stored in Flash or RAM
+    void MTD_FLASHMEM write(void const* source, uint32_t length)
+    {
+        uint8_t const* src = (uint8_t const*)source;
+        while (length > 0)
+        {
+            uint32_t len = min(length, (uint32_t)sizeof(m_buffer) - m_length);
+            f_memcpy((uint8_t*)m_buffer + m_length, src, len);
+            src      += len;
+            length   -= len;
+            m_length += len;
+            if (m_length == sizeof(m_buffer))
+                flush();
+        }
+    }
+    
+    void MTD_FLASHMEM writeDWord(uint32_t value)
+    {
+        write(&value, sizeof(value));
+    }
+    
+    void MTD_FLASHMEM pad()
+    {
+        while (m_length % 4)
+            ((uint8_t*)m_buffer)[m_length++] = 0xFF;
+    }
+    
+    void MTD_FLASHMEM flush()
+    {
+        pad();
+        if (m_length > 0)
+        {
+            Critical critical;
+            spi_flash_write(m_address, (uint32*)m_buffer, m_length);
+            m_address += m_length;
+            m_length = 0;
+        }
+    }
+
+private:
+    uint32_t m_buffer[16];
+    uint32_t m_address;
+    uint32_t m_length;
+};
+
+
+
+
 //////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 // FlashDictionary
 
-// clear the entire available space and write MAGIC at the beginning of the dictionary
+// clear all dictionary sectors and write MAGIC at the beginning of the first one
 // This is required only if you want to remove previous content
-// erase all values to 0xFF
 void STC_FLASHMEM FlashDictionary::eraseContent()
 {
-    Critical critical;
-    spi_flash_erase_sector(FLASH_DICTIONARY_POS / SPI_FLASH_SEC_SIZE);
-    uint32 magic = MAGIC;
-    spi_flash_write(FLASH_DICTIONARY_POS, &magic, sizeof(magic));
+    for (uint32_t sector = 0; sector != FLASH_DICTIONARY_SECTORS; ++sector)
+    {
+        Critical critical;
+        spi_flash_erase_sector(FLASH_DICTIONARY_POS / SPI_FLASH_SEC_SIZE + sector);
+    }
+    writeSectorHeader(0, 0);
 }
 
 
-// requires 4K free heap to execute!
+// appends a new record (nothing is written if the value is not changed)
+// compacts the dictionary into the next sector when the active one is full
+// does nothing if the record cannot fit
 void STC_FLASHMEM FlashDictionary::setValue(char const* key, void const* value, uint32_t valueLength)
 {
     if (!value)
         return;
     
-    // find key or a free space
-    uint8_t const* keyPosPtr = (uint8_t const*)findKey(key);
-
-    // copy the Flash page in RAM buffer (page)
-    // memcpy is ok, because source alredy aligned then can be read directly from Flash
-    uint8_t* page = new uint8_t[SPI_FLASH_SEC_SIZE];
-    memcpy(page, (void const*)(FLASH_MAP_START + FLASH_DICTIONARY_POS), SPI_FLASH_SEC_SIZE);	
-    
-    // get key position as index into page[]
-    uint32_t keyPos = (uint32_t)keyPosPtr - FLASH_MAP_START - FLASH_DICTIONARY_POS;
-    uint32_t curPos = keyPos;
-    
-    // is new key?
-    bool isNewKey = (page[keyPos] == 0xFF);
+    uint32_t keyLength = f_strlen(key);
+    uint32_t recordSize = getRecordSize(keyLength, valueLength);
+    if (keyLength >= 0xFF || recordSize > getTotalSpace())
+        return;
+        
+    uint32_t sequence;
+    uint32_t sector = getActiveSector(&sequence);
     
-    // store key length (byte)
-    uint32_t keyLen = f_strlen(key);
-    page[curPos++] = keyLen;
+    // value not changed?
+    uint8_t const* record = findRecord(sector, key, keyLength);
+    if (record && (*(uint32_t const*)record >> 16) == valueLength &&
+        f_memcmp(record + getRecordSize(keyLength, 0), value, valueLength) == 0)
+        return;
     
-    // store key (and terminating zero)
-    f_strcpy((char *)&page[curPos], key);
-    curPos += keyLen + 1;
-
-    // need to move next key->values?
-    if (!isNewKey)
-    {			
-        uint32_t prevValueLength = page[curPos] | (page[curPos + 1] << 8);	// little-endian
-        bool isLastKey = (page[curPos + 2 + prevValueLength] == 0xFF);
-        int diff = (int32_t)valueLength - prevValueLength;
-        uint8_t* dst = &page[curPos + max(0, diff)];
-        uint8_t* src = &page[curPos - min(0, diff)];
-        uint8_t* end = &page[SPI_FLASH_SEC_SIZE];
-        memmove(dst, src, min(end - src, end - dst));
-        // mark the new end of items
-        if (isLastKey)
-            page[curPos + 2 + valueLength] = 0xFF;			
+    // append to the active sector
+    bool torn;
+    uint8_t const* recordsEnd = getRecordsEnd(sector, &torn);
+    if (!torn && recordsEnd + recordSize <= getSectorPtr(sector) + SPI_FLASH_SEC_SIZE)
+    {
+        writeRecord((uint32_t)recordsEnd - FLASH_MAP_START, key, keyLength, value, valueLength);
+        return;
     }
     
-    // store low and high byte of value length word (little-endian)
-    page[curPos++] = valueLength & 0xFF;
-    page[curPos++] = (valueLength >> 8) & 0xFF;
-    
-    // store value data
-    f_memcpy(&page[curPos], value, valueLength);
-            
-    // write back into the flash
-    Critical critical;
-    spi_flash_erase_sector(FLASH_DICTIONARY_POS / SPI_FLASH_SEC_SIZE);
-    spi_flash_write(FLASH_DICTIONARY_POS, (uint32*)page, SPI_FLASH_SEC_SIZE);
-    
-    delete[] page;
+    // active sector full (or with an uncommitted record): compact into the next sector
+    // the new record is written before the sector header, so it is committed along with the compaction
+    uint32_t destSector = (sector + 1) % FLASH_DICTIONARY_SECTORS;
+    uint32_t address;
+    if (compact(sector, destSector, key, keyLength, recordSize, &address))
+    {
+        writeRecord(address, key, keyLength, value, valueLength);
+        writeSectorHeader(destSector, sequence + 1);
+    }
 }
 
 
-// return NULL if key point to a free space (aka key doesn't exist)
-// return pointer may be Unaligned pointer to Flash
+// return NULL if key doesn't exist
+// return pointer is aligned pointer to Flash, valid until next setValue()
 uint8_t const* STC_FLASHMEM FlashDictionary::getValue(char const* key, uint32_t* valueLength)
 {
-    uint8_t const* pos = (uint8_t const*)findKey(key);
-    uint8_t keyLen = getByte(pos);
-    if (keyLen == 0xFF)
+    uint32_t keyLength = f_strlen(key);
+    uint8_t const* record = findRecord(getActiveSector(), key, keyLength);
+    if (!record)
         return NULL;
-    pos += 1 + keyLen + 1;
     if (valueLength)
-        *valueLength = getWord(pos);
-    return pos + 2;
+        *valueLength = *(uint32_t const*)record >> 16;
+    return record + getRecordSize(keyLength, 0);
 }
 
 
@@ -888,41 +1565,229 @@ bool STC_FLASHMEM FlashDictionary::getBool(char const* key, bool defaultValue)
 }
 
 
-// return starting of specified key or starting of next free position
-// what is stored:
-//   byte: key length (or 0xFF for end of keys, hence starting of free space). Doesn't include ending zero
-//   ....: key string
-//   0x00: key ending zero
-//   word: value length (little endian)
-//   ....: value data
-// automatically erase content if not already initialized
-void const* MTD_FLASHMEM FlashDictionary::findKey(char const* key)
-{		
-    if (!isContentValid())
-        eraseContent();
-    uint8_t const* curpos = (uint8_t const*)(FLASH_MAP_START + FLASH_DICTIONARY_POS + sizeof(MAGIC));	
-    while (true)
+bool STC_FLASHMEM FlashDictionary::isContentValid()
+{
+    uint32_t sequence;
+    return findActiveSector(&sequence) >= 0;
+}
+
+
+// bytes used by records of the active sector (including replaced records)
+uint32_t STC_FLASHMEM FlashDictionary::getUsedSpace()
+{
+    uint32_t sector = getActiveSector();
+    return getRecordsEnd(sector) - (getSectorPtr(sector) + SECTORHEADER_SIZE);
+}
+
+
+// return -1 if there isn't a valid sector
+int32_t STC_FLASHMEM FlashDictionary::findActiveSector(uint32_t* sequence)
+{
+    int32_t result = -1;
+    for (uint32_t sector = 0; sector != FLASH_DICTIONARY_SECTORS; ++sector)
     {
-        uint8_t keylen = getByte(curpos);	// keylen doesn't include ending zero
-        if (keylen == 0xFF || (key && f_strcmp((char const*)(curpos + 1), key) == 0))
-            return curpos;	// return start of free space or start of key->value block
-        // goto next block
-        curpos += 1 + keylen + 1;		// 1 (keylen field) + keylen + 1 (ending zero)
-        curpos += 2 + getWord(curpos);	// 2 (valuelen field) + valuelen
+        // already aligned, can be read directly from Flash
+        uint32_t const* header = (uint32_t const*)getSectorPtr(sector);
+        if (header[0] == MAGIC && (result == -1 || header[1] > *sequence))
+        {
+            result    = sector;
+            *sequence = header[1];
+        }
     }
+    return result;
+}
+
+
+// automatically erase or convert content if not already initialized
+uint32_t STC_FLASHMEM FlashDictionary::getActiveSector(uint32_t* sequence)
+{
+    uint32_t seq;
+    int32_t sector = findActiveSector(&seq);
+    if (sector == -1)
+    {
+        if (*(uint32_t const*)getSectorPtr(0) == MAGIC_V1)
+            convertV1();
+        else
+            eraseContent();
+        sector = findActiveSector(&seq);
+    }
+    if (sequence)
+        *sequence = seq;
+    return sector;
+}
+
+
+uint8_t const* STC_FLASHMEM FlashDictionary::getSectorPtr(uint32_t sector)
+{
+    return FLASH_MAP_START_PTR + FLASH_DICTIONARY_POS + sector * SPI_FLASH_SEC_SIZE;
 }
 
 
-bool MTD_FLASHMEM FlashDictionary::isContentValid()
+// return next committed record or the end of records (free space or uncommitted record)
+uint8_t const* STC_FLASHMEM FlashDictionary::getNextRecord(uint8_t const* record)
 {
-    // already aligned, can be read directly from Flash
-    return *((uint32_t const*)(FLASH_MAP_START + FLASH_DICTIONARY_POS)) == MAGIC;
+    uint32_t header = *(uint32_t const*)record;
+    return record + getRecordSize(header & 0xFF, header >> 16);
 }
 
 
-uint32_t MTD_FLASHMEM FlashDictionary::getUsedSpace()
+// return end of committed records. "torn" is set to true if an uncommitted record follows
+uint8_t const* STC_FLASHMEM FlashDictionary::getRecordsEnd(uint32_t sector, bool* torn)
 {
-    return (uint32_t)findKey(NULL) - (FLASH_MAP_START + FLASH_DICTIONARY_POS);
+    uint8_t const* sectorEnd = getSectorPtr(sector) + SPI_FLASH_SEC_SIZE;
+    uint8_t const* record = getSectorPtr(sector) + SECTORHEADER_SIZE;
+    while (record + RECORDHEADER_SIZE <= sectorEnd)
+    {
+        // already aligned, can be read directly from Flash
+        uint32_t const* header = (uint32_t const*)record;
+        uint8_t const* next = getNextRecord(record);
+        if (header[1] != COMMITTED || (header[0] & 0xFF) == 0xFF || next > sectorEnd)
+        {
+            if (torn)
+                *torn = (header[0] != 0xFFFFFFFF || header[1] != 0xFFFFFFFF);
+            return record;
+        }
+        record = next;
+    }
+    if (torn)
+        *torn = false;
+    return record;
+}
+
+
+// return latest committed record with the specified key or NULL
+uint8_t const* STC_FLASHMEM FlashDictionary::findRecord(uint32_t sector, char const* key, uint32_t keyLength)
+{
+    uint8_t const* result = NULL;
+    uint8_t const* recordsEnd = getRecordsEnd(sector);
+    for (uint8_t const* record = getSectorPtr(sector) + SECTORHEADER_SIZE; record != recordsEnd; record = getNextRecord(record))
+        if (isRecordKey(record, key, keyLength))
+            result = record;
+    return result;
+}
+
+
+bool STC_FLASHMEM FlashDictionary::isRecordKey(uint8_t const* record, char const* key, uint32_t keyLength)
+{
+    return (*(uint32_t const*)record & 0xFF) == keyLength && f_memcmp(record + RECORDHEADER_SIZE, key, keyLength) == 0;
+}
+
+
+// true if no records with the same key follow
+bool STC_FLASHMEM FlashDictionary::isLatestRecord(uint8_t const* record, uint8_t const* recordsEnd)
+{
+    char const* key = (char const*)(record + RECORDHEADER_SIZE);
+    uint32_t keyLength = *(uint32_t const*)record & 0xFF;
+    for (uint8_t const* next = getNextRecord(record); next != recordsEnd; next = getNextRecord(next))
+        if (isRecordKey(next, key, keyLength))
+            return false;
+    return true;
+}
+
+
+uint32_t STC_FLASHMEM FlashDictionary::getRecordSize(uint32_t keyLength, uint32_t valueLength)
+{
+    return RECORDHEADER_SIZE + ((keyLength + 1 + 3) & ~3) + ((valueLength + 3) & ~3);
+}
+
+
+// writes and commits a record at flash address (must be erased)
+void STC_FLASHMEM FlashDictionary::writeRecord(uint32_t address, char const* key, uint32_t keyLength, void const* value, uint32_t valueLength)
+{
+    {
+        FlashDictionaryWriter writer(address);
+        writer.writeDWord(keyLength | 0xFF00 | (valueLength << 16));
+        writer.writeDWord(0xFFFFFFFF);     // state, written below
+        writer.write(key, keyLength + 1);
+        writer.pad();
+        writer.write(value, valueLength);
+    }
+    // commit
+    uint32 state = COMMITTED;
+    Critical critical;
+    spi_flash_write(address + 4, &state, sizeof(state));
+}
+
+
+void STC_FLASHMEM FlashDictionary::writeSectorHeader(uint32_t sector, uint32_t sequence)
+{
+    uint32 header[2] = { MAGIC, sequence };
+    Critical critical;
+    spi_flash_write(FLASH_DICTIONARY_POS + sector * SPI_FLASH_SEC_SIZE, header, sizeof(header));
+}
+
+
+// copies latest records (excluding "key") from sector to the erased destSector
+// return false if the copied records and "freeSize" bytes don't fit, otherwise return in "address" the next free position
+bool STC_FLASHMEM FlashDictionary::compact(uint32_t sector, uint32_t destSector, char const* key, uint32_t keyLength, uint32_t freeSize, uint32_t* address)
+{
+    uint8_t const* recordsStart = getSectorPtr(sector) + SECTORHEADER_SIZE;
+    uint8_t const* recordsEnd   = getRecordsEnd(sector);
+    
+    // check available space
+    uint32_t size = freeSize;
+    for (uint8_t const* record = recordsStart; record != recordsEnd; record = getNextRecord(record))
+        if (!isRecordKey(record, key, keyLength) && isLatestRecord(record, recordsEnd))
+            size += getNextRecord(record) - record;
+    if (size > getTotalSpace())
+        return false;
+    
+    {
+        Critical critical;
+        spi_flash_erase_sector(FLASH_DICTIONARY_POS / SPI_FLASH_SEC_SIZE + destSector);
+    }
+    
+    *address = FLASH_DICTIONARY_POS + destSector * SPI_FLASH_SEC_SIZE + SECTORHEADER_SIZE;
+    for (uint8_t const* record = recordsStart; record != recordsEnd; record = getNextRecord(record))
+    {
+        if (!isRecordKey(record, key, keyLength) && isLatestRecord(record, recordsEnd))
+        {
+            uint32_t header = *(uint32_t const*)record;
+            uint32_t recordKeyLength = header & 0xFF;
+            writeRecord(*address, (char const*)(record + RECORDHEADER_SIZE), recordKeyLength, record + getRecordSize(recordKeyLength, 0), header >> 16);
+            *address += getNextRecord(record) - record;
+        }
+    }
+    return true;
+}
+
+
+// converts a MAGIC_V1 dictionary (first sector) into the second sector
+// V1 content:
+//   dword: MAGIC_V1
+//   byte: key length (or 0xFF for end of keys, hence starting of free space). Doesn't include ending zero
+//   ....: key string
+//   0x00: key ending zero
+//   word: value length (little endian)
+//   ....: value data
+// Records which don't fit (V1 records are smaller) are lost
+void STC_FLASHMEM FlashDictionary::convertV1()
+{
+    {
+        Critical critical;
+        spi_flash_erase_sector(FLASH_DICTIONARY_POS / SPI_FLASH_SEC_SIZE + 1);
+    }
+    uint8_t const* curpos = getSectorPtr(0) + sizeof(MAGIC_V1);
+    uint8_t const* end    = getSectorPtr(1);
+    uint32_t address = FLASH_DICTIONARY_POS + SPI_FLASH_SEC_SIZE + SECTORHEADER_SIZE;
+    uint32_t freeSpace = getTotalSpace();
+    while (curpos < end)
+    {
+        uint8_t keyLength = getByte(curpos);   // keyLength doesn't include ending zero
+        if (keyLength == 0xFF)
+            break;
+        char const* key = (char const*)(curpos + 1);
+        curpos += 1 + keyLength + 1;           // 1 (keyLength field) + keyLength + 1 (ending zero)
+        uint32_t valueLength = getWord(curpos);
+        uint32_t recordSize = getRecordSize(keyLength, valueLength);
+        if (recordSize > freeSpace)
+            break;
+        writeRecord(address, key, keyLength, curpos + 2, valueLength);
+        address   += recordSize;
+        freeSpace -= recordSize;
+        curpos    += 2 + valueLength;          // 2 (valueLength field) + valueLength
+    }
+    writeSectorHeader(1, 1);
 }
 
 
@@ -37,6 +37,7 @@ namespace fdv
 //////////////////////////////////////////////////////////////////////
 // VectorBase
 // A non-template vector
+// add() and insert() return false (leaving the vector unchanged) when out of memory
 // Max item size: 65535 bytes
 // Max items: 65535
 
@@ -46,9 +47,10 @@ public:
     VectorBase(uint16_t itemSize);
     VectorBase(VectorBase const& c);
     ~VectorBase();
-    void add(void const* item);
-    void insert(uint32_t position, void const* item);
+    bool add(void const* item);
+    bool insert(uint32_t position, void const* item);
     void remove(uint32_t position);
+    void removeLast();
     int32_t indexof(void const* item);
     void clear();
     uint32_t size();
@@ -56,7 +58,7 @@ public:
     void operator=(VectorBase const& c);
     
 private:
-    void allocate(uint32_t itemsCount);    
+    bool allocate(uint32_t itemsCount);    
     
 private:
     uint16_t m_itemSize;
@@ -79,14 +81,14 @@ public:
     {
     }
     
-    void add(T const& value)
+    bool add(T const& value)
     {
-        m_data.add(&value);
+        return m_data.add(&value);
     }
     
-    void insert(uint32_t position, T const& value)
+    bool insert(uint32_t position, T const& value)
     {
-        m_data.insert(position, &value);
+        return m_data.insert(position, &value);
     }
     
     void remove(uint32_t position)
@@ -94,6 +96,11 @@ public:
         m_data.remove(position);
     }
     
+    void removeLast()
+    {
+        m_data.removeLast();
+    }
+    
     int32_t indexof(T const& value)
     {
         return m_data.indexof(&value);
@@ -140,9 +147,8 @@ public:
     
     T pop()
     {
-        uint32_t lastIndex = m_data.size() - 1;
-        T ret = m_data[lastIndex];
-        m_data.remove(lastIndex);
+        T ret = m_data.last();
+        m_data.removeLast();
         return ret;
     }
     
@@ -176,7 +182,7 @@ class List
 {
 public:
     List()
-        : m_first(NULL)
+        : m_first(NULL), m_last(NULL)
     {
     }
     
@@ -194,19 +200,23 @@ public:
             reinterpret_cast<T*>(cur->value)->~T();   // destruct value
             delete cur;
         }
-        m_first = NULL;
+        m_first = m_last = NULL;
     }
     
     T* add()
     {
         Item* item = new Item;
         item->next = NULL;
-        *getPtrOfLastNext() = item;
+        if (m_last)
+            m_last->next = item;
+        else
+            m_first = item;
+        m_last = item;
         return new(&item->value[0]) T;  // placement new into value[] array
     }
         
 private:
-    struct Item
+    struct Item : SlabAllocated
     {
         Item*   next;
         uint8_t value[sizeof(T)];
@@ -265,25 +275,605 @@ public:
     }
 
 private:
+    List(List const& c);    // no copy constructor
     
-    Item** getPtrOfLastNext()
+    Item* m_first;
+    Item* m_last;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// SmallVector
+// A vector which stores up to INLINECAPACITY items inside the object. The heap is used only when it grows larger.
+// Like Vector, items are moved using memcpy and never constructed or destructed (use it for pointers and POD types).
+// Max items: 65535
+
+template <typename T, uint32_t INLINECAPACITY>
+class SmallVector
+{
+public:
+    SmallVector()
+        : m_count(0), m_capacity(INLINECAPACITY), m_heap(NULL)
     {
-        Item* cur = m_first;
-        while (cur && cur->next)
-            cur = cur->next;
-        return cur? &cur->next : &m_first;
     }
     
-    Item* m_first;
+    SmallVector(SmallVector const& c)
+        : m_count(0), m_capacity(INLINECAPACITY), m_heap(NULL)
+    {
+        *this = c;
+    }
+    
+    ~SmallVector()
+    {
+        clear();
+    }
+    
+    // allocates only when c doesn't fit into current capacity
+    SmallVector& operator=(SmallVector const& c)
+    {
+        if (this != &c)
+        {
+            m_count = 0;
+            reserve(c.m_count);
+            memcpy(getData(), c.getData(), sizeof(T) * c.m_count);
+            m_count = c.m_count;
+        }
+        return *this;
+    }
+    
+    void add(T const& value)
+    {
+        if (m_count == m_capacity)
+            reserve(m_capacity * 2);
+        getData()[m_count++] = value;
+    }
+    
+    void insert(uint32_t position, T const& value)
+    {
+        if (m_count == m_capacity)
+            reserve(m_capacity * 2);
+        T* data = getData();
+        memmove(data + position + 1, data + position, sizeof(T) * (m_count - position));
+        data[position] = value;
+        ++m_count;
+    }
+    
+    void remove(uint32_t position)
+    {
+        T* data = getData();
+        memmove(data + position, data + position + 1, sizeof(T) * (m_count - position - 1));
+        --m_count;
+    }
+    
+    void removeLast()
+    {
+        --m_count;
+    }
+    
+    // removes all items and frees heap memory
+    void clear()
+    {
+        if (m_heap)
+            Memory::free(m_heap);
+        m_heap = NULL;
+        m_count = 0;
+        m_capacity = INLINECAPACITY;
+    }
+    
+    // ensures space for "capacity" items
+    void reserve(uint32_t capacity)
+    {
+        if (capacity > m_capacity)
+        {
+            T* newHeap = (T*)Memory::malloc(sizeof(T) * capacity);
+            memcpy(newHeap, getData(), sizeof(T) * m_count);
+            if (m_heap)
+                Memory::free(m_heap);
+            m_heap = newHeap;
+            m_capacity = capacity;
+        }
+    }
+    
+    uint32_t size() const
+    {
+        return m_count;
+    }
+    
+    T& operator[](uint32_t position)
+    {
+        return getData()[position];
+    }
+    
+    T& last()
+    {
+        return getData()[m_count - 1];
+    }
+    
+private:
+    T* getData() const
+    {
+        return m_heap? m_heap : (T*)m_inline;
+    }
+    
+    uint16_t m_count;
+    uint16_t m_capacity;
+    T*       m_heap;                                            // NULL while items stay in m_inline
+    uint32_t m_inline[(sizeof(T) * INLINECAPACITY + 3) / 4];    // word aligned inline items
+};
+
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// Intrusive containers
+// Items contain the links (derive them from IntrusiveSNode<T> or IntrusiveNode<T>), so containers never allocate
+// and all operations are O(1). Only the doubly linked IntrusiveList can remove items from the middle.
+// Containers don't own items: clear() just forgets them. An item can stay in one container at a time.
+// These containers aren't task safe.
+//
+// Example:
+//   struct Job : IntrusiveSNode<Job> { ... };
+//   IntrusiveFIFO<Job> jobs;
+//   jobs.push(new Job);
+//   Job* job = jobs.pop();  // NULL when empty
+
+template <typename T>
+struct IntrusiveSNode
+{
+    T* next;
+    
+    IntrusiveSNode()
+        : next(NULL)
+    {
+    }
+};
+
+
+template <typename T>
+struct IntrusiveNode
+{
+    T* next;
+    T* prev;
+    
+    IntrusiveNode()
+        : next(NULL), prev(NULL)
+    {
+    }
+};
+
+
+// Singly linked list with tail pointer. T must derive from IntrusiveSNode<T>.
+template <typename T>
+class IntrusiveSList
+{
+public:
+    IntrusiveSList()
+        : m_first(NULL), m_last(NULL), m_count(0)
+    {
+    }
+    
+    void pushFront(T* item)
+    {
+        item->next = m_first;
+        m_first = item;
+        if (m_last == NULL)
+            m_last = item;
+        ++m_count;
+    }
+    
+    void pushBack(T* item)
+    {
+        item->next = NULL;
+        if (m_last)
+            m_last->next = item;
+        else
+            m_first = item;
+        m_last = item;
+        ++m_count;
+    }
+    
+    // returns NULL if empty
+    T* popFront()
+    {
+        T* item = m_first;
+        if (item)
+        {
+            m_first = item->next;
+            if (m_first == NULL)
+                m_last = NULL;
+            item->next = NULL;
+            --m_count;
+        }
+        return item;
+    }
+    
+    T* getFirst()
+    {
+        return m_first;
+    }
+    
+    T* getLast()
+    {
+        return m_last;
+    }
+    
+    uint32_t size()
+    {
+        return m_count;
+    }
+    
+    bool isEmpty()
+    {
+        return m_first == NULL;
+    }
+    
+    void clear()
+    {
+        m_first = m_last = NULL;
+        m_count = 0;
+    }
+    
+private:
+    IntrusiveSList(IntrusiveSList const& c);    // no copy constructor
+    
+    T*       m_first;
+    T*       m_last;
+    uint32_t m_count;
+};
+
+
+// Doubly linked list. T must derive from IntrusiveNode<T>.
+template <typename T>
+class IntrusiveList
+{
+public:
+    IntrusiveList()
+        : m_first(NULL), m_last(NULL), m_count(0)
+    {
+    }
+    
+    void pushFront(T* item)
+    {
+        item->prev = NULL;
+        item->next = m_first;
+        if (m_first)
+            m_first->prev = item;
+        else
+            m_last = item;
+        m_first = item;
+        ++m_count;
+    }
+    
+    void pushBack(T* item)
+    {
+        item->next = NULL;
+        item->prev = m_last;
+        if (m_last)
+            m_last->next = item;
+        else
+            m_first = item;
+        m_last = item;
+        ++m_count;
+    }
+    
+    // returns NULL if empty
+    T* popFront()
+    {
+        T* item = m_first;
+        if (item)
+            remove(item);
+        return item;
+    }
+    
+    // returns NULL if empty
+    T* popBack()
+    {
+        T* item = m_last;
+        if (item)
+            remove(item);
+        return item;
+    }
+    
+    // item must be in this list
+    void remove(T* item)
+    {
+        if (item->prev)
+            item->prev->next = item->next;
+        else
+            m_first = item->next;
+        if (item->next)
+            item->next->prev = item->prev;
+        else
+            m_last = item->prev;
+        item->next = item->prev = NULL;
+        --m_count;
+    }
+    
+    T* getFirst()
+    {
+        return m_first;
+    }
+    
+    T* getLast()
+    {
+        return m_last;
+    }
+    
+    uint32_t size()
+    {
+        return m_count;
+    }
+    
+    bool isEmpty()
+    {
+        return m_first == NULL;
+    }
+    
+    void clear()
+    {
+        m_first = m_last = NULL;
+        m_count = 0;
+    }
+    
+private:
+    IntrusiveList(IntrusiveList const& c);    // no copy constructor
+    
+    T*       m_first;
+    T*       m_last;
+    uint32_t m_count;
+};
+
+
+// First-in first-out queue. T must derive from IntrusiveSNode<T>.
+template <typename T>
+class IntrusiveFIFO
+{
+public:
+    void push(T* item)
+    {
+        m_list.pushBack(item);
+    }
+    
+    // returns NULL if empty
+    T* pop()
+    {
+        return m_list.popFront();
+    }
+    
+    // returns NULL if empty
+    T* peek()
+    {
+        return m_list.getFirst();
+    }
+    
+    uint32_t size()
+    {
+        return m_list.size();
+    }
+    
+    bool isEmpty()
+    {
+        return m_list.isEmpty();
+    }
+    
+    void clear()
+    {
+        m_list.clear();
+    }
+    
+private:
+    IntrusiveSList<T> m_list;
+};
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// ByteRing
+// Lock free single producer / single consumer bytes ring. Producer and consumer can be an ISR and a task.
+// Only the producer moves m_head, only the consumer moves m_tail. Indexes run freely and wrap at 2^32.
+// The size is rounded up to a power of two.
+
+class ByteRing
+{
+public:
+    explicit ByteRing(uint32_t size);
+    ~ByteRing();
+    
+    // producer side
+    
+    // returns false when full (value is discarded)
+    bool put(uint8_t value)
+    {
+        uint32_t head = m_head;
+        if (head - m_tail > m_mask)
+            return false;
+        m_buffer[head & m_mask] = value;
+        barrier();
+        m_head = head + 1;
+        return true;
+    }
+    
+    uint32_t put(uint8_t const* buffer, uint32_t length); // returns bytes written
+    
+    uint32_t getFree()
+    {
+        return m_mask + 1 - (m_head - m_tail);
+    }
+    
+    // consumer side
+    
+    // returns -1 when empty
+    int16_t get()
+    {
+        uint32_t tail = m_tail;
+        if (tail == m_head)
+            return -1;
+        uint8_t value = m_buffer[tail & m_mask];
+        barrier();
+        m_tail = tail + 1;
+        return value;
+    }
+    
+    // returns -1 when empty
+    int16_t peek()
+    {
+        uint32_t tail = m_tail;
+        return tail == m_head? -1 : m_buffer[tail & m_mask];
+    }
+    
+    uint32_t get(uint8_t* buffer, uint32_t length);       // returns bytes read
+    
+    uint32_t available()
+    {
+        return m_head - m_tail;
+    }
+    
+    // discards all bytes
+    void clear()
+    {
+        m_tail = m_head;
+    }
+    
+private:
+    ByteRing(ByteRing const& c);    // no copy constructor
+    
+    // buffer accesses must be completed before indexes change
+    static void barrier()
+    {
+        __asm__ __volatile__("" : : : "memory");
+    }
+    
+    uint8_t*          m_buffer;
+    uint32_t          m_mask;
+    uint32_t volatile m_head;       // next write position
+    uint32_t volatile m_tail;       // next read position
 };
 
 
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// SharedBuffer
+// A reference counted RAM buffer. Data is allocated together with the counter.
+// create() returns a buffer with one reference (NULL when out of memory), the last release() frees it.
+// References can be added and released by different tasks. Small buffers are allocated by Slab.
+
+struct SharedBuffer
+{
+    static SharedBuffer* create(uint32_t size);
+    
+    char* getData()
+    {
+        return (char*)(this + 1);
+    }
+    
+    uint32_t getSize()
+    {
+        return m_size;
+    }
+    
+    void addRef();
+    void release();
+    
+private:
+    SharedBuffer();    // use create()
+    
+    uint32_t m_refCount;
+    uint32_t m_size;
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// CharSlice
+// A span of chars which is safe to copy and to keep.
+// Data is referenced from a SharedBuffer (kept alive until the last slice is destroyed) or
+// from static data in RAM or Flash (string literals, FSTR(), globals), which is never freed.
+// Use copy() for data with shorter lifetime (stack, heap, received buffers).
+// Slices created by copy() and format() are zero terminated. When out of memory they return a null slice
+// (see isNull()).
+
+struct CharSlice
+{
+    CharSlice()
+        : m_buffer(NULL), m_data(NULL), m_length(0)
+    {
+    }
+    
+    // static data (RAM or Flash), not copied
+    CharSlice(char const* str);
+    CharSlice(char const* data, uint32_t length);
+    
+    // data must stay inside buffer. Adds a reference to buffer.
+    CharSlice(SharedBuffer* buffer, char const* data, uint32_t length);
+    
+    CharSlice(CharSlice const& c);
+    
+    ~CharSlice();
+    
+    CharSlice& operator=(CharSlice const& c);
+    
+    // data can stay in RAM or Flash
+    static CharSlice copy(char const* data, uint32_t length);
+    
+    // like printf
+    static CharSlice format(char const* fmt, ...);
+    
+    template <typename Iterator>
+    static CharSlice TMTD_FLASHMEM copy(Iterator begin, Iterator end)
+    {
+        uint32_t length = end - begin;
+        CharSlice slice = alloc(length);
+        if (slice.m_buffer)
+            t_memcpy(slice.m_buffer->getData(), begin, length);
+        return slice;
+    }
+    
+    char const* getData() const
+    {
+        return m_data;
+    }
+    
+    uint32_t getLength() const
+    {
+        return m_length;
+    }
+    
+    // true for default constructed slices and when copy() or format() are out of memory
+    bool isNull() const
+    {
+        return m_data == NULL;
+    }
+    
+    // NULL for static data
+    SharedBuffer* getBuffer() const
+    {
+        return m_buffer;
+    }
+    
+    // shares the same data
+    CharSlice sub(uint32_t start, uint32_t length) const;
+    
+private:
+    // allocates length + 1 chars (the ending zero is already set). Returns a null slice when out of memory
+    static CharSlice alloc(uint32_t length);
+    
+    SharedBuffer* m_buffer;
+    char const*   m_data;
+    uint32_t      m_length;
+};
+
+
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // CharChunk
 
 
-struct CharChunkBase
+struct CharChunkBase : SlabAllocated
 {
     CharChunkBase* next;
     char*          data;
@@ -352,8 +942,8 @@ struct CharChunkAllocated : public CharChunkOwn<TYPE_V, SIZE_T>
 
 
 typedef CharChunkAllocated<6, uint8_t> CharChunkAllocated8;
-typedef CharChunkAllocated<7, uint8_t> CharChunkAllocated16;
-typedef CharChunkAllocated<8, uint8_t> CharChunkAllocated32;
+typedef CharChunkAllocated<7, uint16_t> CharChunkAllocated16;
+typedef CharChunkAllocated<8, uint32_t> CharChunkAllocated32;
 
 
 struct CharChunkLink : public CharChunkBase
@@ -368,15 +958,41 @@ struct CharChunkLink : public CharChunkBase
     {        
     }
 } __attribute__((packed));
+
+
+// holds a reference to the SharedBuffer of a CharSlice
+struct CharChunkShared : public CharChunkBase
+{
+    static uint8_t const TYPE = 10;
+    
+    uint32_t      items;
+    SharedBuffer* buffer;
+    
+    CharChunkShared(CharSlice const& slice)
+        : CharChunkBase(NULL, (char*)slice.getData(), TYPE), items(slice.getLength()), buffer(slice.getBuffer())
+    {
+        buffer->addRef();
+    }
+    
+    ~CharChunkShared()
+    {
+        buffer->release();
+    }
+} __attribute__((packed));
     
 
     
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // CharChunksIterator
+//
+// Chunks following a CharChunkLink are kept in a stack. First INLINEDEPTH levels stay inside the iterator,
+// so copying an iterator doesn't allocate unless links are nested deeper than INLINEDEPTH.
 
 struct CharChunksIterator
 {
+    static uint32_t const INLINEDEPTH = 4;
+    
 	CharChunksIterator(CharChunkBase* chunk = NULL);
     CharChunksIterator(CharChunksIterator const& c);
     CharChunksIterator& operator=(CharChunksIterator const& c);
@@ -399,10 +1015,10 @@ private:
     void checkLinkedChunks();
 
 private:
-	CharChunkBase*        m_chunk;
-	uint32_t              m_pos;  	   // position inside this chunk
-	uint32_t              m_absPos;    // absolute position (starting from beginning of LinkedCharChunks)
-    Stack<CharChunkBase*> m_linkedNext;
+	CharChunkBase*                            m_chunk;
+	uint32_t                                  m_pos;      // position inside this chunk
+	uint32_t                                  m_absPos;   // absolute position (starting from beginning of LinkedCharChunks)
+    SmallVector<CharChunkBase*, INLINEDEPTH>  m_linked;   // stack of chunks to continue with after a link
 };
 
 
@@ -414,16 +1030,18 @@ private:
 
 struct LinkedCharChunks
 {	
+    static uint32_t const MINCHUNKSIZE = 16;    // first chunk allocated by append()
+    static uint32_t const MAXCHUNKSIZE = 1024;  // append() doubles chunks size up to this value
 	
 	LinkedCharChunks()
-		: m_chunks(NULL), m_current(NULL)
+		: m_chunks(NULL), m_current(NULL), m_itemsBeforeCurrent(0)
 	{
 	}
 	
 	// copy constructor
 	// Only data pointers are copied and they will be not freed
 	LinkedCharChunks(LinkedCharChunks& c)
-		: m_chunks(NULL), m_current(NULL)
+		: m_chunks(NULL), m_current(NULL), m_itemsBeforeCurrent(0)
 	{
         *this = c;
 	}
@@ -439,8 +1057,11 @@ struct LinkedCharChunks
 	CharChunkBase* addChunk(char* data, uint32_t items, bool freeOnDestroy);
 	CharChunkBase* addChunk(char const* data, uint32_t items, bool freeOnDestroy);
 	void addChunk(char const* str, bool freeOnDestroy = false);
+	CharChunkBase* addChunk(CharSlice const& slice);
 	void addChunks(LinkedCharChunks* src);
-	void append(char value, uint32_t newChunkSize = 1);
+	void append(char value, uint32_t newChunkSize = 0);
+	void append(char const* data, uint32_t length);
+	void reserve(uint32_t length);
     CharChunkBase* getFirstChunk();
 	CharChunksIterator getIterator();
 	uint32_t getItemsCount() const;
@@ -449,8 +1070,12 @@ struct LinkedCharChunks
     void operator=(LinkedCharChunks& c);
 
 private:
+    uint32_t getFreeSpace();
+    uint32_t getNextChunkSize(uint32_t minSize);
+
 	CharChunkBase* m_chunks;
-	CharChunkBase* m_current;
+	CharChunkBase* m_current;              // last chunk
+	uint32_t       m_itemsBeforeCurrent;   // items of all chunks except m_current
 };
 
 
@@ -465,6 +1090,7 @@ struct CharChunkFactory
     static CharChunkBase* createCharChunkOwn(char* data, uint32_t items);
     static CharChunkBase* createCharChunkAllocated(uint32_t capacity);
     static CharChunkBase* createCharChunkLink(LinkedCharChunks* link);
+    static CharChunkBase* createCharChunkShared(CharSlice const& slice);
     
     // this to avoid virtual destructors usage
     static void deleteCharChunk(CharChunkBase* chunk);
@@ -472,6 +1098,48 @@ struct CharChunkFactory
 
 
 
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// HashIndex
+// Open addressing (linear probing) hash index of entries numbered in insertion order (0, 1, 2...).
+// The owner keeps the entries and compares keys: find() only returns entries having the same hash.
+// Up to SMALLSIZE entries no table is allocated and find() scans the hashes.
+// Memory: 4 bytes per entry, plus 2 bytes per slot when larger than SMALLSIZE (load factor <= 3/4).
+// Max entries: 65535
+//
+// Example:
+//   uint32_t cursor = 0;
+//   for (uint32_t i = index.find(hash, &cursor); i != HashIndex::NOTFOUND; i = index.find(hash, &cursor))
+//     if (entries[i] has the searched key) ...
+
+class HashIndex
+{
+public:
+    static uint32_t const NOTFOUND  = 0xFFFFFFFF;
+    static uint32_t const SMALLSIZE = 8;
+    
+    HashIndex();
+    ~HashIndex();
+    bool add(uint32_t hash);    // the new entry gets index size(). Returns false (index unchanged) when out of memory
+    uint32_t find(uint32_t hash, uint32_t* cursor); // *cursor must be 0 at first call
+    void clear();
+    uint32_t size();
+    
+private:
+    HashIndex(HashIndex const& c);  // no copy constructor
+    
+    void insertSlot(uint32_t index);
+    bool rebuildSlots(uint32_t slotsCount);
+    
+    uint32_t* m_hashes;
+    uint16_t* m_slots;          // entry index + 1, 0 = empty slot
+    uint16_t  m_count;
+    uint16_t  m_hashesAllocated;
+    uint16_t  m_slotsCount;     // power of two
+};
+
+
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // IterDict
@@ -482,26 +1150,25 @@ class IterDict
 {
 public:
 
-	struct Item
+	struct Item : SlabAllocated
 	{
-		Item*         next;
 		KeyIterator   key;
 		KeyIterator   keyEnd;		
 		ValueIterator value;
 		ValueIterator valueEnd;
-		APtr<char>    valueStr;	// dynamically allocated zero terminated value string (created by operator[])
+		CharSlice     valueStr;	// dynamically allocated zero terminated value string (created by getSlice())
 		
 		Item(KeyIterator key_, KeyIterator keyEnd_, ValueIterator value_, ValueIterator valueEnd_)
-			: next(NULL), key(key_), keyEnd(keyEnd_), value(value_), valueEnd(valueEnd_)
+			: key(key_), keyEnd(keyEnd_), value(value_), valueEnd(valueEnd_)
 		{
 		}
 		Item()
-			: next(NULL), key(KeyIterator()), keyEnd(KeyIterator()), value(ValueIterator()), valueEnd(ValueIterator())
+			: key(KeyIterator()), keyEnd(KeyIterator()), value(ValueIterator()), valueEnd(ValueIterator())
 		{
 		}
 		bool TMTD_FLASHMEM operator==(Item const& rhs)
 		{
-			return next == rhs.next && key == rhs.key && keyEnd == rhs.keyEnd && value == rhs.value && valueEnd == rhs.valueEnd;
+			return key == rhs.key && keyEnd == rhs.keyEnd && value == rhs.value && valueEnd == rhs.valueEnd;
 		}
 		bool TMTD_FLASHMEM operator!=(Item const& rhs)
 		{
@@ -510,7 +1177,7 @@ public:
 	};
 
 	IterDict()
-		: m_items(NULL), m_current(NULL), m_itemsCount(0), m_urlDecode(false)
+		: m_urlDecode(false)
 	{
 	}
 	
@@ -521,29 +1188,16 @@ public:
 	
 	void TMTD_FLASHMEM clear()
 	{
-		Item* item = m_items;
-		while (item)
-		{
-			Item* next = item->next;
-			delete item;
-			item = next;
-		}
-		m_items = m_current = NULL;
-		m_itemsCount = 0;
+		for (uint32_t i = 0; i != m_items.size(); ++i)
+			delete m_items[i];
+		m_items.clear();
+		m_index.clear();
 	}
 	
 	void TMTD_FLASHMEM add(KeyIterator key, KeyIterator keyEnd, ValueIterator value, ValueIterator valueEnd)
 	{
-		if (m_items)
-		{
-			m_current = m_current->next = new Item(key, keyEnd, value, valueEnd);
-			++m_itemsCount;
-		}
-		else
-		{
-			m_current = m_items = new Item(key, keyEnd, value, valueEnd);
-			++m_itemsCount;
-		}
+		m_items.add(new Item(key, keyEnd, value, valueEnd));
+		m_index.add(t_hash(key, keyEnd));
 	}
 	
 	// key and value must terminate with a Zero
@@ -562,28 +1216,25 @@ public:
     
 	uint32_t TMTD_FLASHMEM getItemsCount()
 	{
-		return m_itemsCount;
+		return m_items.size();
 	}
 	
+	// items are in insertion order
 	// warn: this doesn't check "index" range!
 	Item* TMTD_FLASHMEM getItem(uint32_t index)
 	{
-		Item* item = m_items;
-		for (; index > 0; --index)
-			item = item->next;
-		return item;
+		return m_items[index];
 	}
 
 	// key stay in RAM or Flash
+	// returns the first inserted item with this key
 	Item* TMTD_FLASHMEM getItem(char const* key, char const* keyEnd)
 	{
-		Item* item = m_items;
-		while (item)
-		{
-			if (t_compare(item->key, item->keyEnd, CharIterator(key), CharIterator(keyEnd)))
-				return item;	// found
-			item = item->next;
-		}
+		uint32_t cursor = 0;
+		uint32_t hash = t_hash(CharIterator(key), CharIterator(keyEnd));
+		for (uint32_t i = m_index.find(hash, &cursor); i != HashIndex::NOTFOUND; i = m_index.find(hash, &cursor))
+			if (t_compare(m_items[i]->key, m_items[i]->keyEnd, CharIterator(key), CharIterator(keyEnd)))
+				return m_items[i];	// found
 		return NULL;	// not found
 	}
 	
@@ -594,22 +1245,33 @@ public:
 	}
 		
 	// key can stay in RAM or Flash and must terminate with zero
-	// creates a RAM stored temporary (with the same lifetime of IterDict class) zero terminated string with the value content
-	// if m_urlDecode is true then the temporary in RAM string is url decoded
-	char const* TMTD_FLASHMEM operator[](char const* key)
+	// creates (once) a RAM stored zero terminated string with the value content. It is shared, so the
+	// returned slice can be kept after IterDict is destroyed.
+	// if m_urlDecode is true then the in RAM string is url decoded
+	CharSlice TMTD_FLASHMEM getSlice(char const* key)
 	{
 		Item* item = getItem(key, key + f_strlen(key));
 		if (item)
 		{
-			if (item->valueStr.get() == NULL)
+			if (item->valueStr.getBuffer() == NULL)
 			{
-				item->valueStr.reset(t_strdup(item->value, item->valueEnd));
+				CharSlice valueStr = CharSlice::copy(item->value, item->valueEnd);
+				if (valueStr.isNull())
+					return valueStr;	// out of memory, retried at next call
 				if (m_urlDecode)
-					inplaceURLDecode(item->valueStr.get());
+					valueStr = valueStr.sub(0, f_strlen(inplaceURLDecode((char*)valueStr.getData())));
+				item->valueStr = valueStr;
 			}
-			return item->valueStr.get();
+			return item->valueStr;
 		}
-		return NULL;
+		return CharSlice();
+	}
+	
+	// key can stay in RAM or Flash and must terminate with zero
+	// returned string has the same lifetime of IterDict class (see getSlice())
+	char const* TMTD_FLASHMEM operator[](char const* key)
+	{
+		return getSlice(key).getData();
 	}
 	
 	void TMTD_FLASHMEM setUrlDecode(bool value)
@@ -621,7 +1283,7 @@ public:
     /*
 	void TMTD_FLASHMEM dump()
 	{
-		for (uint32_t i = 0; i != m_itemsCount; ++i)
+		for (uint32_t i = 0; i != m_items.size(); ++i)
 		{
 			Item* item = getItem(i);			
 			for (KeyIterator k = item->key; k != item->keyEnd; ++k)
@@ -635,11 +1297,11 @@ public:
     //*/	
 	
 private:
+	IterDict(IterDict const& c);	// no copy constructor
 	
-	Item*    m_items;
-	Item*    m_current;
-	uint32_t m_itemsCount;
-	bool     m_urlDecode;
+	Vector<Item*> m_items;
+	HashIndex     m_index;
+	bool          m_urlDecode;
 };
 
 
@@ -651,28 +1313,27 @@ private:
 template <typename T>
 struct ObjectDict
 {
-	struct Item
+	struct Item : SlabAllocated
 	{
-		Item*         next;
 		char const*   key;
 		char const*   keyEnd;
 		T             value;
 		
 		Item(char const* key_, char const* keyEnd_, T const& value_)
-			: next(NULL), key(key_), keyEnd(keyEnd_), value(value_)
+			: key(key_), keyEnd(keyEnd_), value(value_)
 		{
 		}
 		Item(char const* key_, char const* keyEnd_)
-			: next(NULL), key(key_), keyEnd(keyEnd_)
+			: key(key_), keyEnd(keyEnd_)
 		{
 		}
 		Item()
-			: next(NULL), key(NULL), keyEnd(NULL)
+			: key(NULL), keyEnd(NULL)
 		{
 		}
 		bool MTD_FLASHMEM operator==(Item const& rhs)
 		{
-			return next == rhs.next && key == rhs.key && keyEnd == rhs.keyEnd && value == rhs.value;
+			return key == rhs.key && keyEnd == rhs.keyEnd && value == rhs.value;
 		}
 		bool MTD_FLASHMEM operator!=(Item const& rhs)
 		{
@@ -681,7 +1342,6 @@ struct ObjectDict
 	};
 
 	ObjectDict()
-		: m_items(NULL), m_current(NULL), m_itemsCount(0)
 	{
 	}
 	
@@ -692,44 +1352,21 @@ struct ObjectDict
 	
 	void TMTD_FLASHMEM clear()
 	{
-		Item* item = m_items;
-		while (item)
-		{
-			Item* next = item->next;
-			delete item;
-			item = next;
-		}
-		m_items = m_current = NULL;
-		m_itemsCount = 0;
+		for (uint32_t i = 0; i != m_items.size(); ++i)
+			delete m_items[i];
+		m_items.clear();
+		m_index.clear();
 	}
 	
 	void TMTD_FLASHMEM add(char const* key, char const* keyEnd, T const& value)
 	{
-		if (m_items)
-		{
-			m_current = m_current->next = new Item(key, keyEnd, value);
-			++m_itemsCount;
-		}
-		else
-		{
-			m_current = m_items = new Item(key, keyEnd, value);
-			++m_itemsCount;
-		}
+		addItem(new Item(key, keyEnd, value));
 	}
 
     // same of before, but using default constructed value
 	void TMTD_FLASHMEM add(char const* key, char const* keyEnd)
 	{
-		if (m_items)
-		{
-			m_current = m_current->next = new Item(key, keyEnd);
-			++m_itemsCount;
-		}
-		else
-		{
-			m_current = m_items = new Item(key, keyEnd);
-			++m_itemsCount;
-		}
+		addItem(new Item(key, keyEnd));
 	}
 	
 	// add zero terminated string
@@ -742,27 +1379,31 @@ struct ObjectDict
 	T* TMTD_FLASHMEM add(char const* key)
 	{
         add(key, key + f_strlen(key));
-		return &(getItem(key)->value);
+		return &(m_items.last()->value);
 	}
 	
 	uint32_t TMTD_FLASHMEM getItemsCount()
 	{
-		return m_itemsCount;
+		return m_items.size();
+	}
+	
+	// items are in insertion order
+	// warn: this doesn't check "index" range!
+	Item* TMTD_FLASHMEM getItem(uint32_t index)
+	{
+		return m_items[index];
 	}
 	
 	// key stay in RAM or Flash
+	// returns the first inserted item with this key
 	Item* TMTD_FLASHMEM getItem(char const* key, char const* keyEnd)
 	{
-        // search into local dictionary
-		Item* item = m_items;
-		while (item)
-		{
-			if (t_compare(CharIterator(item->key), CharIterator(item->keyEnd), CharIterator(key), CharIterator(keyEnd)))
-				return item;	// found
-			item = item->next;
-		}
-        // not found
-		return NULL;	
+		uint32_t cursor = 0;
+		uint32_t hash = t_hash(CharIterator(key), CharIterator(keyEnd));
+		for (uint32_t i = m_index.find(hash, &cursor); i != HashIndex::NOTFOUND; i = m_index.find(hash, &cursor))
+			if (t_compare(CharIterator(m_items[i]->key), CharIterator(m_items[i]->keyEnd), CharIterator(key), CharIterator(keyEnd)))
+				return m_items[i];	// found
+		return NULL;	// not found
 	}
 	
 	// key stay in RAM or Flash
@@ -786,23 +1427,28 @@ struct ObjectDict
     /*
 	void TMTD_FLASHMEM dump()
 	{
-		Item* item = m_items;
-		while (item)
+		for (uint32_t i = 0; i != m_items.size(); ++i)
 		{
+			Item* item = m_items[i];
 			debugstrn(item->key, item->keyEnd - item->key);
 			debug(FSTR(" = "));
 			item->value.dump();
 			debug(FSTR("\r\n"));
-			item = item->next;
 		}
 	}
     */
 	
 private:
+	ObjectDict(ObjectDict const& c);	// no copy constructor
 	
-	Item*                  m_items;
-	Item*                  m_current;
-	uint32_t               m_itemsCount;
+	void TMTD_FLASHMEM addItem(Item* item)
+	{
+		m_items.add(item);
+		m_index.add(t_hash(CharIterator(item->key), CharIterator(item->keyEnd)));
+	}
+	
+	Vector<Item*> m_items;
+	HashIndex     m_index;
 };
 
 
@@ -810,11 +1456,19 @@ private:
 //////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 // FlashDictionary
-// Maximum one page (4096 bytes) of storage
+// Append-only log of key->value records stored in FLASH_DICTIONARY_SECTORS flash sectors (4096 bytes each)
+// Only one sector is active. Setting a value appends a new record to the active sector (latest record wins):
+// it is one small flash write, without erasing the sector and without page buffers.
+// When the active sector is full the latest records are compacted into the next sector (sectors rotate to spread the wear).
 // Maximum key length = 254 bytes
-// Maximum value length = 65536 bytes (actually less than 4096!)
+// Maximum value length = 4096 - 8 (sector header) - 8 (record header) - key length
 // All methods which accepts key and/or value allows Flash or RAM storage
 //
+// Power fail safety:
+//   - a record is valid only after its state dword has been written as COMMITTED
+//   - a compacted sector becomes active only after its header (MAGIC and sequence) has been written
+//   - the active sector is the valid sector with the highest sequence
+//
 // Examples:
 //   FlashDictionary::setString("name", "Fabrizio");
 //   debug("name = %s\r\n", FlashDictionary::getString("name", ""));
@@ -824,21 +1478,25 @@ private:
 //
 // No need to call eraseContent the first time because it is automatically called if MAGIC is not found
 // Call eraseContent only if you want to erase old dictionary
+// Single sector dictionaries (MAGIC_V1) are automatically converted
 
 struct FlashDictionary
 {	
-	static uint32_t const MAGIC = 0x46445631;
+	static uint32_t const MAGIC     = 0x46445632;
+	static uint32_t const MAGIC_V1  = 0x46445631;   // old single sector format
+	static uint32_t const COMMITTED = 0x00000000;   // record state. 0xFFFFFFFF (erased) = uncommitted
 	
-	// clear the entire available space and write MAGIC at the beginning of the dictionary
+	// clear all dictionary sectors and write MAGIC at the beginning of the first one
 	// This is required only if you want to remove previous content
-	// erase all values to 0xFF
 	static void eraseContent();
 
-	// requires 4K free heap to execute!
+	// appends a new record (nothing is written if the value is not changed)
+	// compacts the dictionary into the next sector when the active one is full
+	// does nothing if the record cannot fit
 	static void setValue(char const* key, void const* value, uint32_t valueLength);
 	
-	// return NULL if key point to a free space (aka key doesn't exist)
-	// return pointer may be Unaligned pointer to Flash
+	// return NULL if key doesn't exist
+	// return pointer is aligned pointer to Flash, valid until next setValue()
 	static uint8_t const* getValue(char const* key, uint32_t* valueLength = NULL);
 		
 	static void setString(char const* key, char const* value);
@@ -854,19 +1512,65 @@ struct FlashDictionary
 	
 	static bool getBool(char const* key, bool defaultValue);
 	
-	// return starting of specified key or starting of next free position
-	// what is stored:
-	//   byte: key length (or 0xFF for end of keys, hence starting of free space). Doesn't include ending zero
-	//   ....: key string
-	//   0x00: key ending zero
-	//   word: value length (little endian)
-	//   ....: value data
-	// automatically erase content if not already initialized
-	static void const* findKey(char const* key);
-	
 	static bool isContentValid();
 	
-	static uint32_t getUsedSpace();	
+	// bytes used by records of the active sector (including replaced records)
+	static uint32_t getUsedSpace();
+
+	// bytes available for records
+	static uint32_t getTotalSpace()
+	{
+		return SPI_FLASH_SEC_SIZE - SECTORHEADER_SIZE;
+	}
+
+private:
+
+	// what is stored at the beginning of each sector:
+	//   dword: MAGIC (other values mean erased or incomplete sector)
+	//   dword: sequence, incremented at each compaction
+	// then the records, all fields are 4 bytes aligned:
+	//   dword: key length (byte, 0xFF for free space. Doesn't include ending zero) | 0xFF (byte) | value length (word)
+	//   dword: state (COMMITTED when key and value have been completely written)
+	//   ....: key string and ending zero, padded to 4 bytes
+	//   ....: value data, padded to 4 bytes
+	static uint32_t const SECTORHEADER_SIZE = 8;
+	static uint32_t const RECORDHEADER_SIZE = 8;
+	
+	// return -1 if there isn't a valid sector
+	static int32_t findActiveSector(uint32_t* sequence);
+	
+	// automatically erase or convert content if not already initialized
+	static uint32_t getActiveSector(uint32_t* sequence = NULL);
+	
+	static uint8_t const* getSectorPtr(uint32_t sector);
+	
+	// return next committed record or the end of records (free space or uncommitted record)
+	static uint8_t const* getNextRecord(uint8_t const* record);
+	
+	// return end of committed records. "torn" is set to true if an uncommitted record follows
+	static uint8_t const* getRecordsEnd(uint32_t sector, bool* torn = NULL);
+	
+	// return latest committed record with the specified key or NULL
+	static uint8_t const* findRecord(uint32_t sector, char const* key, uint32_t keyLength);
+	
+	static bool isRecordKey(uint8_t const* record, char const* key, uint32_t keyLength);
+	
+	// true if no records with the same key follow
+	static bool isLatestRecord(uint8_t const* record, uint8_t const* recordsEnd);
+	
+	static uint32_t getRecordSize(uint32_t keyLength, uint32_t valueLength);
+	
+	// writes and commits a record at flash address (must be erased)
+	static void writeRecord(uint32_t address, char const* key, uint32_t keyLength, void const* value, uint32_t valueLength);
+	
+	static void writeSectorHeader(uint32_t sector, uint32_t sequence);
+	
+	// copies latest records (excluding "key") from sector to the erased destSector
+	// return false if the copied records and "freeSize" bytes don't fit, otherwise return in "address" the next free position
+	static bool compact(uint32_t sector, uint32_t destSector, char const* key, uint32_t keyLength, uint32_t freeSize, uint32_t* address);
+	
+	// converts a MAGIC_V1 dictionary (first sector) into the second sector
+	static void convertV1();
 };
 
 
@@ -877,8 +1581,8 @@ struct FlashDictionary
 // It is just a files extractor from the flash.
 // You can write files into the flash using "binarydir.py" (to prepare) and "esptool.py" (to flash) tools.
 // For example, having some files in webcontent subdirectory you can do:
-//   python binarydir.py webcontent webcontent.bin 57344
-//   python ../esptool.py --port COM7 write_flash 0x6C000 webcontent.bin
+//   python binarydir.py webcontent webcontent.bin 53248
+//   python ../esptool.py --port COM7 write_flash 0x6E000 webcontent.bin
 // Then you can use FlashFileSystem static methods to get actual files content
 //
 // At the top of files flash memory there is following magick:
@@ -895,6 +1599,25 @@ struct FlashDictionary
 //     x-bytes:  mime type data + zero
 //     x-bytes:  raw file data
 // All values are little-endian
+//
+// Version 2 images (read only, "binarydir.py webcontent webcontent.bin 53248 2") have a directory table at the
+// beginning, sorted by filename hash, and 4 bytes aligned fields and file data:
+//   ImageHeaderV2:
+//     uint32_t: MAGIC_V2 = 0x93841A02
+//     uint32_t: files count
+//     uint32_t: image size in bytes
+//     uint32_t: reserved (0)
+//   EntryV2 (files count times):
+//     uint32_t: filename hash (FNV-1a, see t_hash())
+//     uint32_t: file content hash (FNV-1a)
+//     uint32_t: filename offset (zero terminated)
+//     uint32_t: mime type offset (zero terminated, shared among files of the same type)
+//     uint32_t: file content offset (4 bytes aligned)
+//     uint32_t: file content length
+//     uint32_t: precomputed HTTP headers offset ("Name: value\r\n" lines, zero terminated). 0 = no headers
+//     uint32_t: flags (see ENTRYFLAG_...)
+//   strings and file contents
+// Offsets start from the image beginning. Files cannot be added or removed (FlashFile, remove()) in version 2 images.
 
 
 class FlashFile;
@@ -913,6 +1636,9 @@ class FlashFileSystem
             char const* mimetype;
             uint32_t    datalength;
             void const* data;
+            uint32_t    contenthash;    // 0 for version 1 images
+            char const* headers;        // precomputed HTTP headers. NULL for version 1 images
+            uint32_t    flags;          // ENTRYFLAG_... 0 for version 1 images
             
             Item()
                 : nextpos(NULL)
@@ -933,14 +1659,52 @@ class FlashFileSystem
         {
             return getBeginOfSDKSettings() - FLASHFILESYSTEM_PTR;
         }
+        
+        // 1 or 2. 0 = not formatted
+        static uint32_t getVersion();
+        
+        static uint32_t const ENTRYFLAG_TEMPLATE = 0x00000001;    // file is a template (tpl), only for version 2 images
     
     protected:
         static char const* getFreePos();
+        static void invalidateIndex();
     
     private:
-        static uint32_t const MAGIC = 0x93841A03;
+        static uint32_t const MAGIC    = 0x93841A03;
+        static uint32_t const MAGIC_V2 = 0x93841A02;
+        
+        struct Index;
+        
+        struct ImageHeaderV2
+        {
+            uint32_t magic;
+            uint32_t filesCount;
+            uint32_t imageSize;
+            uint32_t reserved;
+        };
+        
+        struct EntryV2
+        {
+            uint32_t nameHash;
+            uint32_t contentHash;
+            uint32_t nameOffset;
+            uint32_t mimeOffset;
+            uint32_t dataOffset;
+            uint32_t dataLength;
+            uint32_t headersOffset;
+            uint32_t flags;
+        };
     
         static char const* getBase();
+        static bool getNextV2(Item* item);
+        static bool findV2(char const* filename, Item* item);
+        static void getEntryV2(EntryV2 const* entry, Item* item);
+        static Index* getIndex();
+        static void releaseIndex(Index* index);
+        static uint32_t getFilenameHash(char const* filename);
+        
+        static Index* s_index;  // built at first find(), released when files change
+        static uint32_t s_indexGeneration;  // incremented by invalidateIndex()
 };
 
 
@@ -991,6 +1755,8 @@ class StringList
     public:
     
         enum Storage {Reference, Heap};
+        
+        static uint32_t const INLINEITEMS = 4;  // items stored without heap allocations
     
         StringList();
         ~StringList();
@@ -1018,7 +1784,7 @@ class StringList
             }
         };
         
-        Vector<Item> m_items;        
+        SmallVector<Item, INLINEITEMS> m_items;
 };
 
 
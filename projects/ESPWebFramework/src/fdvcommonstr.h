@@ -92,6 +92,22 @@ namespace fdv
     static char const STR_DNS1[] FLASHMEM           = "DNS1";
     static char const STR_DNS2[] FLASHMEM           = "DNS2";
     static char const STR_ROUTING[] FLASHMEM        = "ROUTING";
+    static char const STR_NAPT[] FLASHMEM           = "NAPT";
+    static char const STR_RATELIM[] FLASHMEM        = "RATELIM";
+    static char const STR_RATE[] FLASHMEM           = "RATE";
+    static char const STR_BURST[] FLASHMEM          = "BURST";
+    static char const STR_UDPBIN[] FLASHMEM         = "UDPBIN";
+    static char const STR_UDPBINPORT[] FLASHMEM     = "UDPBINPORT";
+    static char const STR_MQTT[] FLASHMEM           = "MQTT";
+    static char const STR_MQTTHOST[] FLASHMEM       = "MQTTHOST";
+    static char const STR_MQTTPORT[] FLASHMEM       = "MQTTPORT";
+    static char const STR_MQTTID[] FLASHMEM         = "MQTTID";
+    static char const STR_MQTTUSER[] FLASHMEM       = "MQTTUSER";
+    static char const STR_MQTTPSW[] FLASHMEM        = "MQTTPSW";
+    static char const STR_MQTTPFX[] FLASHMEM        = "MQTTPFX";
+    static char const STR_MQTTKA[] FLASHMEM         = "MQTTKA";
+    static char const STR_MQTTINT[] FLASHMEM        = "MQTTINT";
+    static char const STR_MQTTQOS[] FLASHMEM        = "MQTTQOS";
     static char const STR_CLMSK[] FLASHMEM          = "CLMSK";
     static char const STR_APMSK[] FLASHMEM          = "APMSK";
     static char const STR_DISP_APIPCONF[] FLASHMEM  = "DISP_APIPCONF";
@@ -120,6 +136,7 @@ namespace fdv
     static char const STR_400_Bad_Request[] FLASHMEM       = "400 Bad Request";
     static char const STR_401_Unauthorized[] FLASHMEM      = "401 Unauthorized";
     static char const STR_403_Forbidden[] FLASHMEM         = "403 Forbidden";
+    static char const STR_503_Service_Unavailable[] FLASHMEM = "503 Service Unavailable";
     static char const STR_TEXTHTML[] FLASHMEM       = "text/html";
     static char const STR_TEXTHTML_UTF8[] FLASHMEM  = "text/html; charset=utf-8";
     static char const STR_APPJSON[] FLASHMEM        = "application/json";
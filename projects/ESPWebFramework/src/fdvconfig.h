@@ -32,7 +32,20 @@
 // Include SerialBinary class and related functionalities
 #define FDV_INCLUDE_SERIALBINARY 1
 
+// Include UDPBinary class and related functionalities (requires FDV_INCLUDE_SERIALBINARY)
+#define FDV_INCLUDE_UDPBINARY 1
+
+// Include MQTTClient class and related functionalities
+#define FDV_INCLUDE_MQTTCLIENT 1
+
 // Include MemPool
 #define FDV_INCLUDE_MEMPOOL 0
 
+// Size (bytes) of the MemPool used by Memory::malloc() and global new (requires FDV_INCLUDE_MEMPOOL).
+// The pool is taken from the SDK heap at first allocation. 0 = Memory::malloc() uses only the SDK heap
+#define FDV_MEMPOOL_HEAPSIZE 0
+
+// Include HeapTrace: accounts heap usage to allocation call sites (see "heap" console command and /heap.json)
+#define FDV_INCLUDE_HEAPTRACE 0
+
 #endif
\ No newline at end of file
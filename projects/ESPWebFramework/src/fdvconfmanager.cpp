@@ -45,6 +45,14 @@ namespace fdv
     SerialBinary*  ConfigurationManager::s_serialBinary  = NULL;
 #endif
 
+#if (FDV_INCLUDE_UDPBINARY == 1)
+    UDPBinary*     ConfigurationManager::s_UDPBinary     = NULL;
+#endif
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+    MQTTClient*    ConfigurationManager::s_MQTTClient    = NULL;
+#endif
+
 	
     
     // can be re-applied
@@ -88,6 +96,57 @@ namespace fdv
     }
     
     
+#if (FDV_INCLUDE_UDPBINARY == 1)
+    // can be re-applied
+    void STC_FLASHMEM ConfigurationManager::applyUDPBinary()
+    {
+        if (s_UDPBinary)
+        {
+            delete s_UDPBinary;
+            s_UDPBinary = NULL;
+        }
+        bool enabled;
+        uint16_t port;
+        getUDPBinaryParams(&enabled, &port);
+        if (enabled)
+            s_UDPBinary = new UDPBinary(port);
+    }
+#endif
+    
+    
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+    // can be re-applied
+    // should be re-applied when GPIO configuration changes
+    void STC_FLASHMEM ConfigurationManager::applyMQTTClient()
+    {
+        if (s_MQTTClient)
+        {
+            delete s_MQTTClient;
+            s_MQTTClient = NULL;
+        }
+        bool enabled;
+        MQTTClient::Params params;
+        getMQTTClientParams(&enabled, &params);
+        if (enabled)
+        {
+            // publish configured GPIOs, allow writing of configured outputs
+            params.inputsMask  = 0;
+            params.outputsMask = 0;
+            for (uint32_t i = 0; i < 17; ++i)
+            {
+                bool configured, isOutput, pullUp, value;
+                getGPIOParams(i, &configured, &isOutput, &pullUp, &value);
+                if (configured)
+                    params.inputsMask |= 1 << i;
+                if (configured && isOutput)
+                    params.outputsMask |= 1 << i;
+            }
+            s_MQTTClient = new MQTTClient(params);
+        }
+    }
+#endif
+    
+    
     // can be re-applied
     void STC_FLASHMEM ConfigurationManager::applyWiFi()
     {
@@ -201,14 +260,29 @@ namespace fdv
     }
     
     
-    void STC_FLASHMEM ConfigurationManager::applyRouting()
+    // returns false if NAPT is configured but cannot be enabled (no memory for its table), NAPT stays disabled
+    bool STC_FLASHMEM ConfigurationManager::applyRouting()
     {
-        bool routing;
+        bool routing, napt, rateLimit;
+        uint32_t rate, burst;
         getRouting(&routing);
+        getNAPT(&napt);
+        getRateLimit(&rateLimit, &rate, &burst);
+        bool result = true;
+        if (napt && !NAPT::enable())
+        {
+            debug(FSTR("NAPT: not enough memory, disabled\r\n"));
+            result = false;
+            napt   = false;
+        }
+        if (!napt)
+            NAPT::disable();
+        RateLimiter::configure(rateLimit? rate * 1024 : 0, burst * 1024);
         if (routing)
             Router::enable();
         else
             Router::disable();
+        return result;
     }
         
     
@@ -346,6 +420,41 @@ namespace fdv
     {
         *enabled = FlashDictionary::getBool(STR_ROUTING, false);
     }
+    
+
+    void STC_FLASHMEM ConfigurationManager::setNAPT(bool enabled)
+    {
+        FlashDictionary::setBool(STR_NAPT, enabled);
+    }
+    
+
+    void STC_FLASHMEM ConfigurationManager::getNAPT(bool* enabled)
+    {
+        *enabled = FlashDictionary::getBool(STR_NAPT, false);
+    }
+    
+    
+    // rate in KBytes/sec (at least 1), burst in KBytes (at least the MTU)
+    void STC_FLASHMEM ConfigurationManager::setRateLimit(bool enabled, uint32_t rate, uint32_t burst)
+    {
+        uint32_t const minBurst = (RateLimiter::MINBURST + 1023) / 1024;
+        if (rate == 0)
+            rate = 1;
+        if (burst < minBurst)
+            burst = minBurst;
+        FlashDictionary::setBool(STR_RATELIM, enabled);
+        FlashDictionary::setInt(STR_RATE, rate);
+        FlashDictionary::setInt(STR_BURST, burst);
+    }
+    
+    
+    // rate in KBytes/sec, burst in KBytes
+    void STC_FLASHMEM ConfigurationManager::getRateLimit(bool* enabled, uint32_t* rate, uint32_t* burst)
+    {
+        *enabled = FlashDictionary::getBool(STR_RATELIM, false);
+        *rate    = FlashDictionary::getInt(STR_RATE, 64);
+        *burst   = FlashDictionary::getInt(STR_BURST, 16);
+    }
 
     
     void STC_FLASHMEM ConfigurationManager::setDNSParams(IPAddress DNS1, IPAddress DNS2)
@@ -374,6 +483,56 @@ namespace fdv
     }
     
     
+#if (FDV_INCLUDE_UDPBINARY == 1)
+    void STC_FLASHMEM ConfigurationManager::setUDPBinaryParams(bool enabled, uint16_t port)
+    {
+        FlashDictionary::setBool(STR_UDPBIN, enabled);
+        FlashDictionary::setInt(STR_UDPBINPORT, port);
+    }
+    
+    
+    void STC_FLASHMEM ConfigurationManager::getUDPBinaryParams(bool* enabled, uint16_t* port)
+    {
+        *enabled = FlashDictionary::getBool(STR_UDPBIN, false);
+        *port    = FlashDictionary::getInt(STR_UDPBINPORT, 8266);
+    }
+#endif
+    
+    
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+    // strings of params can stay in RAM or Flash, inputsMask and outputsMask are not stored
+    void STC_FLASHMEM ConfigurationManager::setMQTTClientParams(bool enabled, MQTTClient::Params const& params)
+    {
+        FlashDictionary::setBool(STR_MQTT, enabled);
+        FlashDictionary::setString(STR_MQTTHOST, params.host);
+        FlashDictionary::setInt(STR_MQTTPORT, params.port);
+        FlashDictionary::setString(STR_MQTTID, params.clientID);
+        FlashDictionary::setString(STR_MQTTUSER, params.user);
+        FlashDictionary::setString(STR_MQTTPSW, params.password);
+        FlashDictionary::setString(STR_MQTTPFX, params.topicPrefix);
+        FlashDictionary::setInt(STR_MQTTKA, params.keepAlive);
+        FlashDictionary::setInt(STR_MQTTINT, params.publishInterval);
+        FlashDictionary::setInt(STR_MQTTQOS, params.QoS);
+    }
+    
+    
+    // strings of params are stored in Flash, inputsMask and outputsMask are not filled
+    void STC_FLASHMEM ConfigurationManager::getMQTTClientParams(bool* enabled, MQTTClient::Params* params)
+    {
+        *enabled                = FlashDictionary::getBool(STR_MQTT, false);
+        params->host            = FlashDictionary::getString(STR_MQTTHOST, STR_);
+        params->port            = FlashDictionary::getInt(STR_MQTTPORT, 1883);
+        params->clientID        = FlashDictionary::getString(STR_MQTTID, STR_);
+        params->user            = FlashDictionary::getString(STR_MQTTUSER, STR_);
+        params->password        = FlashDictionary::getString(STR_MQTTPSW, STR_);
+        params->topicPrefix     = FlashDictionary::getString(STR_MQTTPFX, FSTR("esp8266"));
+        params->keepAlive       = FlashDictionary::getInt(STR_MQTTKA, 60);
+        params->publishInterval = FlashDictionary::getInt(STR_MQTTINT, 500);
+        params->QoS             = FlashDictionary::getInt(STR_MQTTQOS, 0);
+    }
+#endif
+    
+    
     void STC_FLASHMEM ConfigurationManager::setUARTParams(uint32_t baudRate, bool enableSystemOutput, SerialService serialService)
     {
         FlashDictionary::setInt(STR_BAUD, baudRate);
@@ -457,7 +616,7 @@ namespace fdv
     {
         *timezoneHours    = FlashDictionary::getInt(STR_TZHH, 0);
         *timezoneMinutes  = FlashDictionary::getInt(STR_TZMM, 0);
-        *defaultNTPServer = FlashDictionary::getString(STR_DEFNTPSRV, FSTR("ntp1.inrim.it"));
+        *defaultNTPServer = FlashDictionary::getString(STR_DEFNTPSRV, FSTR("ntp1.inrim.it ntp2.inrim.it"));
     }
     
     
@@ -670,6 +829,76 @@ namespace fdv
         }            
     }
     
+#if (FDV_INCLUDE_UDPBINARY == 1)
+    void MTD_FLASHMEM HTTPHelperConfiguration::getUDPBinary(HTTPTemplateResponse* response)
+    {
+        bool enabled;
+        uint16_t port;
+        ConfigurationManager::getUDPBinaryParams(&enabled, &port);
+        if (enabled)
+            response->addParamStr(STR_UDPBIN, STR_checked);
+        response->addParamInt(STR_UDPBINPORT, port);
+    }
+    
+    void MTD_FLASHMEM HTTPHelperConfiguration::setUDPBinary(HTTPTemplateResponse* response)
+    {
+        char const* port = response->getRequest().form[STR_UDPBINPORT];
+        if (port)
+        {
+            ConfigurationManager::setUDPBinaryParams(response->getRequest().form[STR_UDPBIN] != NULL, strtol(port, NULL, 10));
+            ConfigurationManager::applyUDPBinary();
+        }
+    }
+#endif
+    
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+    void MTD_FLASHMEM HTTPHelperConfiguration::getMQTTClient(HTTPTemplateResponse* response)
+    {
+        bool enabled;
+        MQTTClient::Params params;
+        ConfigurationManager::getMQTTClientParams(&enabled, &params);
+        if (enabled)
+            response->addParamStr(STR_MQTT, STR_checked);
+        response->addParamStr(STR_MQTTHOST, params.host);
+        response->addParamInt(STR_MQTTPORT, params.port);
+        response->addParamStr(STR_MQTTID, params.clientID);
+        response->addParamStr(STR_MQTTUSER, params.user);
+        response->addParamStr(STR_MQTTPSW, params.password);
+        response->addParamStr(STR_MQTTPFX, params.topicPrefix);
+        response->addParamInt(STR_MQTTKA, params.keepAlive);
+        response->addParamInt(STR_MQTTINT, params.publishInterval);
+        response->addParamStr(params.QoS == 0? FSTR("MQTTQOS0") : FSTR("MQTTQOS1"), STR_checked);
+    }
+    
+    void MTD_FLASHMEM HTTPHelperConfiguration::setMQTTClient(HTTPTemplateResponse* response)
+    {
+        char const* host = response->getRequest().form[STR_MQTTHOST];
+        char const* port = response->getRequest().form[STR_MQTTPORT];
+        char const* ka   = response->getRequest().form[STR_MQTTKA];
+        char const* intv = response->getRequest().form[STR_MQTTINT];
+        char const* qos  = response->getRequest().form[STR_MQTTQOS];
+        if (host && port && ka && intv && qos)
+        {
+            char const* clientID    = response->getRequest().form[STR_MQTTID];
+            char const* user        = response->getRequest().form[STR_MQTTUSER];
+            char const* password    = response->getRequest().form[STR_MQTTPSW];
+            char const* topicPrefix = response->getRequest().form[STR_MQTTPFX];
+            MQTTClient::Params params;
+            params.host            = host;
+            params.port            = strtol(port, NULL, 10);
+            params.clientID        = clientID? clientID : STR_;
+            params.user            = user? user : STR_;
+            params.password        = password? password : STR_;
+            params.topicPrefix     = topicPrefix? topicPrefix : STR_;
+            params.keepAlive       = strtol(ka, NULL, 10);
+            params.publishInterval = strtol(intv, NULL, 10);
+            params.QoS             = (strtol(qos, NULL, 10) > 0? 1 : 0);
+            ConfigurationManager::setMQTTClientParams(response->getRequest().form[STR_MQTT] != NULL, params);
+            ConfigurationManager::applyMQTTClient();
+        }
+    }
+#endif
+    
     void MTD_FLASHMEM HTTPHelperConfiguration::getAPWiFiParams(HTTPTemplateResponse* response, APtr<char>& APCHStr, APtr<char>& APSECStr)
     {
         uint8_t channel;
@@ -743,15 +972,38 @@ namespace fdv
     
     void MTD_FLASHMEM HTTPHelperConfiguration::getRouting(HTTPTemplateResponse* response)
     {
-        bool routing;
+        bool routing, napt;
         ConfigurationManager::getRouting(&routing);
+        ConfigurationManager::getNAPT(&napt);
         if (routing)
             response->addParamStr(STR_ROUTING, STR_checked);
+        if (napt)
+            response->addParamStr(STR_NAPT, STR_checked);
     }
     
     void MTD_FLASHMEM HTTPHelperConfiguration::setRouting(HTTPTemplateResponse* response)
     {
         ConfigurationManager::setRouting(response->getRequest().form[STR_ROUTING] != NULL);
+        ConfigurationManager::setNAPT(response->getRequest().form[STR_NAPT] != NULL);
+    }
+    
+    void MTD_FLASHMEM HTTPHelperConfiguration::getRateLimit(HTTPTemplateResponse* response)
+    {
+        bool enabled;
+        uint32_t rate, burst;
+        ConfigurationManager::getRateLimit(&enabled, &rate, &burst);
+        if (enabled)
+            response->addParamStr(STR_RATELIM, STR_checked);
+        response->addParamInt(STR_RATE, rate);
+        response->addParamInt(STR_BURST, burst);
+    }
+    
+    void MTD_FLASHMEM HTTPHelperConfiguration::setRateLimit(HTTPTemplateResponse* response)
+    {
+        char const* rate  = response->getRequest().form[STR_RATE];
+        char const* burst = response->getRequest().form[STR_BURST];
+        if (rate && burst)
+            ConfigurationManager::setRateLimit(response->getRequest().form[STR_RATELIM] != NULL, strtol(rate, NULL, 10), strtol(burst, NULL, 10));
     }
     
     // looks for "gpio" (0..16), "val" (0..1) and "store" (0..1) parameters in the http query
@@ -876,6 +1128,7 @@ namespace fdv
             
             // set Routing
             HTTPHelperConfiguration::setRouting(this);
+            HTTPHelperConfiguration::setRateLimit(this);
             ConfigurationManager::applyRouting();
         }
         
@@ -899,6 +1152,7 @@ namespace fdv
         
         // get routing configuration
         HTTPHelperConfiguration::getRouting(this);
+        HTTPHelperConfiguration::getRateLimit(this);
         
         HTTPTemplateResponse::flush();
     }
@@ -925,6 +1179,16 @@ namespace fdv
             
             // set UART configuration
             HTTPHelperConfiguration::setUART(this);
+            
+#if (FDV_INCLUDE_UDPBINARY == 1)
+            // set UDP binary protocol configuration
+            HTTPHelperConfiguration::setUDPBinary(this);
+#endif
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+            // set MQTT client configuration
+            HTTPHelperConfiguration::setMQTTClient(this);
+#endif
         }
         
         // get Web server configuration
@@ -935,6 +1199,16 @@ namespace fdv
         // get UART configuration
         HTTPHelperConfiguration::getUART(this);
         
+#if (FDV_INCLUDE_UDPBINARY == 1)
+        // get UDP binary protocol configuration
+        HTTPHelperConfiguration::getUDPBinary(this);
+#endif
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+        // get MQTT client configuration
+        HTTPHelperConfiguration::getMQTTClient(this);
+#endif
+        
         HTTPTemplateResponse::flush();
     }
 		
@@ -956,7 +1230,7 @@ namespace fdv
         addHeader(STR_Content_Type, STR_TEXTHTML);
         
         uint32_t count = 0;
-        WiFi::APInfo* infos = WiFi::getAPList(&count, true);
+        APtr<WiFi::APInfo> infos(WiFi::getAPList(&count));
 
         addContent(FSTR("<tr> <th>SSID</th> <th>Address</th> <th>Channel</th> <th>RSSI</th> <th>Security</th> </tr>"));
         for (uint32_t i = 0; i != count; ++i)
@@ -1003,6 +1277,9 @@ namespace fdv
                 // gpio disabled (not configured)
                 ConfigurationManager::setGPIOParams(strtol(gpio, NULL, 10), false, false, false, false);
             }
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+            ConfigurationManager::applyMQTTClient();
+#endif
         }
         
         HTTPHelperConfiguration::GPIOSetValue(this);
@@ -1086,6 +1363,63 @@ namespace fdv
 
     
     
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPPacketCaptureResponse
+
+    MTD_FLASHMEM HTTPPacketCaptureResponse::HTTPPacketCaptureResponse(HTTPHandler* httpHandler)
+        : HTTPResponse(httpHandler, NULL)
+    {
+    }
+    
+    
+    void MTD_FLASHMEM HTTPPacketCaptureResponse::flush()
+    {
+        char const* snaplenStr = getRequest().query[FSTR("snaplen")];
+        char const* secsStr    = getRequest().query[FSTR("secs")];
+        uint32_t snapLen = snaplenStr? strtol(snaplenStr, NULL, 10) : PacketCapture::DEFAULTSNAPLEN;
+        uint32_t timeOut = secsStr? strtol(secsStr, NULL, 10) * 1000 : 0;
+        
+        // the ring is drained while capture goes on
+        uint32_t const BUFFERSIZE = sizeof(PacketCapture::RecordHeader) + PacketCapture::MAXSNAPLEN;
+        APtr<uint8_t> buffer(new uint8_t[BUFFERSIZE]);
+        
+        uint32_t owner = 0;
+        if (buffer.get() == NULL || !Router::isEnabled() || (owner = PacketCapture::start(PacketCapture::DEFAULTBUFFERSIZE, snapLen)) == 0)
+        {
+            setStatus(STR_503_Service_Unavailable);
+            HTTPResponse::flush();
+            return;
+        }
+        
+        setStatus(STR_200_OK);
+        addHeader(STR_Content_Type, FSTR("application/vnd.tcpdump.pcap"));
+        flushHeaders(UNKNOWNLENGTH);
+        
+        Socket* socket = getHttpHandler()->getSocket();
+        
+        PacketCapture::FileHeader fileHeader;
+        PacketCapture::getFileHeader(&fileHeader);
+        bool connected = (socket->write(&fileHeader, sizeof(PacketCapture::FileHeader)) > 0);
+        
+        uint32_t startTime = millis();
+        while (connected && (timeOut == 0 || millisDiff(startTime, millis()) < timeOut))
+        {
+            uint32_t length = PacketCapture::read(owner, buffer.get(), BUFFERSIZE);
+            if (length > 0)
+                connected = (socket->write(buffer.get(), length) > 0);
+            else
+            {
+                Task::delay(50);
+                connected = socket->checkConnection();
+            }
+        }
+        
+        PacketCapture::stop(owner);
+    }
+
+    
+    
 	//////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////
 	// HTTPTimeConfigurationResponse
@@ -1201,6 +1535,50 @@ namespace fdv
 		
     
     
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPHeapTraceResponse
+
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+
+    MTD_FLASHMEM HTTPHeapTraceResponse::HTTPHeapTraceResponse(HTTPHandler* httpHandler)
+        : HTTPResponse(httpHandler, STR_200_OK)
+    {
+    }
+    
+    
+    // counters are read before building the response, so they don't include its own allocations
+    void MTD_FLASHMEM HTTPHeapTraceResponse::flush()
+    {
+        APtr<HeapTrace::Site> sites(new HeapTrace::Site[HeapTrace::MAXSITES]);   // too large for the task stack
+        HeapTrace::Stats stats;
+        HeapTrace::getStats(&stats);
+        for (uint32_t i = 0; i != HeapTrace::MAXSITES; ++i)
+            if (!HeapTrace::getSite(i, &sites[i]))
+                sites[i].allocations = 0;
+        
+        addHeader(STR_Content_Type, STR_APPJSON);
+        addContent(CharSlice::format(FSTR("{\"live\":%d,\"highWater\":%d,\"allocations\":%d,\"sites\":["), stats.liveBytes, stats.highWater, stats.allocations));
+        bool first = true;
+        for (uint32_t i = 0; i != HeapTrace::MAXSITES; ++i)
+        {
+            HeapTrace::Site const& site = sites[i];
+            if (site.allocations == 0)
+                continue;
+            if (site.address)
+                addContent(CharSlice::format(FSTR("%s{\"site\":\"0x%08X\","), first? STR_ : FSTR(","), (uint32_t)site.address));
+            else
+                addContent(first? FSTR("{\"site\":\"others\",") : FSTR(",{\"site\":\"others\","));
+            addContent(CharSlice::format(FSTR("\"live\":%d,\"count\":%d,\"peak\":%d,\"allocs\":%d}"), site.liveBytes, site.liveCount, site.peakBytes, site.allocations));
+            first = false;
+        }
+        addContent(FSTR("]}"));
+        HTTPResponse::flush();
+    }
+
+#endif
+
+
 	//////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////
 	// HTTPFileSystemBrowserResponse
@@ -1268,6 +1646,10 @@ namespace fdv
             {FSTR("/conftime"),   (PageHandler)&DefaultHTTPHandler::get_conftime},
             {FSTR("/reboot"),     (PageHandler)&DefaultHTTPHandler::get_reboot},
             {FSTR("/restore"),    (PageHandler)&DefaultHTTPHandler::get_restore},
+            {FSTR("/capture.pcap"), (PageHandler)&DefaultHTTPHandler::get_capture},
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+            {FSTR("/heap.json"),  (PageHandler)&DefaultHTTPHandler::get_heap},
+#endif
             {FSTR("*"),           (PageHandler)&DefaultHTTPHandler::get_all},
         };
         setRoutes(routes, sizeof(routes) / sizeof(Route));
@@ -1396,6 +1778,22 @@ namespace fdv
     }
 
     
+    void MTD_FLASHMEM DefaultHTTPHandler::get_capture()
+    {
+        HTTPPacketCaptureResponse response(this);
+        response.flush();
+    }
+
+    
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+    void MTD_FLASHMEM DefaultHTTPHandler::get_heap()
+    {
+        HTTPHeapTraceResponse response(this);
+        response.flush();
+    }
+#endif
+
+    
     void MTD_FLASHMEM DefaultHTTPHandler::get_all()
     {
         HTTPStaticFileResponse response(this, getRequest().requestedPage);
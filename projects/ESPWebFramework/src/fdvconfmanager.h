@@ -53,6 +53,12 @@ namespace fdv
 			applyGPIO();
 			applyWebServer<HTTPCustomServer_T>();            
             applyRouting();
+#if (FDV_INCLUDE_UDPBINARY == 1)
+            applyUDPBinary();
+#endif
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+            applyMQTTClient();
+#endif
 		}
 		
 	
@@ -90,7 +96,19 @@ namespace fdv
         static void applyDNS();
         
         // can be re-applied
-        static void applyRouting();
+        // returns false if NAPT is configured but cannot be enabled (no memory for its table), NAPT stays disabled
+        static bool applyRouting();
+        
+#if (FDV_INCLUDE_UDPBINARY == 1)
+        // can be re-applied
+        static void applyUDPBinary();
+#endif
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+        // can be re-applied
+        // should be re-applied when GPIO configuration changes
+        static void applyMQTTClient();
+#endif
         
 		// cannot be re-applied
 		template <typename HTTPCustomServer_T>
@@ -157,6 +175,17 @@ namespace fdv
         static void setRouting(bool enabled);
         
         static void getRouting(bool* enabled);
+        
+        // NAPT: translate Access Point network connections to the Client network IP
+        static void setNAPT(bool enabled);
+        
+        static void getNAPT(bool* enabled);
+        
+        // rate limit of each Access Point client routed traffic
+        // rate in KBytes/sec, burst in KBytes
+        static void setRateLimit(bool enabled, uint32_t rate, uint32_t burst);
+        
+        static void getRateLimit(bool* enabled, uint32_t* rate, uint32_t* burst);
 		
 		
         //// DNS parameters
@@ -173,6 +202,26 @@ namespace fdv
 		static void getWebServerParams(uint16_t* port);
 		
 		
+#if (FDV_INCLUDE_UDPBINARY == 1)
+		//// UDP binary protocol parameters
+		
+		static void setUDPBinaryParams(bool enabled, uint16_t port);
+		
+		static void getUDPBinaryParams(bool* enabled, uint16_t* port);
+#endif
+		
+		
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+		//// MQTT client parameters
+		
+		// strings of params can stay in RAM or Flash, inputsMask and outputsMask are not stored
+		static void setMQTTClientParams(bool enabled, MQTTClient::Params const& params);
+		
+		// strings of params are stored in Flash, inputsMask and outputsMask are not filled
+		static void getMQTTClientParams(bool* enabled, MQTTClient::Params* params);
+#endif
+		
+		
 		//// UART parameters
 		
 		static void setUARTParams(uint32_t baudRate, bool enableSystemOutput, SerialService serialService);
@@ -216,6 +265,12 @@ namespace fdv
 #endif
 #if (FDV_INCLUDE_SERIALBINARY == 1)
 		static SerialBinary*  s_serialBinary;
+#endif
+#if (FDV_INCLUDE_UDPBINARY == 1)
+		static UDPBinary*     s_UDPBinary;
+#endif
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+		static MQTTClient*    s_MQTTClient;
 #endif
 	};
 
@@ -254,6 +309,16 @@ namespace fdv
         static void getUART(HTTPTemplateResponse* response);
         static void setUART(HTTPTemplateResponse* response);
 
+#if (FDV_INCLUDE_UDPBINARY == 1)
+        static void getUDPBinary(HTTPTemplateResponse* response);
+        static void setUDPBinary(HTTPTemplateResponse* response);
+#endif
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+        static void getMQTTClient(HTTPTemplateResponse* response);
+        static void setMQTTClient(HTTPTemplateResponse* response);
+#endif
+
         static void getAPWiFiParams(HTTPTemplateResponse* response, APtr<char>& APCHStr, APtr<char>& APSECStr);
         static void setAPWiFiParams(HTTPTemplateResponse* response);
         
@@ -265,6 +330,8 @@ namespace fdv
 
         static void getRouting(HTTPTemplateResponse* response);
         static void setRouting(HTTPTemplateResponse* response);
+        static void getRateLimit(HTTPTemplateResponse* response);
+        static void setRateLimit(HTTPTemplateResponse* response);
         
         static void GPIOSetValue(HTTPResponse* response);
         static void GPIOConf(HTTPResponse* response);
@@ -397,6 +464,44 @@ namespace fdv
     
     
 
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPPacketCaptureResponse
+    // Captures routed packets and streams them as pcap file, until the client disconnects or
+    // the specified time elapses. Routing must be enabled. Only one capture at the time is allowed.
+    //
+    // Query string:
+    //   snaplen = max bytes captured for each packet (if not present PacketCapture::DEFAULTSNAPLEN is assumed)
+    //   secs    = capture duration in seconds (if not present capture ends when client disconnects)
+    //
+    // Example: captures the first 128 bytes of each routed packet for 60 seconds
+    //   http://192.168.4.1/capture.pcap?snaplen=128&secs=60
+
+	struct HTTPPacketCaptureResponse : public HTTPResponse
+	{
+		HTTPPacketCaptureResponse(HTTPHandler* httpHandler);
+		
+		virtual void flush();
+	};
+    
+    
+    //////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPHeapTraceResponse
+    // Heap usage by allocation call site (see HeapTrace), as JSON. Example:
+    //   {"live":12000,"highWater":20000,"allocations":5000,"sites":[{"site":"0x40212345","live":1024,"count":4,"peak":2048,"allocs":100},...]}
+    // Site "others" collects sites not fitting the table.
+
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+	struct HTTPHeapTraceResponse : public HTTPResponse
+	{
+		HTTPHeapTraceResponse(HTTPHandler* httpHandler);
+		
+		virtual void flush();
+	};
+#endif
+    
+    
     //////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////
 	// HTTPFileSystemBrowserResponse
@@ -435,6 +540,10 @@ namespace fdv
         void get_restore();
         void get_confwizard();
         void get_fsbrowser();
+        void get_capture();
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+        void get_heap();
+#endif
         void get_all();
     };
 	
@@ -34,28 +34,57 @@ namespace fdv
     // static members
     int8_t      DateTime::s_defaultTimezoneHours    = 0;
     uint8_t     DateTime::s_defaultTimezoneMinutes  = 0;
-    IPAddress   DateTime::s_defaultNTPServer;   // never initialize (no constructor is called here!)
-    bool        DateTime::s_synchingWithNTPServer   = false;
+    char        DateTime::s_defaultNTPServer[NTPSERVER_MAXLEN] = {0};
+    uint64_t    DateTime::s_localMillis             = 0;
+    uint32_t    DateTime::s_lastMillis              = 0;
+    sint64_t    DateTime::s_baseTime                = (sint64_t)SECONDS_FROM_1970_TO_2000 * 1000;
+    uint64_t    DateTime::s_baseLocal               = 0;
+    int32_t     DateTime::s_slewOffset              = 0;
+    int32_t     DateTime::s_drift                   = 0;
+    bool        DateTime::s_timeSet                 = false;
+    bool        DateTime::s_synchronized            = false;
+    bool        DateTime::s_driftValid              = false;
+    uint64_t    DateTime::s_lastSampleLocal         = 0;
+    uint32_t    DateTime::s_lastDelay               = 0;
+    uint32_t    DateTime::s_pollInterval            = MINPOLL;
+    uint64_t    DateTime::s_nextPoll                = 0;
+    bool        DateTime::s_querying                = false;
 
     
     // a local copy of defaultNTPServer string is perfomed
+    // defaultNTPServer can contain up to SNTPClient::MAXSERVERS names separated by spaces or commas
+    // doesn't block: names are resolved in background and looked up again (from cache) at synchronization time
     void MTD_FLASHMEM DateTime::setDefaults(int8_t timezoneHours, uint8_t timezoneMinutes, char const* defaultNTPServer)
     {
-        s_defaultNTPServer       = NSLookup::lookup(defaultNTPServer);
+        uint32_t len = f_strnlen(defaultNTPServer, NTPSERVER_MAXLEN - 1);
+        f_memcpy(s_defaultNTPServer, defaultNTPServer, len);
+        s_defaultNTPServer[len]  = 0;
         s_defaultTimezoneHours   = timezoneHours;
         s_defaultTimezoneMinutes = timezoneMinutes;
-        if (s_defaultNTPServer != IPAddress(0, 0, 0, 0))
+        // start names resolution
+        char name[NTPSERVER_MAXLEN];
+        char const* list = s_defaultNTPServer;
+        while ((list = getNTPServerName(list, name)) != NULL)
         {
-            // this will force NTP synchronization
-            lastSyncMillis(true, 0);
+            IPAddress address;
+            NSLookup::lookupAsync(name, &address);
         }
+        // this will force NTP synchronization
+        Critical critical;
+        s_nextPoll = 0;
     }
     
     
     void MTD_FLASHMEM DateTime::setCurrentDateTime(DateTime const& dateTime)
     {
-        lastSyncDateTime(true, dateTime);
-        lastSyncMillis(true, millis());
+        sint64_t time  = ((sint64_t)dateTime.getUnixDateTime() - dateTime.getTimezoneSeconds()) * 1000;
+        uint64_t local = localMillis();
+        Critical critical;
+        s_baseTime      = time;
+        s_baseLocal     = local;
+        s_slewOffset    = 0;
+        s_timeSet       = true;
+        s_synchronized  = false;    // next NTP reply will step the clock
     }
 
 
@@ -124,10 +153,20 @@ namespace fdv
     }
     
     
-    // if serverIP = 0.0.0.0 then look into s_defaultNTPServer
+    int32_t MTD_FLASHMEM DateTime::getTimezoneSeconds() const
+    {
+        return (timezoneHours * 3600L) + (timezoneMinutes * 60L);
+    }
+    
+    
+    // if serverIP = 0.0.0.0 then look into s_defaultNTPServer (first server)
+    // warn: blocks until reply or timeout
     bool MTD_FLASHMEM DateTime::getFromNTPServer(IPAddress const& serverIP)
     {
-        IPAddress ip = (serverIP == IPAddress(0, 0, 0, 0)? s_defaultNTPServer : serverIP);
+        IPAddress ip = serverIP;
+        char name[NTPSERVER_MAXLEN];
+        if (ip == IPAddress(0, 0, 0, 0) && getNTPServerName(s_defaultNTPServer, name))
+            ip = NSLookup::lookup(name);
         if (ip != IPAddress(0, 0, 0, 0))
         {
             SNTPClient sntp(ip);
@@ -140,97 +179,222 @@ namespace fdv
         }
         return false;
     }
-
-
     
-    void STC_FLASHMEM DateTime::syncWithNTPServer()
+    
+    // extracts next name from a list of names separated by spaces or commas
+    // name must have NTPSERVER_MAXLEN bytes
+    // returns the position after the extracted name, or NULL when there aren't more names
+    char const* STC_FLASHMEM DateTime::getNTPServerName(char const* list, char* name)
+    {
+        while (*list == ' ' || *list == ',')
+            ++list;
+        if (*list == 0)
+            return NULL;
+        uint32_t len = 0;
+        while (*list != 0 && *list != ' ' && *list != ',' && len < NTPSERVER_MAXLEN - 1)
+            name[len++] = *list++;
+        name[len] = 0;
+        return list;
+    }
+    
+    
+    // 64 bit extension of millis()
+    uint64_t STC_FLASHMEM DateTime::localMillis()
+    {
+        Critical critical;
+        uint32_t currentMillis = millis();
+        s_localMillis += (uint32_t)(currentMillis - s_lastMillis);
+        s_lastMillis   = currentMillis;
+        return s_localMillis;
+    }
+    
+    
+    // part of s_slewOffset applied at "local" time
+    // must be called inside a Critical section
+    sint64_t STC_FLASHMEM DateTime::appliedSlew(uint64_t local)
     {
-        static uint32_t const MAXTRIES = 5;
-        static uint32_t const DELAY    = 30000;
-        if (!s_synchingWithNTPServer)
+        sint64_t elapsed = (sint64_t)(local - s_baseLocal);
+        if (s_slewOffset == 0 || elapsed <= 0)
+            return 0;
+        sint64_t slew = elapsed * SLEWRATE / 1000000;
+        if (s_slewOffset > 0)
+            return slew < s_slewOffset? slew : s_slewOffset;
+        else
+            return slew < -s_slewOffset? -slew : s_slewOffset;
+    }
+    
+    
+    // UTC unix time in ms at "local" time
+    // must be called inside a Critical section
+    sint64_t STC_FLASHMEM DateTime::clockTime(uint64_t local)
+    {
+        sint64_t elapsed = (sint64_t)(local - s_baseLocal);
+        return s_baseTime + elapsed + elapsed * s_drift / 1000000000 + appliedSlew(local);
+    }
+    
+    
+    // starts a new NTP query when needed, or applies the result of the completed one
+    // doesn't block
+    void STC_FLASHMEM DateTime::pollNTPServers(uint64_t local)
+    {
+        bool start     = false;
+        bool completed = false;
         {
-            s_synchingWithNTPServer = true;
-            for (uint32_t i = 0; i != MAXTRIES; ++i)
+            Critical critical;
+            if (s_querying)
             {
-                DateTime dt;
-                if (dt.getFromNTPServer())
-                {
-                    DateTime::lastSyncDateTime(true, dt);
-                    DateTime::lastSyncMillis(true, millis());
-                    break;
-                }
-                Task::delay(DELAY);
+                completed  = SNTPClient::isCompleted();
+                s_querying = !completed;
+            }
+            else if (local >= s_nextPoll)
+            {
+                s_querying = true;
+                start      = true;
+            }
+        }
+        
+        if (completed)
+        {
+            SNTPClient::Sample sample;
+            if (SNTPClient::getBestSample(&sample))
+                applyNTPSample(sample.serverTime, sample.receiveMillis, sample.delay);
+            else
+            {
+                // all servers failed
+                Critical critical;
+                s_nextPoll = local + RETRYPOLL * 1000;
+            }
+        }
+        else if (start)
+        {
+            // names still being resolved are skipped (will be available from NSLookup cache at next poll)
+            IPAddress servers[SNTPClient::MAXSERVERS];
+            uint32_t count = 0;
+            bool pending = false;
+            char name[NTPSERVER_MAXLEN];
+            char const* list = s_defaultNTPServer;
+            while (count != SNTPClient::MAXSERVERS && (list = getNTPServerName(list, name)) != NULL)
+            {
+                IPAddress address;
+                if (!NSLookup::lookupAsync(name, &address))
+                    pending = true;
+                else if (address != IPAddress(0, 0, 0, 0))
+                    servers[count++] = address;
+            }
+            if (count == 0 || !SNTPClient::request(servers, count))
+            {
+                Critical critical;
+                s_querying = false;
+                s_nextPoll = local + (pending? DNSRETRY : RETRYPOLL * 1000);
             }
-            s_synchingWithNTPServer = false;
         }
     }
     
     
-    // if this is the first time calling now() or after 6 hours an NTP update is perfomed
-    // warn: now() should be called within 50 days from the last call
-    // warn: loses about 3 seconds every 10 hours
-    DateTime MTD_FLASHMEM DateTime::now()
+    // serverTime: UTC unix time in ms at receiveMillis
+    // delay: round trip delay in us
+    // insane samples (server time out of 2000-2100, large delay, too old) are discarded and the query retried later
+    void STC_FLASHMEM DateTime::applyNTPSample(uint64_t serverTime, uint32_t receiveMillis, uint32_t delay)
     {
-        uint32_t currentMillis = millis();
-        uint32_t locLastMillis = lastSyncMillis();
-        uint32_t diff = (currentMillis < locLastMillis) ? (0xFFFFFFFF - locLastMillis + currentMillis) : (currentMillis - locLastMillis);
+        Critical critical;
         
-        // need to synch with NTP server?
-        if (locLastMillis == 0 || diff > 6 * 3600 * 1000)
+        // local clock at reply reception. The clock is refreshed first, because the reply may have been received
+        // after the last localMillis() call
+        uint64_t local = localMillis();
+        int32_t age = (int32_t)(s_lastMillis - receiveMillis);
+        if (age < 0)
+            age = 0;
+        if (serverTime < (uint64_t)SECONDS_FROM_1970_TO_2000 * 1000 || serverTime > (uint64_t)SECONDS_FROM_1970_TO_2100 * 1000 ||
+            delay > MAXDELAY || age > (int32_t)MAXSAMPLEAGE || (uint64_t)age > local)
         {
-            if (!s_synchingWithNTPServer)
-                asyncExec<syncWithNTPServer>();
+            s_nextPoll = local + RETRYPOLL * 1000;
+            return;
         }
         
-        DateTime result;
-        result.setUnixDateTime( lastSyncDateTime().getUnixDateTime() + (diff / 1000) );
+        // local clock and disciplined clock at reply reception
+        uint64_t sampleLocal = local - age;
+        sint64_t sampleTime  = clockTime(sampleLocal);
+        sint64_t offset      = (sint64_t)serverTime - sampleTime;
+        sint64_t absOffset   = (offset < 0? -offset : offset);
         
-        if (s_defaultNTPServer == IPAddress(0, 0, 0, 0))
+        if (!s_synchronized || absOffset > STEPTHRESHOLD)
+        {
+            // step
+            s_baseTime     = serverTime;
+            s_slewOffset   = 0;
+            s_pollInterval = MINPOLL;
+        }
+        else
         {
-            // NTP synchronization is disabled. Take care for millis overflow.
-            if (diff > 10 * 24 * 3600 * 1000)   // past 10 days?
+            // offset not explained by the pending slew is due to frequency error
+            sint64_t residual = offset - (s_slewOffset - appliedSlew(sampleLocal));
+            uint64_t interval = sampleLocal - s_lastSampleLocal;
+            if (interval >= MINPOLL * 500)
             {
-                // reset millis counter to avoid overflow (actually it overflows after 50 days)
-                lastSyncMillis(true, currentMillis);
-                lastSyncDateTime(true, result);
+                sint64_t error = residual * 1000000000 / (sint64_t)interval;
+                sint64_t drift = s_drift + (s_driftValid? error / 4 : error);
+                s_drift      = (drift > MAXDRIFT? MAXDRIFT : (drift < -MAXDRIFT? -MAXDRIFT : drift));
+                s_driftValid = true;
             }
+            // slew
+            s_baseTime   = sampleTime;
+            s_slewOffset = offset;
+            if (absOffset < STABLEOFFSET && s_driftValid)
+                s_pollInterval = (s_pollInterval * 2 < MAXPOLL? s_pollInterval * 2 : MAXPOLL);
+            else
+                s_pollInterval = MINPOLL;
         }
-        
-        return result;
+        s_baseLocal       = sampleLocal;
+        s_lastSampleLocal = sampleLocal;
+        s_lastDelay       = delay;
+        s_timeSet         = true;
+        s_synchronized    = true;
+        s_nextPoll        = sampleLocal + (uint64_t)s_pollInterval * 1000;
     }
-
-
-    DateTime MTD_FLASHMEM DateTime::lastSyncDateTime(bool set, DateTime const& value)
+    
+    
+    // doesn't block. Starts NTP queries when needed.
+    // warn: now() should be called within 49 days from the last call
+    DateTime MTD_FLASHMEM DateTime::now()
     {
-        static DateTime s_lastDateTime;        
-        static bool s_init = false;
+        uint64_t local = localMillis();
+        
+        if (s_defaultNTPServer[0] != 0)
+            pollNTPServers(local);
         
-        if (!s_init)
+        sint64_t time;
+        bool timeSet;
         {
-            // this is necessary because statics classes (like DateTime is not initializated automatically)
-            s_init = true;
-            s_lastDateTime = DateTime();
+            Critical critical;
+            time    = clockTime(local);
+            timeSet = s_timeSet;
         }
-
-        if (set)
-            s_lastDateTime = value;
+        
+        // before the first setting the clock counts from 01/01/2000 without timezone
+        DateTime result;
+        uint32_t unixTime = time / 1000 + (timeSet? result.getTimezoneSeconds() : 0);
+        result.setUnixDateTime(unixTime);
         
         // Maybe this is the first right datetime we see. Setup boot time.
-        if (s_lastDateTime.year > 2000 && ConfigurationManager::getBootDateTime().year == 2000)
+        uint32_t bootTime = unixTime - (uint32_t)(local / 1000);
+        if (timeSet && bootTime >= SECONDS_FROM_1970_TO_2000 && ConfigurationManager::getBootDateTime().year == 2000)
         {
-            ConfigurationManager::getBootDateTime(true, s_lastDateTime);
+            DateTime bootDateTime;
+            bootDateTime.setUnixDateTime(bootTime);
+            ConfigurationManager::getBootDateTime(true, bootDateTime);
         }
-            
-        return s_lastDateTime;
+        
+        return result;
     }
-
-
-    uint32_t MTD_FLASHMEM DateTime::lastSyncMillis(bool set, uint32_t value)
+    
+    
+    void STC_FLASHMEM DateTime::getClockStatus(bool* synchronized, int32_t* drift, uint32_t* pollInterval, uint32_t* delay)
     {
-        static uint32_t s_lastMillis = 0;
-        if (set)
-            s_lastMillis = value;
-        return s_lastMillis;
+        Critical critical;
+        *synchronized = s_synchronized;
+        *drift        = s_drift;
+        *pollInterval = s_pollInterval;
+        *delay        = s_lastDelay;
     }
     
     
@@ -35,6 +35,13 @@ namespace fdv
 
     // Contains datetimes >= 01/01/2000
     // parts from JeeLabs and Rob Tillaart
+    //
+    // now() is driven by a software clock disciplined by NTP, and never blocks:
+    //  - the configured NTP servers (space or comma separated) are queried asynchronously, the reply with the lowest
+    //    round trip delay is used
+    //  - offsets up to STEPTHRESHOLD are slewed (at most SLEWRATE), larger offsets step the clock
+    //  - the frequency error of the local clock is estimated from the offsets measured between queries and applied
+    //    to now(), so the poll interval can grow from MINPOLL up to MAXPOLL
     struct DateTime
     {
 
@@ -82,27 +89,66 @@ namespace fdv
         uint16_t format(char* outbuf, char const* formatstr);
         char const* decode(char const* inbuf, char const* formatstr);
 
+        // doesn't block. Starts NTP queries when needed.
+        // warn: now() should be called within 49 days from the last call
         static DateTime now();
+        
+        // synchronized: at least one NTP reply has been applied
+        // drift: estimated frequency error of the local clock, in ppb (positive when the local clock is slow)
+        // pollInterval: current NTP poll interval in seconds
+        // delay: round trip delay of the last applied NTP reply, in us
+        static void getClockStatus(bool* synchronized, int32_t* drift, uint32_t* pollInterval, uint32_t* delay);
                         
          
     private:
 
         DateTime& setNTPDateTime(uint8_t const* datetimeField);
+        int32_t getTimezoneSeconds() const;
     
         static uint32_t const SECONDS_FROM_1970_TO_2000 = 946684800;
+        static uint32_t const SECONDS_FROM_1970_TO_2100 = 4102444800U;
+        static uint32_t const NTPSERVER_MAXLEN          = 64;
+        static uint32_t const MINPOLL                   = 1024;     // secs, after a step or a large offset
+        static uint32_t const MAXPOLL                   = 65536;    // secs
+        static uint32_t const RETRYPOLL                 = 60;       // secs, after all servers failed
+        static uint32_t const DNSRETRY                  = 2000;     // ms, when server names are still being resolved
+        static uint32_t const STEPTHRESHOLD             = 2000;     // ms, larger offsets step the clock
+        static uint32_t const STABLEOFFSET              = 100;      // ms, smaller offsets double the poll interval
+        static uint32_t const SLEWRATE                  = 500;      // ppm
+        static int32_t const  MAXDRIFT                  = 500000;   // ppb
+        static uint32_t const MAXDELAY                  = 2000000;  // us, samples with larger round trip delay are discarded
+        static uint32_t const MAXSAMPLEAGE              = 60000;    // ms, older samples are discarded
         
         static int8_t      s_defaultTimezoneHours;
         static uint8_t     s_defaultTimezoneMinutes;
-        static IPAddress   s_defaultNTPServer;  // NTP synchronization enabled if s_defaultNTPServer != 0.0.0.0
-        static bool        s_synchingWithNTPServer;
+        static char        s_defaultNTPServer[NTPSERVER_MAXLEN];  // NTP synchronization enabled if s_defaultNTPServer is not empty
+        
+        // software clock (protected by Critical)
+        static uint64_t    s_localMillis;       // 64 bit extension of millis()
+        static uint32_t    s_lastMillis;
+        static sint64_t    s_baseTime;          // UTC unix time in ms at s_baseLocal
+        static uint64_t    s_baseLocal;
+        static int32_t     s_slewOffset;        // ms to be slewed starting from s_baseLocal
+        static int32_t     s_drift;             // ppb
+        static bool        s_timeSet;           // set by NTP or setCurrentDateTime()
+        static bool        s_synchronized;      // set by NTP
+        static bool        s_driftValid;
+        static uint64_t    s_lastSampleLocal;
+        static uint32_t    s_lastDelay;
+        static uint32_t    s_pollInterval;      // secs
+        static uint64_t    s_nextPoll;          // local ms
+        static bool        s_querying;
         
         static uint8_t daysInMonth(uint8_t month);
         static long time2long(uint16_t days, uint8_t h, uint8_t m, uint8_t s);
         static uint16_t date2days(uint16_t y, uint8_t m, uint8_t d);                
         
-        static void syncWithNTPServer();
-        static DateTime lastSyncDateTime(bool set = false, DateTime const& value = DateTime());    // datetime at the time of NTP synchronization
-        static uint32_t lastSyncMillis(bool set = false, uint32_t value = 0);      // millisecs at the time of NTP synchronization
+        static char const* getNTPServerName(char const* list, char* name);
+        static uint64_t localMillis();
+        static sint64_t appliedSlew(uint64_t local);
+        static sint64_t clockTime(uint64_t local);
+        static void pollNTPServers(uint64_t local);
+        static void applyNTPSample(uint64_t serverTime, uint32_t receiveMillis, uint32_t delay);
 
     };
 
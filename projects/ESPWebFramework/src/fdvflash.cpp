@@ -243,20 +243,28 @@ namespace fdv
 	///////////////////////////////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
 
+	// reads at most two flash dwords
 	uint16_t FUNC_FLASHMEM getWord(void const* buffer)
 	{
-		uint8_t const* pc = (uint8_t const*)buffer;
-		return getByte(pc) | (getByte(pc + 1) << 8);
+		FlashReader reader(buffer);
+		uint16_t b0 = reader.read();
+		uint16_t b1 = reader.read();
+		return b0 | (b1 << 8);
 	}
 	
 	
 	///////////////////////////////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
 
+	// reads at most two flash dwords
 	uint32_t FUNC_FLASHMEM getDWord(void const* buffer)
 	{
-		uint8_t const* pc = (uint8_t const*)buffer;
-		return getByte(pc) | (getByte(pc + 1) << 8) | (getByte(pc + 2) << 16) | (getByte(pc + 3) << 24);
+		FlashReader reader(buffer);
+		uint32_t b0 = reader.read();
+		uint32_t b1 = reader.read();
+		uint32_t b2 = reader.read();
+		uint32_t b3 = reader.read();
+		return b0 | (b1 << 8) | (b2 << 16) | (b3 << 24);
 	}
 
     
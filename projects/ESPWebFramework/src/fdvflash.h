@@ -31,8 +31,8 @@
 
 // Flash from 0x0 to 0x8000      mapped at 0x40100000 (RAM), len = 0x8000 (32KBytes) -> ".text"
 // Flash from 0x11000 to 0x6C000 mapped at 0x40211000, len = 0x5B000 (364KBytes)     -> ".irom.text", ".irom0.text", ".irom1.text", ".irom2.text", ".irom3.text", ".irom4.text"
-// Flash from 0x6C000 to 0x6D000 mapped at 0x4026C000, len = 0x1000  (4KBytes)       -> FlashDictionary content
-// Flash from 0x6D000 to 0x7B000 mapped at 0x4026D000, len = 0xE000  (56KBytes)      -> FlashFileSystem content
+// Flash from 0x6C000 to 0x6E000 mapped at 0x4026C000, len = 0x2000  (8KBytes)       -> FlashDictionary content (two sectors)
+// Flash from 0x6E000 to 0x7B000 mapped at 0x4026E000, len = 0xD000  (52KBytes)      -> FlashFileSystem content
 
 static uint32_t const FLASH_MAP_START      = 0x40200000;    // based on the CPU address space
 static uint8_t const* FLASH_MAP_START_PTR  = (uint8_t const*)FLASH_MAP_START;
@@ -40,9 +40,10 @@ static uint8_t const* FLASH_MAP_START_PTR  = (uint8_t const*)FLASH_MAP_START;
 static uint32_t const SDKFLASHSETTINGSZE   = 0x5000;    // info from look at "eagle.app.v6.ld". Used in getBeginOfSDKSettings()
 
 // Flash address space
-static uint32_t const FLASHFILESYSTEM_POS  = 0x6D000;
+static uint32_t const FLASHFILESYSTEM_POS  = 0x6E000;
 static uint8_t const* FLASHFILESYSTEM_PTR  = FLASH_MAP_START_PTR + FLASHFILESYSTEM_POS;
 static uint32_t const FLASH_DICTIONARY_POS = 0x6C000;
+static uint32_t const FLASH_DICTIONARY_SECTORS = 2;     // at least 2 (one active, one for compaction)
 
 
 
@@ -124,6 +125,13 @@ namespace fdv
 	}
 	
 
+	///////////////////////////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////
+	// getFlashAlignedDWord
+	// reads a 32 bit aligned dword from flash, selecting the right flash bank
+	uint32_t getFlashAlignedDWord(uint32_t const* ptr);
+
+
 	///////////////////////////////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////
 	// getChar
@@ -169,6 +177,54 @@ namespace fdv
 	uint32_t getDWord(void const* buffer);
 
 
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+    // FlashReader
+    //
+    // Sequential reader of RAM or Flash data
+    // Flash is read one aligned dword at the time, which serves four consecutive bytes (getByte() reads a dword for each byte)
+    // Data can be unaligned
+    //
+    // Example:
+    //   FlashReader reader(FSTR("hello"));
+    //   for (char c; (c = reader.read()) != 0; )
+    //     dosomething(c);
+    
+    class FlashReader
+    {
+        public:
+            FlashReader(void const* ptr)
+                : m_ptr((uint8_t const*)ptr), m_flash(isStoredInFlash(ptr)), m_wordAddress(0)
+            {
+            }
+            
+            // returns current byte and moves to the next one
+            uint8_t MTD_FLASHMEM read()
+            {
+                if (!m_flash)
+                    return *m_ptr++;
+                uint32_t address = (uint32_t)m_ptr & 0xFFFFFFFC;
+                if (address != m_wordAddress)
+                {
+                    m_word        = getFlashAlignedDWord((uint32_t const*)address);
+                    m_wordAddress = address;
+                }
+                return m_word >> (((uint32_t)m_ptr++ & 0x3) * 8);   // little-endian
+            }
+            
+            uint8_t const* MTD_FLASHMEM get()
+            {
+                return m_ptr;
+            }
+            
+        private:
+            uint8_t const* m_ptr;
+            bool           m_flash;
+            uint32_t       m_wordAddress;   // address of m_word, 0 = none
+            uint32_t       m_word;
+    };
+    
+    
 	//////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////
     // FlashWriter
@@ -0,0 +1,431 @@
+/*
+# Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com)
+# Copyright (c) 2015/2016 Fabrizio Di Vittorio.
+# All rights reserved.
+
+# GNU GPL LICENSE
+#
+# This module is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; latest version thereof,
+# available at: <http://www.gnu.org/licenses/gpl.txt>.
+#
+# This module is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this module; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA
+*/
+
+
+
+
+
+#include "fdv.h"
+
+
+
+
+namespace fdv
+{
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+
+    //////////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////////
+    // MQTTClient
+    
+    // strings of params are copied and can stay in RAM or Flash
+    MTD_FLASHMEM MQTTClient::MQTTClient(Params const& params)
+        : m_params(params),
+          m_host(f_strdup(params.host)),
+          m_clientID(f_strdup(params.clientID)),
+          m_user(f_strdup(params.user)),
+          m_password(f_strdup(params.password)),
+          m_topicPrefix(f_strdup(params.topicPrefix)),
+          m_task(this, true, 400),
+          m_connection(NULL),
+          m_connected(false),
+          m_nextPacketID(0),
+          m_lastSent(0),
+          m_pingPending(false),
+          m_pingTime(0),
+          m_stateValid(false),
+          m_publishedState(0),
+          m_lastPublish(0),
+          m_inflight(false),
+          m_inflightID(0),
+          m_inflightState(0)
+    {
+        m_params.host        = m_host.get();
+        m_params.clientID    = m_clientID.get();
+        m_params.user        = m_user.get();
+        m_params.password    = m_password.get();
+        m_params.topicPrefix = m_topicPrefix.get();
+        m_task.resume();
+    }
+    
+    
+    MTD_FLASHMEM MQTTClient::~MQTTClient()
+    {
+        m_task.terminate();
+        disconnect();
+    }
+    
+    
+    void MTD_FLASHMEM MQTTClient::task()
+    {
+        while (true)
+        {
+            if (connect())
+            {
+                while (processIncoming() && publishState() && keepAlive())
+                    Task::delay(POLLINTERVAL);
+            }
+            disconnect();
+            Task::delay(RECONNECTDELAY);
+        }
+    }
+    
+    
+    bool MTD_FLASHMEM MQTTClient::connect()
+    {
+        IPAddress address = NSLookup::lookup(m_params.host);
+        if (address == IPAddress())
+            return false;
+        m_connection = new TCPClient(address, m_params.port);
+        Socket* socket = m_connection->getSocket();
+        if (!socket->isConnected())
+            return false;
+        socket->setNoDelay(true);
+        socket->setTimeOut(RESPONSETIMEOUT);
+        
+        // CONNECT
+        // MQTT 3.1.1 (3.1.2.9): the password flag requires the user name flag, so a password without user is not sent
+        uint32_t userLength     = f_strlen(m_params.user);
+        uint32_t passwordLength = (userLength? f_strlen(m_params.password) : 0);
+        uint32_t length = 10 + 2 + f_strlen(m_params.clientID) + (userLength? 2 + userLength : 0) + (passwordLength? 2 + passwordLength : 0);
+        APtr<uint8_t> packet(new uint8_t[HEADERSPACE + length]);
+        uint8_t* p = packet.get() + HEADERSPACE;
+        p = putString(p, FSTR("MQTT"));
+        *p++ = 4;   // protocol level (3.1.1)
+        *p++ = CONNECT_CLEANSESSION | (userLength? CONNECT_USERNAME : 0) | (passwordLength? CONNECT_PASSWORD : 0);
+        p = putUInt16(p, m_params.keepAlive);
+        p = putString(p, m_params.clientID);
+        if (userLength)
+            p = putString(p, m_params.user);
+        if (passwordLength)
+            p = putString(p, m_params.password);
+        if (!sendPacket(PACKET_CONNECT, packet.get(), length))
+            return false;
+            
+        // CONNACK, return code 0 = accepted
+        uint8_t header;
+        if (!receivePacket(&header, &length) || header != PACKET_CONNACK || length != 2 || m_rxBuffer[1] != 0)
+            return false;
+            
+        // SUBSCRIBE, SUBACK is ignored
+        APtr<char> topic(f_printf(FSTR("%s/gpio/+/set"), m_params.topicPrefix));
+        length = 2 + 2 + f_strlen(topic.get()) + 1;
+        packet.reset(new uint8_t[HEADERSPACE + length]);
+        p = packet.get() + HEADERSPACE;
+        p = putUInt16(p, getNextPacketID());
+        p = putString(p, topic.get());
+        *p = m_params.QoS;
+        if (!sendPacket(PACKET_SUBSCRIBE, packet.get(), length))
+            return false;
+        
+        m_pingPending = false;
+        m_stateValid  = false;  // publish current state
+        m_inflight    = false;  // clean session, nothing to resend
+        m_connected   = true;
+        return true;
+    }
+    
+    
+    void MTD_FLASHMEM MQTTClient::disconnect()
+    {
+        if (m_connection)
+        {
+            if (m_connected)
+            {
+                uint8_t packet[HEADERSPACE];
+                sendPacket(PACKET_DISCONNECT, packet, 0);
+            }
+            delete m_connection;
+            m_connection = NULL;
+        }
+        m_connected = false;
+    }
+    
+    
+    // processes all available packets
+    // returns false when the connection is lost
+    bool MTD_FLASHMEM MQTTClient::processIncoming()
+    {
+        Socket* socket = m_connection->getSocket();
+        while (true)
+        {
+            uint8_t b;
+            int32_t r = socket->peek(&b, 1, true);
+            if (r == 0)
+                return false;   // closed by the broker
+            if (r < 0)
+            {
+                // no data available?
+                int32_t lastError = socket->getLastError();
+                return lastError == 0 || lastError == EAGAIN;
+            }
+            
+            uint8_t header;
+            uint32_t length;
+            if (!receivePacket(&header, &length))
+                return false;
+            switch (header & 0xF0)
+            {
+                case PACKET_PUBLISH:
+                    if (!processPublish(header, length))
+                        return false;
+                    break;
+                case PACKET_PUBACK:
+                    if (length == 2 && m_inflight && ((m_rxBuffer[0] << 8) | m_rxBuffer[1]) == m_inflightID)
+                        m_inflight = false;
+                    break;
+                case PACKET_PINGRESP:
+                    m_pingPending = false;
+                    break;
+            }
+        }
+    }
+    
+    
+    // handles "<prefix>/gpio/N/set" messages
+    bool MTD_FLASHMEM MQTTClient::processPublish(uint8_t header, uint32_t length)
+    {
+        if (length < 2)
+            return true;
+        uint32_t topicLength = (m_rxBuffer[0] << 8) | m_rxBuffer[1];
+        uint32_t pos = 2 + topicLength;
+        uint8_t QoS = (header >> 1) & 0x03;
+        uint16_t packetID = 0;
+        if (QoS > 0)
+        {
+            if (pos + 2 > length)
+                return true;
+            packetID = (m_rxBuffer[pos] << 8) | m_rxBuffer[pos + 1];
+            pos += 2;
+        }
+        if (pos > length)
+            return true;
+        
+        char const* topic    = (char const*)m_rxBuffer + 2;
+        char const* topicEnd = topic + topicLength;
+        uint32_t prefixLength = f_strlen(m_params.topicPrefix);
+        if (topicLength > prefixLength + 6 && memcmp(topic, m_params.topicPrefix, prefixLength) == 0 && f_memcmp(topic + prefixLength, FSTR("/gpio/"), 6) == 0)
+        {
+            char const* c = topic + prefixLength + 6;
+            uint32_t gpio = 0;
+            for (; c != topicEnd && isdigit(*c); ++c)
+                gpio = gpio * 10 + (*c - '0');
+            if (topicEnd - c == 4 && f_memcmp(c, FSTR("/set"), 4) == 0 && pos < length && gpio <= 16 && (m_params.outputsMask & (1 << gpio)))
+                GPIOX(gpio).write(m_rxBuffer[pos] == '1');
+        }
+        
+        if (QoS > 0)
+        {
+            uint8_t packet[HEADERSPACE + 2];
+            putUInt16(packet + HEADERSPACE, packetID);
+            return sendPacket(PACKET_PUBACK, packet, 2);
+        }
+        return true;
+    }
+    
+    
+    // publishes GPIO states when changed, at most once every publishInterval
+    bool MTD_FLASHMEM MQTTClient::publishState()
+    {
+        if (m_params.inputsMask == 0)
+            return true;
+            
+        uint32_t now = millis();
+        if (m_inflight)
+        {
+            // resend unacknowledged message, new changes wait
+            if (millisDiff(m_lastPublish, now) < RETRYTIMEOUT)
+                return true;
+            m_lastPublish = now;
+            return sendPublish(m_inflightState, m_inflightID, PUBLISH_QOS1 | PUBLISH_DUP);
+        }
+        
+        uint32_t state = readGPIOs();
+        if ((m_stateValid && state == m_publishedState) || millisDiff(m_lastPublish, now) < m_params.publishInterval)
+            return true;
+        m_publishedState = state;
+        m_stateValid     = true;
+        m_lastPublish    = now;
+        if (m_params.QoS == 0)
+            return sendPublish(state, 0, 0);
+        m_inflight      = true;
+        m_inflightID    = getNextPacketID();
+        m_inflightState = state;
+        return sendPublish(state, m_inflightID, PUBLISH_QOS1);
+    }
+    
+    
+    // returns false when the broker doesn't reply to PINGREQ
+    bool MTD_FLASHMEM MQTTClient::keepAlive()
+    {
+        if (m_params.keepAlive == 0)
+            return true;
+        uint32_t now = millis();
+        uint32_t keepAliveMs = m_params.keepAlive * 1000;
+        if (m_pingPending)
+            return millisDiff(m_pingTime, now) < keepAliveMs;
+        if (millisDiff(m_lastSent, now) >= keepAliveMs / 2)
+        {
+            m_pingPending = true;
+            m_pingTime    = now;
+            uint8_t packet[HEADERSPACE];
+            return sendPacket(PACKET_PINGREQ, packet, 0);
+        }
+        return true;
+    }
+    
+    
+    // packet ID cannot be 0
+    uint16_t MTD_FLASHMEM MQTTClient::getNextPacketID()
+    {
+        m_nextPacketID = (m_nextPacketID == 0xFFFF? 1 : m_nextPacketID + 1);
+        return m_nextPacketID;
+    }
+    
+    
+    bool MTD_FLASHMEM MQTTClient::sendPublish(uint32_t state, uint16_t packetID, uint8_t flags)
+    {
+        // payload, ex: {"0":1,"2":0}
+        char payload[4 + 17 * 7];
+        uint32_t payloadLength = 0;
+        payload[payloadLength++] = '{';
+        for (uint32_t i = 0; i != 17; ++i)
+            if (m_params.inputsMask & (1 << i))
+                payloadLength += sprintf(payload + payloadLength, FSTR("\"%d\":%d,"), i, (state >> i) & 1);
+        if (payload[payloadLength - 1] == ',')
+            --payloadLength;
+        payload[payloadLength++] = '}';
+        
+        APtr<char> topic(f_printf(FSTR("%s/gpio"), m_params.topicPrefix));
+        uint32_t length = 2 + f_strlen(topic.get()) + (flags & PUBLISH_QOS1? 2 : 0) + payloadLength;
+        APtr<uint8_t> packet(new uint8_t[HEADERSPACE + length]);
+        uint8_t* p = putString(packet.get() + HEADERSPACE, topic.get());
+        if (flags & PUBLISH_QOS1)
+            p = putUInt16(p, packetID);
+        memcpy(p, payload, payloadLength);
+        return sendPacket(PACKET_PUBLISH | PUBLISH_RETAIN | flags, packet.get(), length);
+    }
+    
+    
+    // packet must contain HEADERSPACE free bytes followed by "length" bytes of variable header and payload
+    bool MTD_FLASHMEM MQTTClient::sendPacket(uint8_t header, uint8_t* packet, uint32_t length)
+    {
+        // remaining length
+        uint8_t lengthBytes[4];
+        uint32_t count = 0;
+        uint32_t value = length;
+        do
+        {
+            lengthBytes[count] = value & 0x7F;
+            value >>= 7;
+            if (value > 0)
+                lengthBytes[count] |= 0x80;
+            ++count;
+        } while (value > 0 && count != 4);
+        
+        uint8_t* start = packet + HEADERSPACE - count - 1;
+        start[0] = header;
+        memcpy(start + 1, lengthBytes, count);
+        
+        m_lastSent = millis();
+        uint32_t size = 1 + count + length;
+        return m_connection->getSocket()->write(start, size) == (int32_t)size;
+    }
+    
+    
+    // packets longer than MAXPACKETSIZE are discarded (header = 0, length = 0)
+    bool MTD_FLASHMEM MQTTClient::receivePacket(uint8_t* header, uint32_t* length)
+    {
+        if (!readBytes(header, 1))
+            return false;
+        uint32_t value = 0;
+        for (uint32_t shift = 0; ; shift += 7)
+        {
+            uint8_t b;
+            if (shift > 21 || !readBytes(&b, 1))
+                return false;
+            value |= (uint32_t)(b & 0x7F) << shift;
+            if ((b & 0x80) == 0)
+                break;
+        }
+        if (value > MAXPACKETSIZE)
+        {
+            while (value > 0)
+            {
+                uint32_t chunk = (value < MAXPACKETSIZE? value : MAXPACKETSIZE);
+                if (!readBytes(m_rxBuffer, chunk))
+                    return false;
+                value -= chunk;
+            }
+            *header = 0;
+        }
+        *length = value;
+        return readBytes(m_rxBuffer, value);
+    }
+    
+    
+    bool MTD_FLASHMEM MQTTClient::readBytes(uint8_t* buffer, uint32_t length)
+    {
+        Socket* socket = m_connection->getSocket();
+        for (uint32_t pos = 0; pos != length; )
+        {
+            int32_t r = socket->read(buffer + pos, length - pos);
+            if (r <= 0)
+                return false;
+            pos += r;
+        }
+        return true;
+    }
+    
+    
+    uint32_t MTD_FLASHMEM MQTTClient::readGPIOs()
+    {
+        uint32_t state = 0;
+        for (uint32_t i = 0; i != 17; ++i)
+            if (m_params.inputsMask & (1 << i))
+                state |= (uint32_t)GPIOX(i).read() << i;
+        return state;
+    }
+    
+    
+    // big-endian
+    uint8_t* STC_FLASHMEM MQTTClient::putUInt16(uint8_t* dest, uint16_t value)
+    {
+        dest[0] = value >> 8;
+        dest[1] = value & 0xFF;
+        return dest + 2;
+    }
+    
+    
+    // str can stay in RAM or Flash
+    uint8_t* STC_FLASHMEM MQTTClient::putString(uint8_t* dest, char const* str)
+    {
+        uint32_t length = f_strlen(str);
+        dest = putUInt16(dest, length);
+        f_memcpy(dest, str, length);
+        return dest + length;
+    }
+
+#endif  // FDV_INCLUDE_MQTTCLIENT
+    
+}
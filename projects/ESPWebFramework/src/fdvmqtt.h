@@ -0,0 +1,166 @@
+/*
+# Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com)
+# Copyright (c) 2015/2016 Fabrizio Di Vittorio.
+# All rights reserved.
+
+# GNU GPL LICENSE
+#
+# This module is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; latest version thereof,
+# available at: <http://www.gnu.org/licenses/gpl.txt>.
+#
+# This module is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this module; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA
+*/
+
+
+
+
+#ifndef _FDVMQTT_H_
+#define _FDVMQTT_H_
+
+#include "fdv.h"
+
+
+
+
+namespace fdv
+{
+
+#if (FDV_INCLUDE_MQTTCLIENT == 1)
+
+    //////////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////////
+    // MQTTClient
+    // MQTT 3.1.1 client which publishes GPIO states and writes GPIOs on request.
+    // Runs in its own task, reconnecting automatically when the connection is lost.
+    //
+    // Topics (<prefix> is Params::topicPrefix):
+    //   <prefix>/gpio       : published (retained) when one or more GPIOs change. Changes happening within
+    //                         publishInterval are coalesced into one message. Payload is a JSON object with
+    //                         the state of all GPIOs in inputsMask, ex: {"0":1,"2":0}
+    //   <prefix>/gpio/N/set : subscribed. Payload "1" or "0" writes GPIO N (if N is in outputsMask)
+    //
+    // A QoS 1 message is resent until acknowledged: meanwhile new changes are coalesced into the next message.
+    // Incoming messages longer than MAXPACKETSIZE are ignored.
+    //
+    // Example, using mosquitto clients:
+    //   mosquitto_sub -t 'esp8266/gpio'
+    //   mosquitto_pub -t 'esp8266/gpio/2/set' -m 1
+
+    class MQTTClient
+    {
+        
+        static uint32_t const MAXPACKETSIZE   = 128;
+        static uint32_t const HEADERSPACE     = 5;       // fixed header: type + up to 4 bytes of remaining length
+        static uint32_t const POLLINTERVAL    = 20;      // ms
+        static uint32_t const RECONNECTDELAY  = 5000;    // ms
+        static uint32_t const RESPONSETIMEOUT = 5000;    // ms
+        static uint32_t const RETRYTIMEOUT    = 5000;    // ms
+        
+        // control packet types
+        static uint8_t const PACKET_CONNECT     = 0x10;
+        static uint8_t const PACKET_CONNACK     = 0x20;
+        static uint8_t const PACKET_PUBLISH     = 0x30;
+        static uint8_t const PACKET_PUBACK      = 0x40;
+        static uint8_t const PACKET_SUBSCRIBE   = 0x82;
+        static uint8_t const PACKET_SUBACK      = 0x90;
+        static uint8_t const PACKET_PINGREQ     = 0xC0;
+        static uint8_t const PACKET_PINGRESP    = 0xD0;
+        static uint8_t const PACKET_DISCONNECT  = 0xE0;
+        
+        // PUBLISH flags
+        static uint8_t const PUBLISH_RETAIN     = 0x01;
+        static uint8_t const PUBLISH_QOS1       = 0x02;
+        static uint8_t const PUBLISH_DUP        = 0x08;
+        
+        // CONNECT flags
+        static uint8_t const CONNECT_CLEANSESSION = 0x02;
+        static uint8_t const CONNECT_PASSWORD     = 0x40;
+        static uint8_t const CONNECT_USERNAME     = 0x80;
+        
+    public:
+    
+        struct Params
+        {
+            char const* host;               // broker name or IP
+            uint16_t    port;
+            char const* clientID;           // empty = assigned by the broker
+            char const* user;               // empty = no user
+            char const* password;           // empty = no password (ignored when user is empty)
+            char const* topicPrefix;
+            uint16_t    keepAlive;          // seconds (0 = disabled)
+            uint32_t    publishInterval;    // ms
+            uint8_t     QoS;                // 0 or 1
+            uint32_t    inputsMask;         // bit N = 1: state of GPIO N is published
+            uint32_t    outputsMask;        // bit N = 1: GPIO N can be written
+        };
+    
+        // strings of params are copied and can stay in RAM or Flash
+        MQTTClient(Params const& params);
+        
+        ~MQTTClient();
+        
+        bool isConnected()
+        {
+            return m_connected;
+        }
+        
+    private:
+    
+        void task();
+        
+        bool connect();
+        void disconnect();
+        bool processIncoming();
+        bool processPublish(uint8_t header, uint32_t length);
+        bool publishState();
+        bool keepAlive();
+        
+        uint16_t getNextPacketID();
+        bool sendPublish(uint32_t state, uint16_t packetID, uint8_t flags);
+        bool sendPacket(uint8_t header, uint8_t* packet, uint32_t length);
+        bool receivePacket(uint8_t* header, uint32_t* length);
+        bool readBytes(uint8_t* buffer, uint32_t length);
+        uint32_t readGPIOs();
+        
+        static uint8_t* putUInt16(uint8_t* dest, uint16_t value);
+        static uint8_t* putString(uint8_t* dest, char const* str);
+        
+    private:
+    
+        Params                                     m_params;
+        APtr<char>                                 m_host;
+        APtr<char>                                 m_clientID;
+        APtr<char>                                 m_user;
+        APtr<char>                                 m_password;
+        APtr<char>                                 m_topicPrefix;
+        MethodTask<MQTTClient, &MQTTClient::task>  m_task;
+        TCPClient*                                 m_connection;
+        bool volatile                              m_connected;
+        uint8_t                                    m_rxBuffer[MAXPACKETSIZE];
+        uint16_t                                   m_nextPacketID;
+        uint32_t                                   m_lastSent;           // millis
+        bool                                       m_pingPending;
+        uint32_t                                   m_pingTime;           // millis
+        bool                                       m_stateValid;         // false = state must be published
+        uint32_t                                   m_publishedState;
+        uint32_t                                   m_lastPublish;        // millis
+        bool                                       m_inflight;           // QoS 1 message waiting for PUBACK
+        uint16_t                                   m_inflightID;
+        uint32_t                                   m_inflightState;
+    };
+
+#endif  // FDV_INCLUDE_MQTTCLIENT
+    
+}
+
+
+#endif
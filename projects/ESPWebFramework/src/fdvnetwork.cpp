@@ -32,6 +32,7 @@ extern "C"
 	#include "lwip/dns.h"
 	#include "lwip/netdb.h"
 	#include "lwip/api.h"
+	#include "lwip/udp.h"
 	#include "lwip/netbuf.h"
     #include "lwip/inet.h"
     #include "lwip/netif/etharp.h"
@@ -151,10 +152,12 @@ namespace fdv
 	// WiFi
 	
     
+    // changing mode adds or removes network interfaces
     WiFi::Mode STC_FLASHMEM WiFi::setMode(Mode mode)
     {
         Critical critical;
         wifi_set_opmode(mode);
+        Router::invalidateRouteCache();
     }
     
     
@@ -235,25 +238,81 @@ namespace fdv
     }
     
     
-    // returns access point list
-    WiFi::APInfo* STC_FLASHMEM WiFi::getAPList(uint32_t* count, bool rescan, bool canRetry)
+    WiFi::APInfo* WiFi::s_APList = NULL;
+    
+    uint32_t WiFi::s_APCount = 0;
+    
+    bool WiFi::s_APListValid = false;
+    
+    uint32_t WiFi::s_APListTime = 0;
+    
+    uint32_t WiFi::s_APListMaxAge = DEFAULTAPLISTMAXAGE;
+    
+    bool volatile WiFi::s_scanning = false;
+    
+    uint32_t WiFi::s_scanStartTime = 0;
+    
+    
+    // returns a copy of the cached access point list, free it using delete[]
+    WiFi::APInfo* STC_FLASHMEM WiFi::getAPList(uint32_t* count, bool refresh)
     {
-        if (rescan)
+        bool stale = !s_APListValid || millisDiff(s_APListTime, millis()) > s_APListMaxAge;
+        if (stale || refresh)
+            scan();
+        if (refresh || !s_APListValid)
         {
-            if (getMode() == AccessPoint)
-                setMode(ClientAndAccessPoint);
-            wifi_station_scan(NULL, scanDoneCB);
-            getAPInfo()->receive();	// wait for completion
+            waitScan();
+            if (s_APCount == 0)
+            {
+                // first scan after switching to client mode may return nothing, retry once
+                scan();
+                waitScan();
+            }
         }
-        APInfo* infos;
-        getAPInfo(&infos, count);
-        if (*count == 0 && canRetry)
+        
+        // allocate outside of critical section, the list may change meanwhile
+        uint32_t allocated = s_APCount;
+        APInfo* infos = (allocated > 0? new APInfo[allocated] : NULL);
+        if (infos == NULL)
         {
-            // retry
-            return getAPList(count, true, false);   // canRetry = false, no more retry to avoid infinite recursive calls
+            *count = 0;
+            return NULL;
         }
+        Critical critical;
+        *count = min(allocated, s_APCount);
+        memcpy(infos, s_APList, sizeof(APInfo) * (*count));
         return infos;
     }
+    
+    
+    // starts a background scan. Concurrent calls share the scan in progress
+    bool STC_FLASHMEM WiFi::scan()
+    {
+        {
+            Critical critical;
+            // a scan not completed within SCANTIMEOUT is considered lost
+            if (s_scanning && millisDiff(s_scanStartTime, millis()) < SCANTIMEOUT)
+                return true;
+            s_scanning = true;
+            s_scanStartTime = millis();
+        }
+        if (getMode() == AccessPoint)
+            setMode(ClientAndAccessPoint);
+        if (!wifi_station_scan(NULL, scanDoneCB))
+        {
+            s_scanning = false;
+            return false;
+        }
+        return true;
+    }
+    
+    
+    void STC_FLASHMEM WiFi::waitScan()
+    {
+        SoftTimeOut timeOut(SCANTIMEOUT);
+        while (s_scanning && !timeOut)
+            Task::delay(100);
+    }
 
     
     void STC_FLASHMEM WiFi::scanDoneCB(void* arg, STATUS status)
@@ -265,54 +324,37 @@ namespace fdv
             for (bss_info* bss_link = ((bss_info*)arg)->next.stqe_next; bss_link; bss_link = bss_link->next.stqe_next)
                 ++count;
             // fill items
-            APInfo* infos;
-            getAPInfo(&infos, &count, count);
-            for (bss_info* bss_link = ((bss_info*)arg)->next.stqe_next; bss_link; bss_link = bss_link->next.stqe_next, ++infos)
+            APInfo* infos = (count > 0? new APInfo[count] : NULL);
+            if (count > 0 && infos == NULL)
             {
-                memcpy(infos->BSSID, bss_link->bssid, 6);
-                memset(infos->SSID, 0, 33);
-                memcpy(infos->SSID, bss_link->ssid, 32);
-                infos->Channel  = bss_link->channel;
-                infos->RSSI     = bss_link->rssi;
-                infos->AuthMode = (SecurityProtocol)bss_link->authmode;
-                infos->isHidden = (bool)bss_link->is_hidden;
+                // out of memory: keep the old cached list
+                s_scanning = false;
+                return;
             }
-            getAPInfo()->signal();
-        }
-    }
-    
-    
-    // allocateCount >= 0 -> allocate (or reallocate or free) AP info
-    // allocateCount < 0  -> get infos
-    Queue<bool>* STC_FLASHMEM WiFi::getAPInfo(APInfo** infos, uint32_t* count, int32_t allocateCount)
-    {
-        static bool         s_init  = false;
-        static APInfo*      s_infos = NULL;
-        static uint32_t     s_count = 0;
-        static Queue<bool>* s_queue;
-        if (!s_init)
-        {
-            s_queue = new Queue<bool>(1);	// never deleted        
-            s_init = true;
-        }
-        if (allocateCount >= 0)
-        {
-            if (s_infos != NULL)
-                delete[] s_infos;
-            s_infos = NULL;
-            s_count = 0;
-            if (allocateCount > 0)
+            APInfo* info = infos;
+            for (bss_info* bss_link = ((bss_info*)arg)->next.stqe_next; bss_link; bss_link = bss_link->next.stqe_next, ++info)
             {
-                s_infos = new APInfo[allocateCount];
-                s_count = allocateCount;
+                memcpy(info->BSSID, bss_link->bssid, 6);
+                memset(info->SSID, 0, 33);
+                memcpy(info->SSID, bss_link->ssid, 32);
+                info->Channel  = bss_link->channel;
+                info->RSSI     = bss_link->rssi;
+                info->AuthMode = (SecurityProtocol)bss_link->authmode;
+                info->isHidden = (bool)bss_link->is_hidden;
             }
+            // replace cached list
+            APInfo* oldInfos;
+            {
+                Critical critical;
+                oldInfos      = s_APList;
+                s_APList      = infos;
+                s_APCount     = count;
+                s_APListTime  = millis();
+                s_APListValid = true;
+            }
+            delete[] oldInfos;
         }
-        if (infos && count)
-        {
-            *infos = s_infos;
-            *count = s_count;
-        }
-        return s_queue;
+        s_scanning = false;
     }
 		
 
@@ -332,6 +374,7 @@ namespace fdv
         wifi_station_dhcpc_stop();
         wifi_softap_dhcps_stop();
         wifi_set_ip_info(network, &info);
+        Router::invalidateRouteCache();
     }
     
     
@@ -342,6 +385,7 @@ namespace fdv
         {
             Critical critical;
             wifi_station_dhcpc_start();
+            Router::invalidateRouteCache();
         }
     }
     
@@ -389,26 +433,277 @@ namespace fdv
     // NSLookup (DNS client)
     
     
+    NSLookup::CacheEntry NSLookup::s_cache[CACHE_SIZE];    // zero filled, all entries are "Free"
+    
+    
     MTD_FLASHMEM NSLookup::NSLookup(char const* hostname)
     {    
         m_ipaddr = lookup(hostname);
     }
     
     
-    // returns IPAddress(0, 0, 0, 0) on fail
-    IPAddress MTD_FLASHMEM NSLookup::lookup(char const* hostname)
+    // returns IPAddress(0, 0, 0, 0) on fail or timeout
+    IPAddress MTD_FLASHMEM NSLookup::lookup(char const* hostname, uint32_t timeOut)
+    {
+        IPAddress address;
+        Queue<IPAddress> queue(1);
+        if (!lookupAsync(hostname, &address, lookupCB, &queue) && !queue.receive(&address, timeOut))
+        {
+            // timeout: lookupCB must not use "queue" anymore
+            if (!removeWaiter(lookupCB, &queue))
+                queue.receive(&address);    // too late, lookupCB is going to be called
+        }
+        return address;
+    }
+    
+    
+    // returns true when the result is immediately available (cached or numeric address): *address contains it (0.0.0.0 on fail).
+    // returns false when a DNS query is in progress: callback (if not NULL) will be called once with the result.
+    // Fails (returns true and 0.0.0.0) also when all cache entries are pending or too many callbacks wait for the same name.
+    bool MTD_FLASHMEM NSLookup::lookupAsync(char const* hostname, IPAddress* address, Callback callback, void* arg)
+    {
+        uint32_t now = millis();
+        bool result;
+        
+        // look into the cache
+        {
+            Critical critical;
+            if (checkCache(hostname, now, address, callback, arg, &result))
+                return result;
+        }
+        
+        // lwIP needs a RAM copy of hostname
+        char* name = f_strdup(hostname);
+        
+        // numeric address doesn't need a query
+        in_addr_t numeric = ipaddr_addr(name);
+        if (numeric != IPADDR_NONE)
+        {
+            delete[] name;
+            *address = IPAddress(numeric);
+            return true;
+        }
+        
+        // prepare a pending entry
+        CacheEntry* entry = NULL;
+        char* oldName = NULL;
+        Waiter staleWaiters[MAX_WAITERS] = { };
+        bool cached;
+        {
+            Critical critical;
+            // another task could have queried the same name in the meantime
+            cached = checkCache(name, now, address, callback, arg, &result);
+            if (!cached)
+            {
+                entry = findEntry(name);    // expired entry of the same name?
+                if (entry == NULL)
+                    entry = getFreeEntry();
+                if (entry)
+                {
+                    if (entry->state == Pending)
+                        memcpy(staleWaiters, entry->waiters, sizeof(staleWaiters));   // lost query
+                    oldName = entry->hostname;
+                    entry->hostname = name;
+                    entry->address  = 0;
+                    entry->time     = now;
+                    entry->lastUsed = now;
+                    entry->state    = Pending;
+                    memset(entry->waiters, 0, sizeof(entry->waiters));
+                    addWaiter(entry, callback, arg);
+                    name = NULL;
+                }
+            }
+        }
+        delete[] oldName;
+        delete[] name;
+        for (uint32_t i = 0; i != MAX_WAITERS; ++i)
+            if (staleWaiters[i].callback)
+                staleWaiters[i].callback(IPAddress(0, 0, 0, 0), staleWaiters[i].arg);
+        if (cached)
+            return result;
+        if (entry == NULL)
+        {
+            // all entries are pending
+            *address = IPAddress(0, 0, 0, 0);
+            return true;
+        }
+        
+        // query (the pending entry cannot be removed by other tasks)
+        ip_addr_t ipaddr;
+        err_t err = dns_gethostbyname(entry->hostname, &ipaddr, dnsFoundCB, NULL);
+        if (err == ERR_INPROGRESS)
+            return false;
+        
+        // immediate result (lwIP cache) or error: this caller doesn't want to be called back
+        removeWaiter(callback, arg, entry);
+        complete(entry->hostname, err == ERR_OK? &ipaddr : NULL);
+        *address = (err == ERR_OK? IPAddress(ipaddr) : IPAddress(0, 0, 0, 0));
+        return true;
+    }
+    
+    
+    // removes all not pending entries
+    void MTD_FLASHMEM NSLookup::flushCache()
+    {
+        char* names[CACHE_SIZE] = { };
+        {
+            Critical critical;
+            for (uint32_t i = 0; i != CACHE_SIZE; ++i)
+                if (s_cache[i].state != Pending)
+                {
+                    names[i] = s_cache[i].hostname;
+                    s_cache[i].hostname = NULL;
+                    s_cache[i].state    = Free;
+                }
+        }
+        for (uint32_t i = 0; i != CACHE_SIZE; ++i)
+            delete[] names[i];
+    }
+    
+    
+    // must be called inside a critical section
+    // returns true if the request has been handled (*result contains lookupAsync() return value)
+    bool MTD_FLASHMEM NSLookup::checkCache(char const* hostname, uint32_t now, IPAddress* address, Callback callback, void* arg, bool* result)
+    {
+        CacheEntry* entry = findEntry(hostname);
+        if (entry == NULL || isExpired(entry, now))
+            return false;
+        if (entry->state == Pending)
+        {
+            // share the query in progress
+            *result = !addWaiter(entry, callback, arg);
+            if (*result)
+                *address = IPAddress(0, 0, 0, 0);   // too many waiters
+            return true;
+        }
+        entry->lastUsed = now;
+        *address = IPAddress((in_addr_t)entry->address);
+        *result = true;
+        return true;
+    }
+    
+    
+    // must be called inside a critical section
+    NSLookup::CacheEntry* MTD_FLASHMEM NSLookup::findEntry(char const* hostname)
+    {
+        for (uint32_t i = 0; i != CACHE_SIZE; ++i)
+            if (s_cache[i].state != Free && f_strcmp(s_cache[i].hostname, hostname) == 0)
+                return &s_cache[i];
+        return NULL;
+    }
+    
+    
+    // must be called inside a critical section
+    // returns a free entry, otherwise the least recently used not pending one. NULL if all entries are pending.
+    NSLookup::CacheEntry* MTD_FLASHMEM NSLookup::getFreeEntry()
+    {
+        uint32_t now = millis();
+        CacheEntry* candidate = NULL;
+        for (uint32_t i = 0; i != CACHE_SIZE; ++i)
+        {
+            CacheEntry* entry = &s_cache[i];
+            if (entry->state == Free)
+                return entry;
+            if (entry->state != Pending && (candidate == NULL || millisDiff(entry->lastUsed, now) > millisDiff(candidate->lastUsed, now)))
+                candidate = entry;
+        }
+        return candidate;
+    }
+    
+    
+    bool MTD_FLASHMEM NSLookup::isExpired(CacheEntry const* entry, uint32_t now)
+    {
+        uint32_t age = millisDiff(entry->time, now);
+        switch (entry->state)
+        {
+            case Pending:
+                return age > PENDING_TIMEOUT;
+            case Resolved:
+                return age > CACHE_TTL;
+            case Failed:
+                return age > NEGATIVE_TTL;
+            default:
+                return true;
+        }
+    }
+    
+    
+    // must be called inside a critical section
+    // returns false if there isn't space for another waiter
+    bool MTD_FLASHMEM NSLookup::addWaiter(CacheEntry* entry, Callback callback, void* arg)
+    {
+        if (callback == NULL)
+            return true;
+        for (uint32_t i = 0; i != MAX_WAITERS; ++i)
+            if (entry->waiters[i].callback == NULL)
+            {
+                entry->waiters[i].callback = callback;
+                entry->waiters[i].arg      = arg;
+                return true;
+            }
+        return false;
+    }
+    
+    
+    // entry = NULL: look into all entries
+    // returns false if the waiter was not found (not registered or already called)
+    bool MTD_FLASHMEM NSLookup::removeWaiter(Callback callback, void* arg, CacheEntry* entry)
+    {
+        Critical critical;
+        for (uint32_t i = 0; i != CACHE_SIZE; ++i)
+        {
+            if (entry && entry != &s_cache[i])
+                continue;
+            for (uint32_t j = 0; j != MAX_WAITERS; ++j)
+            {
+                Waiter* waiter = &s_cache[i].waiters[j];
+                if (waiter->callback == callback && waiter->arg == arg)
+                {
+                    waiter->callback = NULL;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    
+    // stores the result and calls waiting callbacks
+    // ipaddr = NULL on fail
+    void MTD_FLASHMEM NSLookup::complete(char const* hostname, ip_addr_t const* ipaddr)
     {
-        APtr<char> memHostName( f_strdup(hostname) );
-        addrinfo* addrinfo;
-        if (lwip_getaddrinfo(memHostName.get(), NULL, NULL, &addrinfo) == 0 && addrinfo)
+        uint32_t now = millis();
+        Waiter waiters[MAX_WAITERS];
+        IPAddress address;
         {
-            // according to lwip documentation uses only first item of "addrinfo"
-            sockaddr_in* sa = (sockaddr_in*)(addrinfo->ai_addr);
-            in_addr_t addr = sa->sin_addr.s_addr;
-            lwip_freeaddrinfo(addrinfo);
-            return IPAddress(addr);
+            Critical critical;
+            CacheEntry* entry = findEntry(hostname);
+            if (entry == NULL || entry->state != Pending)
+                return;
+            entry->state   = (ipaddr? Resolved : Failed);
+            entry->address = (ipaddr? ipaddr->addr : 0);
+            entry->time    = now;
+            memcpy(waiters, entry->waiters, sizeof(waiters));
+            memset(entry->waiters, 0, sizeof(entry->waiters));
+            address = IPAddress((in_addr_t)entry->address);
         }
-        return IPAddress(0, 0, 0, 0);   // fail!
+        for (uint32_t i = 0; i != MAX_WAITERS; ++i)
+            if (waiters[i].callback)
+                waiters[i].callback(address, waiters[i].arg);
+    }
+    
+    
+    // called by lwIP
+    void STC_FLASHMEM NSLookup::dnsFoundCB(char const* name, ip_addr_t* ipaddr, void* arg)
+    {
+        complete(name, ipaddr);
+    }
+    
+    
+    // used by lookup(), arg is a Queue<IPAddress>
+    void STC_FLASHMEM NSLookup::lookupCB(IPAddress address, void* arg)
+    {
+        ((Queue<IPAddress>*)arg)->send(address, 0);
     }
     
     
@@ -422,6 +717,7 @@ namespace fdv
     {
         ip_addr_t a = server.get_ip_addr_t();
         dns_setserver(num, &a);
+        flushCache();
     }
     
     
@@ -604,7 +900,7 @@ namespace fdv
 	// HTTPResponse
 	
     MTD_FLASHMEM HTTPResponse::HTTPResponse(HTTPHandler* httpHandler, char const* status, char const* content)
-        : m_httpHandler(httpHandler), m_status(status), m_headersFlushed(false)
+        : m_httpHandler(httpHandler), m_status(status), m_rawHeaders(NULL), m_headersFlushed(false)
     {
         // content (if present, otherwise use addContent())
         if (content)
@@ -647,6 +943,14 @@ namespace fdv
     {
         m_content.addChunks(src);
     }
+    
+    
+    // can be called many times
+    // slice data is not copied, the response keeps a reference to it
+    void MTD_FLASHMEM HTTPResponse::addContent(CharSlice const& slice)
+    {
+        m_content.addChunk(slice);
+    }
             
             
     void MTD_FLASHMEM HTTPResponse::flushHeaders(uint32_t contentLength)
@@ -663,11 +967,18 @@ namespace fdv
             for (uint32_t i = 0; i != m_headers.getItemsCount(); ++i)
             {
                 Fields::Item* item = m_headers[i];
-                m_httpHandler->getSocket()->writeFmt(FSTR("%s: %s\r\n"), APtr<char>(t_strdup(item->key)).get(), APtr<char>(t_strdup(item->value)).get());
+                m_httpHandler->getSocket()->writeFmt(FSTR("%s: %s\r\n"), item->key.get(), item->value.get());    // writeFmt accepts Flash strings
             }
+            
+            // precomputed headers
+            if (m_rawHeaders)
+                m_httpHandler->getSocket()->write(m_rawHeaders);
 
             // content length header
-            m_httpHandler->getSocket()->writeFmt(FSTR("%s: %d\r\n\r\n"), STR_Content_Length, contentLength);
+            if (contentLength != UNKNOWNLENGTH)
+                m_httpHandler->getSocket()->writeFmt(FSTR("%s: %d\r\n\r\n"), STR_Content_Length, contentLength);
+            else
+                m_httpHandler->getSocket()->write(FSTR("\r\n"));
 
             m_headersFlushed = true;
         }
@@ -731,43 +1042,43 @@ namespace fdv
 		char const* start = curc;
 		char const* curBlockKey      = NULL;
 		char const* curBlockKeyEnd   = NULL;
-		while (curc != m_strEnd)
+		while (curc < m_strEnd)
 		{
-			char c0 = getChar(curc);
-			if (c0 == '{')
+			// jump to next '{', reading the template one dword at the time
+			curc = (char const*)f_memchr(curc, '{', m_strEnd - curc);
+			if (curc == NULL)
+				break;
+			char c1 = getChar(curc + 1);
+			if (c1 == '{')
+			{
+				// found "{{"
+				// push previous content
+				m_results.last()->addChunk(start, curc - start, false);
+				// process parameter tag
+				start = curc = replaceTag(curc);
+				continue;
+			}
+			else if (c1 == '%')
 			{
-				char c1 = getChar(curc + 1);
-				if (c1 == '{')
+				// found "{%"
+				// push previous content
+				if (curBlockKey && curBlockKeyEnd)
 				{
-					// found "{{"
-					// push previous content
 					m_results.last()->addChunk(start, curc - start, false);
-					// process parameter tag
-					start = curc = replaceTag(curc);
-					continue;
+					m_blocks.add(curBlockKey, curBlockKeyEnd, m_results.last());
+					m_results.add(new LinkedCharChunks);
 				}
-				else if (c1 == '%')
+				// process block tag
+				curBlockKey = extractTagStr(curc, &curBlockKeyEnd);
+				start = curc = curBlockKeyEnd + 2;	// bypass "%}"
+				// if this is the first block tag then this is the template file name
+				if (m_template.get() == NULL)
 				{
-					// found "{%"
-					// push previous content
-					if (curBlockKey && curBlockKeyEnd)
-					{
-						m_results.last()->addChunk(start, curc - start, false);
-						m_blocks.add(curBlockKey, curBlockKeyEnd, m_results.last());
-                        m_results.add(new LinkedCharChunks);
-					}
-					// process block tag
-					curBlockKey = extractTagStr(curc, &curBlockKeyEnd);
-					start = curc = curBlockKeyEnd + 2;	// bypass "%}"
-					// if this is the first block tag then this is the template file name
-					if (m_template.get() == NULL)
-					{
-						m_template.reset(f_strdup(curBlockKey, curBlockKeyEnd));
-						curBlockKey = NULL;
-						curBlockKeyEnd = NULL;
-					}
-					continue;
+					m_template.reset(f_strdup(curBlockKey, curBlockKeyEnd));
+					curBlockKey = NULL;
+					curBlockKeyEnd = NULL;
 				}
+				continue;
 			}
 			++curc;
 		}
@@ -822,8 +1133,13 @@ namespace fdv
 	{
 		char const* tagStart = curc + 2; // by pass "{{" or "{%"
 		*tagEnd = tagStart;
-		while (*tagEnd < m_strEnd && getChar(*tagEnd) != '}' && getChar(*tagEnd) != '%')
-			++*tagEnd;
+		FlashReader reader(tagStart);
+		for (; *tagEnd < m_strEnd; ++*tagEnd)
+		{
+			char c = reader.read();
+			if (c == '}' || c == '%')
+				break;
+		}
 		return tagStart;
 	}
 	
@@ -847,11 +1163,20 @@ namespace fdv
     }
     
     
-    void MTD_FLASHMEM HTTPTemplateResponse::addParamInt(char const* key, int32_t value)
+    // value is not copied, the parameter keeps a reference to it
+    void MTD_FLASHMEM HTTPTemplateResponse::addParamStr(char const* key, CharSlice const& value)
     {
-        char* valueStr = f_printf(FSTR("%d"), value);
         LinkedCharChunks* linkedCharChunks = m_params.add(key);
-        linkedCharChunks->addChunk(valueStr, f_strlen(valueStr), true);	// true = need to free
+        linkedCharChunks->addChunk(value);
+    }
+    
+    
+    // the parameter is not added when out of memory
+    void MTD_FLASHMEM HTTPTemplateResponse::addParamInt(char const* key, int32_t value)
+    {
+        CharSlice slice = CharSlice::format(FSTR("%d"), value);
+        if (!slice.isNull())
+            addParamStr(key, slice);
     }
     
     
@@ -980,6 +1305,30 @@ namespace fdv
     }
     
     
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// TCPClient
+    
+    MTD_FLASHMEM TCPClient::TCPClient(IPAddress remoteAddress, uint16_t remotePort)
+        : m_socket(lwip_socket(AF_INET, SOCK_STREAM, 0))
+    {
+        sockaddr_in address     = {0};
+        address.sin_family      = AF_INET;
+        address.sin_len         = sizeof(sockaddr_in);
+        address.sin_addr.s_addr = remoteAddress.get_in_addr_t();
+        address.sin_port        = htons(remotePort);
+        if (lwip_connect(m_socket.getSocket(), (sockaddr*)&address, sizeof(sockaddr_in)) != 0)
+            m_socket.close();
+    }
+    
+    
+    MTD_FLASHMEM TCPClient::~TCPClient()
+    {
+        m_socket.close();
+    }
+    
+    
+    
     ////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////
     // SNTPClient
@@ -1018,136 +1367,934 @@ namespace fdv
 
       return false;  // error
     }
-
-    
- 
-    ////////////////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////////////
-    // ICMP
-    
-    MTD_FLASHMEM ICMP::ICMP()
-        : m_waitingID(rand() & 0xFFFF), m_waitingSeq(0), m_queue(1)
-    {
-    }
     
     
-    int32_t MTD_FLASHMEM ICMP::ping(IPAddress const& dest)
-    {       
-        static uint32_t const TIMEOUT        = 4000;
-        static int32_t const TIMEOUT_RESULT  = -1;
+    udp_pcb*             SNTPClient::s_pcb = NULL;
+    SNTPClient::Request  SNTPClient::s_requests[MAXSERVERS];
+    uint32_t             SNTPClient::s_requestsCount = 0;
+    uint32_t             SNTPClient::s_requestMillis = 0;
     
-        uint32_t result = TIMEOUT_RESULT;
-                
-        // generate seq
-        m_waitingSeq++;
-        
-        // prepare packet to send
-        pbuf* hdrbuf = pbuf_alloc(PBUF_IP, sizeof(icmp_echo_hdr), PBUF_RAM);
-        icmp_echo_hdr* hdr = (icmp_echo_hdr*)hdrbuf->payload;
-        hdr->type   = ICMP_ECHO;
-        hdr->code   = 0;
-        hdr->chksum = 0;
-        hdr->id     = htons(m_waitingID);
-        hdr->seqno  = htons(m_waitingSeq);
-        hdr->chksum = inet_chksum((uint16_t*)hdr, sizeof(icmp_echo_hdr));
-        
-        // send Echo request
-        raw_pcb* pcb = raw_new(IP_PROTO_ICMP);
-        raw_recv(pcb, ICMP::raw_recv_fn, this);
-        raw_bind(pcb, IP_ADDR_ANY);            
-        
-        ip_addr_t addr = dest.get_ip_addr_t();
-        raw_sendto(pcb, hdrbuf, &addr);
-        pbuf_free(hdrbuf);
-        
-        uint32_t t1 = micros();
-        if (m_queue.receive(TIMEOUT))
-            result = (micros() - t1);
-                
-        raw_remove(pcb);
-        
-        return result;            
-    }
-
     
-    uint8_t STC_FLASHMEM ICMP::raw_recv_fn(void *arg, raw_pcb *pcb, pbuf *p, ip_addr_t *addr)
+    // doesn't block. Cancels a pending request.
+    // returns false on fail (no memory)
+    bool MTD_FLASHMEM SNTPClient::request(IPAddress const* servers, uint32_t count)
     {
-        ICMP* this_ = (ICMP*)arg;
+        uint8_t const MODE_CLIENT = 3;
+        uint8_t const VERSION     = 4;
+        uint8_t const BUFLEN      = 48;
         
-        ip_hdr *iphdr = (ip_hdr*)p->payload;
+        if (s_pcb == NULL)
+        {
+            s_pcb = udp_new();
+            if (s_pcb == NULL)
+                return false;
+            udp_recv(s_pcb, recvFn, NULL);
+            udp_bind(s_pcb, IP_ADDR_ANY, 0);
+        }
         
-        uint16_t ttl = IPH_TTL(iphdr);
+        count = (count < MAXSERVERS? count : MAXSERVERS);
+        {
+            Critical critical;
+            s_requestsCount = 0;    // cancels previous request
+        }
         
-        if (p->tot_len >= PBUF_IP_HLEN + sizeof(icmp_echo_hdr) && pbuf_header(p, -PBUF_IP_HLEN) == 0)
+        for (uint32_t i = 0; i != count; ++i)
         {
-            icmp_echo_hdr* hdr = (icmp_echo_hdr*)p->payload;
-            if (ntohs(hdr->id) == this_->m_waitingID && ntohs(hdr->seqno) == this_->m_waitingSeq)
+            pbuf* p = pbuf_alloc(PBUF_TRANSPORT, BUFLEN, PBUF_RAM);
+            if (p == NULL)
+                break;
+            uint8_t* buf = (uint8_t*)p->payload;
+            memset(buf, 0, BUFLEN);
+            buf[0] = MODE_CLIENT | (VERSION << 3);
+            Request* request = &s_requests[i];
+            request->address  = servers[i].get_in_addr_t();
+            request->nonce[0] = rand();
+            request->nonce[1] = rand();
+            request->replied  = false;
+            memcpy(&buf[40], request->nonce, sizeof(request->nonce));
             {
-                this_->m_receivedBytes = p->tot_len;
-                this_->m_receivedTTL   = ttl;
-                this_->m_queue.signal();
-                pbuf_free(p);
-                return 1;
+                Critical critical;
+                request->sendMicros = micros();
+                s_requestMillis     = millis();
+                s_requestsCount     = i + 1;
             }
+            ip_addr_t addr = servers[i].get_ip_addr_t();
+            udp_sendto(s_pcb, p, &addr, 123);
+            pbuf_free(p);
         }
-        
-        return 0;
-    }    
-
-
-
-    ////////////////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////////////
-    // NetInterface
+        return s_requestsCount > 0;
+    }
     
-    netif* NetInterface::get(uint32_t index)
+    
+    // true when all servers have replied or REPLYTIMEOUT has elapsed
+    bool MTD_FLASHMEM SNTPClient::isCompleted()
     {
-        char name[4] = "enX";
-        name[2] = '0' + index;
-        return netif_find(name);
+        Critical critical;
+        if (millisDiff(s_requestMillis, millis()) > REPLYTIMEOUT)
+            return true;
+        for (uint32_t i = 0; i != s_requestsCount; ++i)
+            if (!s_requests[i].replied)
+                return false;
+        return true;
     }
-
-        
-
-    ////////////////////////////////////////////////////////////////////////////////////////
-    ////////////////////////////////////////////////////////////////////////////////////////
-    // Router
     
-    netif_input_fn Router::s_prevInput[INTFCOUNT];
     
-    bool Router::s_enabled = false;
+    // returns false when no server has replied
+    bool MTD_FLASHMEM SNTPClient::getBestSample(Sample* sample)
+    {
+        Critical critical;
+        Request const* best = NULL;
+        for (uint32_t i = 0; i != s_requestsCount; ++i)
+            if (s_requests[i].replied && (best == NULL || s_requests[i].sample.delay < best->sample.delay))
+                best = &s_requests[i];
+        if (best)
+            *sample = best->sample;
+        return best != NULL;
+    }
     
     
-    void MTD_FLASHMEM Router::enable()
+    // called by lwIP task
+    void MTD_FLASHMEM SNTPClient::recvFn(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port)
     {
-        if (!s_enabled)
+        uint32_t const SECONDS_FROM_1900_TO_1970 = 2208988800UL;
+        uint8_t const  BUFLEN                    = 48;
+        
+        uint32_t receiveMicros = micros();
+        uint32_t receiveMillis = millis();
+        uint8_t buf[BUFLEN];
+        if (p->tot_len >= BUFLEN && pbuf_copy_partial(p, buf, BUFLEN, 0) == BUFLEN)
         {
-            Critical critical;
-            for (uint32_t i = 0; i != INTFCOUNT; ++i)
+            uint8_t leap    = buf[0] >> 6;
+            uint8_t mode    = buf[0] & 7;
+            uint8_t stratum = buf[1];
+            // server mode, synchronized, not a "kiss-o'-death" packet
+            if (mode == 4 && leap != 3 && stratum != 0 && stratum < 16)
             {
-                netif* en = NetInterface::get(i);
-                if (en)
+                Critical critical;
+                for (uint32_t i = 0; i != s_requestsCount; ++i)
                 {
-                    s_prevInput[i] = en->input;
-                    en->input = Router::netif_input;
+                    Request* request = &s_requests[i];
+                    if (!request->replied && request->address == addr->addr && memcmp(&buf[24], request->nonce, sizeof(request->nonce)) == 0)
+                    {
+                        // T2 = server receive timestamp, T3 = server transmit timestamp
+                        uint32_t t2sec  = ntohl(*(uint32_t*)&buf[32]);
+                        uint32_t t2frac = ntohl(*(uint32_t*)&buf[36]);
+                        uint32_t t3sec  = ntohl(*(uint32_t*)&buf[40]);
+                        uint32_t t3frac = ntohl(*(uint32_t*)&buf[44]);
+                        sint64_t processing = (sint64_t)(t3sec - t2sec) * 1000000 + (sint64_t)(((uint64_t)t3frac * 1000000) >> 32) - (sint64_t)(((uint64_t)t2frac * 1000000) >> 32);
+                        sint64_t delay = (sint64_t)(receiveMicros - request->sendMicros) - processing;
+                        request->sample.delay         = (delay > 0? delay : 0);
+                        request->sample.serverTime    = (uint64_t)(t3sec - SECONDS_FROM_1900_TO_1970) * 1000 + (((uint64_t)t3frac * 1000) >> 32) + request->sample.delay / 2000;
+                        request->sample.receiveMillis = receiveMillis;
+                        request->replied              = true;
+                        break;
+                    }
                 }
-                else
-                    s_prevInput[i] = NULL;
             }
-            s_enabled = true;
         }
+        pbuf_free(p);
     }
+
     
+ 
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // ICMP
     
-    void MTD_FLASHMEM Router::disable()
+    MTD_FLASHMEM ICMP::ICMP()
+        : m_pcb(raw_new(IP_PROTO_ICMP)), m_id(rand() & 0xFFFF), m_round(0), m_targets(NULL), m_targetsCount(0), m_targetsAllocated(0),
+          m_pendingCount(0), m_queue(1)
     {
-        if (s_enabled)
+        if (m_pcb)
         {
-            Critical critical;
-            for (uint32_t i = 0; i != INTFCOUNT; ++i)
-            {
-                netif* en = NetInterface::get(i);
-                if (en && s_prevInput[i])
+            raw_recv(m_pcb, ICMP::raw_recv_fn, this);
+            raw_bind(m_pcb, IP_ADDR_ANY);
+        }
+    }
+    
+    
+    MTD_FLASHMEM ICMP::~ICMP()
+    {
+        if (m_pcb)
+            raw_remove(m_pcb);
+        delete[] m_targets;
+    }
+    
+    
+    // returns target index, or -1 when MAXTARGETS has been reached
+    int32_t MTD_FLASHMEM ICMP::addTarget(IPAddress const& address)
+    {
+        if (m_targetsCount == MAXTARGETS)
+            return -1;
+        if (m_targetsCount == m_targetsAllocated)
+        {
+            // grow (outside of Critical), then swap: late replies of previous sweeps may still access m_targets
+            uint32_t allocated = (m_targetsAllocated == 0? 4 : m_targetsAllocated * 2);
+            allocated = (allocated < MAXTARGETS? allocated : MAXTARGETS);
+            Target* targets = new Target[allocated];
+            if (targets == NULL)
+                return -1;  // no memory, current targets are kept
+            Target* old = m_targets;
+            {
+                Critical critical;
+                memcpy(targets, m_targets, m_targetsCount * sizeof(Target));
+                m_targets          = targets;
+                m_targetsAllocated = allocated;
+            }
+            delete[] old;
+        }
+        Target* target = &m_targets[m_targetsCount];
+        memset(target, 0, sizeof(Target));
+        target->stats.address  = address.get_in_addr_t();
+        target->stats.minTime  = 0xFFFFFFFF;
+        target->stats.lastTime = -1;
+        Critical critical;
+        return m_targetsCount++;
+    }
+    
+    
+    void MTD_FLASHMEM ICMP::clearTargets()
+    {
+        Critical critical;
+        m_targetsCount = 0;
+        m_pendingCount = 0;
+    }
+    
+    
+    // sends one Echo Request to each target, then waits until all replied or timeOut (ms)
+    // returns the number of received replies
+    uint32_t MTD_FLASHMEM ICMP::sweep(uint32_t timeOut)
+    {
+        if (m_pcb == NULL || m_targetsCount == 0)
+            return 0;
+        
+        // new round: replies of previous rounds are ignored
+        ++m_round;
+        m_queue.receive((uint32_t)0);   // clear a late signal
+        {
+            // all requests are pending before the first one is sent, so m_pendingCount cannot reach zero early
+            Critical critical;
+            m_pendingCount = m_targetsCount;
+            for (uint32_t i = 0; i != m_targetsCount; ++i)
+            {
+                m_targets[i].pending = true;
+                ++m_targets[i].stats.sent;
+            }
+        }
+        
+        for (uint32_t i = 0; i != m_targetsCount; ++i)
+        {
+            // prepare packet to send
+            pbuf* hdrbuf = pbuf_alloc(PBUF_IP, sizeof(icmp_echo_hdr), PBUF_RAM);
+            if (hdrbuf == NULL)
+                break;
+            icmp_echo_hdr* hdr = (icmp_echo_hdr*)hdrbuf->payload;
+            hdr->type   = ICMP_ECHO;
+            hdr->code   = 0;
+            hdr->chksum = 0;
+            hdr->id     = htons(m_id);
+            hdr->seqno  = htons((m_round << 8) | i);
+            hdr->chksum = inet_chksum((uint16_t*)hdr, sizeof(icmp_echo_hdr));
+            
+            Target* target = &m_targets[i];
+            {
+                Critical critical;
+                target->sendMicros = micros();
+            }
+            
+            // send Echo request
+            ip_addr_t addr;
+            addr.addr = target->stats.address;
+            raw_sendto(m_pcb, hdrbuf, &addr);
+            pbuf_free(hdrbuf);
+        }
+        
+        m_queue.receive(timeOut);
+        
+        // requests still pending are lost
+        uint32_t received = 0;
+        Critical critical;
+        for (uint32_t i = 0; i != m_targetsCount; ++i)
+        {
+            if (m_targets[i].pending)
+            {
+                m_targets[i].pending        = false;
+                m_targets[i].stats.lastTime = -1;
+            }
+            else
+                ++received;
+        }
+        m_pendingCount = 0;
+        return received;
+    }
+    
+    
+    int32_t MTD_FLASHMEM ICMP::ping(IPAddress const& dest)
+    {       
+        if (m_targetsCount != 1 || m_targets[0].stats.address != dest.get_in_addr_t())
+        {
+            clearTargets();
+            if (addTarget(dest) < 0)
+                return -1;
+        }
+        sweep(DEFAULTTIMEOUT);
+        return m_targets[0].stats.lastTime;
+    }
+
+    
+    // called by lwIP task
+    uint8_t STC_FLASHMEM ICMP::raw_recv_fn(void *arg, raw_pcb *pcb, pbuf *p, ip_addr_t *addr)
+    {
+        uint32_t receiveMicros = micros();
+        
+        ICMP* this_ = (ICMP*)arg;
+        
+        ip_hdr *iphdr = (ip_hdr*)p->payload;
+        
+        uint16_t ttl = IPH_TTL(iphdr);
+        
+        if (p->tot_len >= PBUF_IP_HLEN + sizeof(icmp_echo_hdr) && pbuf_header(p, -PBUF_IP_HLEN) == 0)
+        {
+            icmp_echo_hdr* hdr = (icmp_echo_hdr*)p->payload;
+            uint16_t seq   = ntohs(hdr->seqno);
+            uint32_t index = seq & 0xFF;
+            if (hdr->type == ICMP_ER && ntohs(hdr->id) == this_->m_id && (seq >> 8) == this_->m_round)
+            {
+                bool completed = false;
+                bool matched   = false;
+                {
+                    Critical critical;
+                    if (index < this_->m_targetsCount && this_->m_targets[index].pending && this_->m_targets[index].stats.address == addr->addr)
+                    {
+                        Target* target = &this_->m_targets[index];
+                        uint32_t time = receiveMicros - target->sendMicros;
+                        target->pending          = false;
+                        target->stats.lastTime   = time;
+                        target->stats.lastBytes  = p->tot_len;
+                        target->stats.lastTTL    = ttl;
+                        target->stats.totalTime += time;
+                        target->stats.minTime    = (time < target->stats.minTime? time : target->stats.minTime);
+                        target->stats.maxTime    = (time > target->stats.maxTime? time : target->stats.maxTime);
+                        ++target->stats.received;
+                        completed = (--this_->m_pendingCount == 0);
+                        matched   = true;
+                    }
+                }
+                if (completed)
+                    this_->m_queue.signal(0);
+                if (matched)
+                {
+                    pbuf_free(p);
+                    return 1;
+                }
+            }
+            // restore IP header for other receivers
+            pbuf_header(p, PBUF_IP_HLEN);
+        }
+        
+        return 0;
+    }
+
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // NetInterface
+    
+    netif* NetInterface::get(uint32_t index)
+    {
+        char name[4] = "enX";
+        name[2] = '0' + index;
+        return netif_find(name);
+    }
+
+        
+
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // NAPT
+    //
+    // Hot path methods are not in flash (MTD_FLASHMEM) to speedup routing
+    
+    bool NAPT::s_enabled = false;
+    
+    NAPT::Entry* NAPT::s_table = NULL;
+    
+    
+    bool MTD_FLASHMEM NAPT::enable()
+    {
+        if (s_table == NULL)
+        {
+            Entry* table = new Entry[TABLESIZE];
+            if (table == NULL)
+                return false;
+            memset(table, 0, sizeof(Entry) * TABLESIZE);
+            Critical critical;
+            s_table = table;
+        }
+        s_enabled = true;
+        return true;
+    }
+    
+    
+    // table is not freed because netif_input could be using it
+    void MTD_FLASHMEM NAPT::disable()
+    {
+        s_enabled = false;
+    }
+    
+    
+    uint32_t MTD_FLASHMEM NAPT::getActiveCount()
+    {
+        uint32_t count = 0;
+        if (s_table)
+        {
+            uint32_t now = millis();
+            for (uint32_t i = 0; i != TABLESIZE; ++i)
+                if (isAlive(&s_table[i], now))
+                    ++count;
+        }
+        return count;
+    }
+    
+    
+    // returns pointer to transport header, NULL if not translatable (unsupported protocol, not first fragment, too short)
+    uint8_t* NAPT::getTransportHeader(ip_hdr* iphdr, uint32_t len)
+    {
+        if ((IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK)) != 0)
+            return NULL;
+        uint32_t minLen;
+        switch (IPH_PROTO(iphdr))
+        {
+            case IP_PROTO_TCP:
+                minLen = 20;
+                break;
+            case IP_PROTO_UDP:
+            case IP_PROTO_ICMP:
+                minLen = 8;
+                break;
+            default:
+                return NULL;
+        }
+        uint32_t hlen = IPH_HL(iphdr) * 4;
+        if (len < hlen + minLen)
+            return NULL;
+        return (uint8_t*)iphdr + hlen;
+    }
+    
+    
+    bool NAPT::isAlive(Entry const* entry, uint32_t now)
+    {
+        uint32_t timeOut;
+        switch (entry->proto)
+        {
+            case IP_PROTO_TCP:
+                timeOut = entry->closing? TCPFIN_TIMEOUT : TCP_TIMEOUT;
+                break;
+            case IP_PROTO_UDP:
+                timeOut = UDP_TIMEOUT;
+                break;
+            case IP_PROTO_ICMP:
+                timeOut = ICMP_TIMEOUT;
+                break;
+            default:
+                return false;
+        }
+        return millisDiff(entry->lastUsed, now) <= timeOut;
+    }
+    
+    
+    // finds or creates the outbound entry
+    NAPT::Entry* NAPT::getEntry(uint8_t proto, uint32_t srcAddr, uint16_t srcPort, uint32_t dstAddr, uint16_t dstPort, uint32_t now)
+    {
+        uint32_t h = srcAddr ^ dstAddr ^ ((uint32_t)srcPort << 16 | dstPort) ^ proto;
+        h ^= h >> 16;
+        h ^= h >> 8;
+        
+        Entry* victim = NULL;
+        bool victimAlive = true;
+        for (uint32_t i = 0; i != MAXPROBES; ++i)
+        {
+            Entry* entry = &s_table[(h + i) & (TABLESIZE - 1)];
+            bool alive = isAlive(entry, now);
+            if (alive)
+            {
+                if (entry->srcPort == srcPort && entry->dstPort == dstPort && entry->srcAddr == srcAddr && entry->dstAddr == dstAddr && entry->proto == proto)
+                    return entry;
+                if (victimAlive && (victim == NULL || millisDiff(entry->lastUsed, now) > millisDiff(victim->lastUsed, now)))
+                    victim = entry;     // least recently used
+            }
+            else if (victimAlive)
+            {
+                victim = entry;         // first free or expired
+                victimAlive = false;
+            }
+        }
+        
+        // new connection
+        victim->srcAddr = srcAddr;
+        victim->dstAddr = dstAddr;
+        victim->srcPort = srcPort;
+        victim->dstPort = dstPort;
+        victim->proto   = proto;
+        victim->closing = false;
+        return victim;
+    }
+    
+    
+    // RFC 1624: HC' = ~(~HC + ~m + m')
+    // all values in network order
+    void NAPT::adjustChecksum(uint16_t* chksum, uint16_t oldValue, uint16_t newValue)
+    {
+        uint32_t sum = (uint16_t)~*chksum + (uint16_t)~oldValue + newValue;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        *chksum = ~sum;
+    }
+    
+    
+    void NAPT::adjustChecksum(uint16_t* chksum, uint32_t oldValue, uint32_t newValue)
+    {
+        adjustChecksum(chksum, (uint16_t)(oldValue & 0xFFFF), (uint16_t)(newValue & 0xFFFF));
+        adjustChecksum(chksum, (uint16_t)(oldValue >> 16), (uint16_t)(newValue >> 16));
+    }
+    
+    
+    bool NAPT::translateOutbound(ip_hdr* iphdr, uint32_t len, netif* outIntf)
+    {
+        uint8_t* thdr = getTransportHeader(iphdr, len);
+        if (thdr == NULL || s_table == NULL)
+            return false;
+            
+        uint8_t proto = IPH_PROTO(iphdr);
+        uint16_t* port;         // source port or ICMP identifier
+        uint16_t* chksum;
+        uint16_t dstPort = 0;
+        switch (proto)
+        {
+            case IP_PROTO_TCP:
+                port    = (uint16_t*)thdr;
+                dstPort = *(uint16_t*)(thdr + 2);
+                chksum  = (uint16_t*)(thdr + 16);
+                break;
+            case IP_PROTO_UDP:
+                port    = (uint16_t*)thdr;
+                dstPort = *(uint16_t*)(thdr + 2);
+                chksum  = (uint16_t*)(thdr + 6);
+                break;
+            default:    // IP_PROTO_ICMP
+                if (thdr[0] != ICMP_ECHO)
+                    return false;
+                port    = (uint16_t*)(thdr + 4);
+                chksum  = (uint16_t*)(thdr + 2);
+                break;
+        }
+        
+        uint32_t now = millis();
+        Entry* entry = getEntry(proto, iphdr->src.addr, *port, iphdr->dest.addr, dstPort, now);
+        entry->lastUsed = now;
+        if (proto == IP_PROTO_TCP && (thdr[13] & (TCPFLAG_FIN | TCPFLAG_RST)))
+            entry->closing = true;
+        
+        uint16_t newPort = htons(PORTBASE + (entry - s_table));
+        uint32_t newAddr = outIntf->ip_addr.addr;
+        
+        // TCP and UDP checksums include the pseudo header (addresses). UDP checksum can be disabled (0).
+        bool hasChksum = (proto != IP_PROTO_UDP || *chksum != 0);
+        if (hasChksum)
+        {
+            if (proto != IP_PROTO_ICMP)
+                adjustChecksum(chksum, iphdr->src.addr, newAddr);
+            adjustChecksum(chksum, *port, newPort);
+            if (proto == IP_PROTO_UDP && *chksum == 0)
+                *chksum = 0xFFFF;
+        }
+        *port = newPort;
+        
+        uint16_t iphchksum = IPH_CHKSUM(iphdr);
+        adjustChecksum(&iphchksum, iphdr->src.addr, newAddr);
+        IPH_CHKSUM_SET(iphdr, iphchksum);
+        iphdr->src.addr = newAddr;
+        
+        return true;
+    }
+    
+    
+    bool NAPT::translateInbound(ip_hdr* iphdr, uint32_t len)
+    {
+        uint8_t* thdr = getTransportHeader(iphdr, len);
+        if (thdr == NULL || s_table == NULL)
+            return false;
+            
+        uint8_t proto = IPH_PROTO(iphdr);
+        uint16_t* port;         // destination port or ICMP identifier
+        uint16_t* chksum;
+        uint16_t srcPort = 0;
+        switch (proto)
+        {
+            case IP_PROTO_TCP:
+                srcPort = *(uint16_t*)thdr;
+                port    = (uint16_t*)(thdr + 2);
+                chksum  = (uint16_t*)(thdr + 16);
+                break;
+            case IP_PROTO_UDP:
+                srcPort = *(uint16_t*)thdr;
+                port    = (uint16_t*)(thdr + 2);
+                chksum  = (uint16_t*)(thdr + 6);
+                break;
+            default:    // IP_PROTO_ICMP
+                if (thdr[0] != ICMP_ER)
+                    return false;
+                port    = (uint16_t*)(thdr + 4);
+                chksum  = (uint16_t*)(thdr + 2);
+                break;
+        }
+        
+        uint32_t slot = ntohs(*port) - PORTBASE;
+        if (slot >= TABLESIZE)
+            return false;
+        uint32_t now = millis();
+        Entry* entry = &s_table[slot];
+        if (entry->proto != proto || !isAlive(entry, now) || entry->dstAddr != iphdr->src.addr || entry->dstPort != srcPort)
+            return false;
+        entry->lastUsed = now;
+        if (proto == IP_PROTO_TCP && (thdr[13] & (TCPFLAG_FIN | TCPFLAG_RST)))
+            entry->closing = true;
+            
+        bool hasChksum = (proto != IP_PROTO_UDP || *chksum != 0);
+        if (hasChksum)
+        {
+            if (proto != IP_PROTO_ICMP)
+                adjustChecksum(chksum, iphdr->dest.addr, entry->srcAddr);
+            adjustChecksum(chksum, *port, entry->srcPort);
+            if (proto == IP_PROTO_UDP && *chksum == 0)
+                *chksum = 0xFFFF;
+        }
+        *port = entry->srcPort;
+        
+        uint16_t iphchksum = IPH_CHKSUM(iphdr);
+        adjustChecksum(&iphchksum, iphdr->dest.addr, entry->srcAddr);
+        IPH_CHKSUM_SET(iphdr, iphchksum);
+        iphdr->dest.addr = entry->srcAddr;
+        
+        return true;
+    }
+    
+    
+    
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // RateLimiter
+    //
+    // Hot path methods are not in flash (MTD_FLASHMEM) to speedup routing
+    
+    uint32_t RateLimiter::s_rate  = 0;
+    
+    uint32_t RateLimiter::s_burst = 0;
+    
+    RateLimiter::Bucket RateLimiter::s_buckets[MAXCLIENTS];
+    
+    
+    // rate in bytes per second (0 = disabled), burst in bytes (at least MINBURST)
+    void MTD_FLASHMEM RateLimiter::configure(uint32_t rate, uint32_t burst)
+    {
+        Critical critical;
+        memset(s_buckets, 0, sizeof(s_buckets));
+        s_rate  = rate;
+        s_burst = (burst < MINBURST? MINBURST : burst);
+    }
+    
+    
+    bool MTD_FLASHMEM RateLimiter::getClientStats(uint32_t index, ClientStats* stats)
+    {
+        if (index >= MAXCLIENTS)
+            return false;
+        Critical critical;
+        *stats = s_buckets[index].stats;
+        return true;
+    }
+    
+    
+    // finds or recycles a bucket
+    RateLimiter::Bucket* RateLimiter::getBucket(uint32_t clientAddr, uint32_t now)
+    {
+        Bucket* lru = &s_buckets[0];
+        for (uint32_t i = 0; i != MAXCLIENTS; ++i)
+        {
+            Bucket* bucket = &s_buckets[i];
+            if (bucket->stats.address == clientAddr)
+                return bucket;
+            if (bucket->stats.address == 0 || (lru->stats.address != 0 && millisDiff(bucket->lastUsed, now) > millisDiff(lru->lastUsed, now)))
+                lru = bucket;
+        }
+        memset(lru, 0, sizeof(Bucket));
+        lru->stats.address = clientAddr;
+        lru->tokens        = s_burst;
+        lru->lastRefill    = now;
+        return lru;
+    }
+    
+    
+    bool RateLimiter::consume(uint32_t clientAddr, uint32_t length)
+    {
+        uint32_t now = millis();
+        Bucket* bucket = getBucket(clientAddr, now);
+        bucket->lastUsed = now;
+        
+        // refill
+        uint32_t elapsed = millisDiff(bucket->lastRefill, now);
+        uint64_t refill = (uint64_t)s_rate * elapsed / 1000;
+        uint32_t tokens = (refill > s_burst? s_burst : (uint32_t)refill);
+        if (tokens > 0)
+        {
+            bucket->tokens = (bucket->tokens + tokens > s_burst? s_burst : bucket->tokens + tokens);
+            bucket->lastRefill = now;
+        }
+        
+        if (bucket->tokens >= length)
+        {
+            bucket->tokens -= length;
+            return true;
+        }
+        ++bucket->stats.droppedPackets;
+        bucket->stats.droppedBytes += length;
+        return false;
+    }
+    
+    
+    
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // PacketCapture
+    //
+    // capture() is not in flash (MTD_FLASHMEM) to speedup routing
+
+    uint8_t* volatile PacketCapture::s_buffer = NULL;
+
+    uint32_t volatile PacketCapture::s_owner = 0;
+
+    uint32_t PacketCapture::s_lastOwner = 0;
+
+    uint32_t PacketCapture::s_bufferSize = 0;
+
+    uint32_t PacketCapture::s_snapLen = 0;
+
+    uint32_t PacketCapture::s_head = 0;
+
+    uint32_t PacketCapture::s_tail = 0;
+
+    uint32_t volatile PacketCapture::s_used = 0;
+
+    uint32_t PacketCapture::s_seconds = 0;
+
+    uint32_t PacketCapture::s_microseconds = 0;
+
+    uint32_t PacketCapture::s_lastMicros = 0;
+
+    uint32_t PacketCapture::s_capturedPackets = 0;
+
+    uint32_t PacketCapture::s_droppedPackets = 0;
+
+
+    // the capture is claimed inside the critical section: a concurrent start() which loses frees its buffer
+    uint32_t MTD_FLASHMEM PacketCapture::start(uint32_t bufferSize, uint32_t snapLen)
+    {
+        snapLen = (snapLen < MINSNAPLEN? MINSNAPLEN : (snapLen > MAXSNAPLEN? MAXSNAPLEN : snapLen));
+        if (s_buffer != NULL || bufferSize < sizeof(RecordHeader) + snapLen)
+            return 0;
+        uint8_t* buffer = new uint8_t[bufferSize];
+        if (buffer == NULL)
+            return 0;
+        // timestamps are local time, like DateTime::now()
+        uint32_t seconds = DateTime::now().getUnixDateTime();
+        uint32_t owner = 0;
+        {
+            Critical critical;
+            if (s_buffer == NULL)
+            {
+                owner = (s_lastOwner == 0xFFFFFFFF? 1 : s_lastOwner + 1);
+                s_lastOwner       = owner;
+                s_owner           = owner;
+                s_bufferSize      = bufferSize;
+                s_snapLen         = snapLen;
+                s_head            = 0;
+                s_tail            = 0;
+                s_used            = 0;
+                s_seconds         = seconds;
+                s_microseconds    = 0;
+                s_lastMicros      = micros();
+                s_capturedPackets = 0;
+                s_droppedPackets  = 0;
+                s_buffer          = buffer;
+            }
+        }
+        if (owner == 0)
+            delete[] buffer;
+        return owner;
+    }
+
+
+    void MTD_FLASHMEM PacketCapture::stop(uint32_t owner)
+    {
+        uint8_t* buffer = NULL;
+        {
+            Critical critical;
+            if (owner != 0 && owner == s_owner)
+            {
+                buffer = s_buffer;
+                s_buffer = NULL;
+                s_owner = 0;
+            }
+        }
+        delete[] buffer;
+    }
+
+
+    void MTD_FLASHMEM PacketCapture::getFileHeader(FileHeader* header)
+    {
+        header->magic        = 0xA1B2C3D4;   // microseconds timestamps, native byte order
+        header->versionMajor = 2;
+        header->versionMinor = 4;
+        header->thisZone     = 0;
+        header->sigFigs      = 0;
+        header->snapLen      = s_snapLen;
+        header->linkType     = 101;          // LINKTYPE_RAW
+    }
+
+
+    void PacketCapture::writeRing(uint32_t pos, void const* data, uint32_t length)
+    {
+        uint32_t firstPart = min(length, s_bufferSize - pos);
+        memcpy(s_buffer + pos, data, firstPart);
+        memcpy(s_buffer, (uint8_t const*)data + firstPart, length - firstPart);
+    }
+
+
+    void MTD_FLASHMEM PacketCapture::readRing(uint32_t pos, void* data, uint32_t length)
+    {
+        uint32_t firstPart = min(length, s_bufferSize - pos);
+        memcpy(data, s_buffer + pos, firstPart);
+        memcpy((uint8_t*)data + firstPart, s_buffer, length - firstPart);
+    }
+
+
+    // copied bytes are bounded by snapLen
+    void PacketCapture::capture(pbuf* p)
+    {
+        Critical critical;
+
+        if (s_buffer == NULL)
+            return;
+
+        // update timestamp (micros() wraps every ~71 minutes, so it is correct if packets arrive more often)
+        uint32_t now = micros();
+        s_microseconds += now - s_lastMicros;
+        s_lastMicros = now;
+        if (s_microseconds >= 1000000)
+        {
+            s_seconds += s_microseconds / 1000000;
+            s_microseconds %= 1000000;
+        }
+
+        RecordHeader header;
+        header.capturedLength = min((uint32_t)p->tot_len, s_snapLen);
+        uint32_t recordLength = sizeof(RecordHeader) + header.capturedLength;
+        if (s_bufferSize - s_used < recordLength)
+        {
+            ++s_droppedPackets;
+            return;
+        }
+        header.seconds        = s_seconds;
+        header.microseconds   = s_microseconds;
+        header.originalLength = p->tot_len;
+
+        writeRing(s_head, &header, sizeof(RecordHeader));
+
+        // packet data may wrap around the end of the ring
+        uint32_t pos = (s_head + sizeof(RecordHeader)) % s_bufferSize;
+        uint32_t firstPart = min(header.capturedLength, s_bufferSize - pos);
+        pbuf_copy_partial(p, s_buffer + pos, firstPart, 0);
+        pbuf_copy_partial(p, s_buffer, header.capturedLength - firstPart, firstPart);
+
+        s_head = (s_head + recordLength) % s_bufferSize;
+        s_used += recordLength;
+        ++s_capturedPackets;
+    }
+
+
+    // the ring is read outside of critical sections: capture() writes only the free space and only
+    // the owner can stop (free) the ring
+    uint32_t MTD_FLASHMEM PacketCapture::read(uint32_t owner, void* buffer, uint32_t maxLength)
+    {
+        if (owner == 0 || owner != s_owner)
+            return 0;
+
+        uint32_t used = s_used;
+        uint32_t length = 0;
+        while (length < used)
+        {
+            uint32_t pos = (s_tail + length) % s_bufferSize;
+            RecordHeader header;
+            readRing(pos, &header, sizeof(RecordHeader));
+            uint32_t recordLength = sizeof(RecordHeader) + header.capturedLength;
+            if (length + recordLength > maxLength)
+                break;
+            readRing(pos, (uint8_t*)buffer + length, recordLength);
+            length += recordLength;
+        }
+
+        Critical critical;
+        s_tail = (s_tail + length) % s_bufferSize;
+        s_used -= length;
+        return length;
+    }
+
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // Router
+    
+    netif_input_fn Router::s_prevInput[INTFCOUNT];
+    
+    bool Router::s_enabled = false;
+    
+    Router::RouteCacheEntry Router::s_routeCache[ROUTECACHESIZE];
+    
+    Router::Counters Router::s_counters[INTFCOUNT];
+    
+    
+    void MTD_FLASHMEM Router::enable()
+    {
+        if (!s_enabled)
+        {
+            Critical critical;
+            memset(s_routeCache, 0, sizeof(s_routeCache));
+            for (uint32_t i = 0; i != INTFCOUNT; ++i)
+            {
+                netif* en = NetInterface::get(i);
+                if (en)
+                {
+                    s_prevInput[i] = en->input;
+                    en->input = Router::netif_input;
+                }
+                else
+                    s_prevInput[i] = NULL;
+            }
+            s_enabled = true;
+        }
+    }
+    
+    
+    void MTD_FLASHMEM Router::disable()
+    {
+        if (s_enabled)
+        {
+            Critical critical;
+            for (uint32_t i = 0; i != INTFCOUNT; ++i)
+            {
+                netif* en = NetInterface::get(i);
+                if (en && s_prevInput[i])
                     en->input = s_prevInput[i];
             }
             s_enabled = false;
@@ -1155,8 +2302,62 @@ namespace fdv
     }
     
     
-    // remove MTD_FLASHMEM to speedup routing
-    err_t MTD_FLASHMEM Router::netif_input(pbuf *p, netif *inp)
+    void MTD_FLASHMEM Router::invalidateRouteCache()
+    {
+        Critical critical;
+        memset(s_routeCache, 0, sizeof(s_routeCache));
+    }
+    
+    
+    void MTD_FLASHMEM Router::getCounters(uint32_t intfIndex, Counters* counters)
+    {
+        Critical critical;
+        *counters = s_counters[intfIndex];
+    }
+    
+    
+    void MTD_FLASHMEM Router::resetCounters()
+    {
+        Critical critical;
+        memset(s_counters, 0, sizeof(s_counters));
+    }
+    
+    
+    // true if intf is still in the list of network interfaces (it could have been removed)
+    // not in flash (MTD_FLASHMEM) to speedup routing
+    bool Router::isInterfaceValid(netif* intf)
+    {
+        for (netif* n = netif_list; n; n = n->next)
+            if (n == intf)
+                return true;
+        return false;
+    }
+    
+    
+    // not in flash (MTD_FLASHMEM) to speedup routing
+    // returns NULL if there isn't a route
+    netif* Router::findRoute(uint32_t dest)
+    {
+        RouteCacheEntry* entry = &s_routeCache[((dest >> 24) ^ (dest >> 16)) & (ROUTECACHESIZE - 1)];
+        if (entry->intf != NULL && entry->dest == dest && isInterfaceValid(entry->intf) &&
+            entry->intf->ip_addr.addr == entry->intfAddr && netif_is_up(entry->intf))
+            return entry->intf;
+        
+        ip_addr_t ipdest;
+        ipdest.addr = dest;
+        netif* intf = ip_route(&ipdest);
+        if (intf)
+        {
+            entry->dest     = dest;
+            entry->intf     = intf;
+            entry->intfAddr = intf->ip_addr.addr;
+        }
+        return intf;
+    }
+    
+    
+    // not in flash (MTD_FLASHMEM) to speedup routing
+    err_t Router::netif_input(pbuf *p, netif *inp)
     {
         eth_hdr* ethdr = (eth_hdr*)p->payload;
         
@@ -1172,8 +2373,11 @@ namespace fdv
             bool route = ((iphdr->dest.addr & inp->netmask.addr) != (inp->ip_addr.addr & inp->netmask.addr));
             // 2. check if not multicast or broadcast (>=224.0.0.0 up to 255.255.255.255)
             route = route && ((iphdr->dest.addr & 0xE0) != 0xE0);
+            // 3. check if this is a reply to a translated connection (changes destination)
+            bool translated = !route && NAPT::isEnabled() && inp->num == WiFi::ClientNetwork && iphdr->dest.addr == inp->ip_addr.addr &&
+                              NAPT::translateInbound(iphdr, p->len);
             
-            if (route)
+            if (route || translated)
             {
                 /*
                 debug("netif_input intf=%d len=%d id=%d prot=%d src=%s dst=%s route?=%c\r\n", 
@@ -1183,15 +2387,30 @@ namespace fdv
                       route?'Y':'N');
                 */
                 
+                Counters* counters = &s_counters[inp->num];
+                uint32_t len = p->tot_len;
+                
+                if (PacketCapture::isEnabled())
+                    PacketCapture::capture(p);
+                
                 // find destination interface
-                ip_addr_t ipdest;
-                ipdest.addr = iphdr->dest.addr;
-                netif* destIntf = ip_route(&ipdest);
+                netif* destIntf = findRoute(iphdr->dest.addr);
                 
                 // decrement TTL
                 IPH_TTL_SET(iphdr, IPH_TTL(iphdr) - 1);
                 
-                if (IPH_TTL(iphdr) > 0)
+                // limit Access Point clients bandwidth
+                bool allowed = true;
+                if (destIntf && RateLimiter::isEnabled())
+                {
+                    if (inp->num == WiFi::AccessPointNetwork)
+                        allowed = RateLimiter::consume(iphdr->src.addr, len);
+                    else if (destIntf->num == WiFi::AccessPointNetwork)
+                        allowed = RateLimiter::consume(iphdr->dest.addr, len);
+                }
+                
+                bool sent = false;
+                if (destIntf && allowed && IPH_TTL(iphdr) > 0)
                 {
                     // update IP checksum
                     if (IPH_CHKSUM(iphdr) >= PP_HTONS(0xffffU - 0x100))
@@ -1199,8 +2418,23 @@ namespace fdv
                     else
                         IPH_CHKSUM_SET(iphdr, IPH_CHKSUM(iphdr) + PP_HTONS(0x100));
                 
+                    // translate connections going from Access Point network to Client network
+                    bool translate = !translated && NAPT::isEnabled() && inp->num == WiFi::AccessPointNetwork && destIntf->num == WiFi::ClientNetwork;
+                
                     // send the packet
-                    ip_output_if(p, NULL, IP_HDRINCL, 0, 0, 0, destIntf);
+                    if (!translate || NAPT::translateOutbound(iphdr, p->len, destIntf))
+                        sent = (ip_output_if(p, NULL, IP_HDRINCL, 0, 0, 0, destIntf) == ERR_OK);
+                }
+                
+                if (sent)
+                {
+                    ++counters->forwardedPackets;
+                    counters->forwardedBytes += len;
+                }
+                else
+                {
+                    ++counters->droppedPackets;
+                    counters->droppedBytes += len;
                 }
                       
                 pbuf_free(p);
@@ -1381,7 +2615,7 @@ namespace fdv
             else if (substate == 4)
             {
                 // end of headers
-                headers->append(0, 1);   // add string terminating zero
+                headers->append((char)0, 1);   // add string terminating zero
                 
                 // look for "name" parameter
                 CharChunksIterator keyBegin;
@@ -1769,6 +3003,7 @@ namespace fdv
             // found				
             setStatus(STR_200_OK);
             addHeader(STR_Content_Type, file.mimetype);
+            setRawHeaders(file.headers);    // NULL if not present
             addContent(file.data, file.datalength);
         }
         else
@@ -1779,6 +3014,354 @@ namespace fdv
         HTTPResponse::flush();
     }
     
+    
+    
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPClient
+    
+    MTD_FLASHMEM HTTPClient::HTTPClient()
+        : m_bodyCallback(NULL), m_bodyCallbackArg(NULL), m_status(0), m_keepAlive(false), m_receivedAny(false),
+          m_bodyComplete(false), m_chunked(false), m_chunkState(ChunkSize), m_remaining(0)
+    {
+        memset(m_connections, 0, sizeof(m_connections));
+    }
+    
+    
+    MTD_FLASHMEM HTTPClient::~HTTPClient()
+    {
+        close();
+    }
+    
+    
+    void MTD_FLASHMEM HTTPClient::close()
+    {
+        for (uint32_t i = 0; i != MAXCONNECTIONS; ++i)
+            closeConnection(&m_connections[i]);
+    }
+    
+    
+    void MTD_FLASHMEM HTTPClient::closeConnection(Connection* connection)
+    {
+        if (connection->hostname)
+        {
+            delete connection->client;
+            delete[] connection->hostname;
+            delete[] connection->host;
+            memset(connection, 0, sizeof(Connection));
+        }
+    }
+    
+    
+    // returns a connected connection, reusing a kept alive one when possible
+    HTTPClient::Connection* MTD_FLASHMEM HTTPClient::getConnection(char const* hostname, uint16_t port, bool* reused)
+    {
+        *reused = false;
+        uint32_t const now = millis();
+        
+        // look for a kept alive connection to the same host
+        Connection* slot = NULL;
+        for (uint32_t i = 0; i != MAXCONNECTIONS; ++i)
+        {
+            Connection* connection = &m_connections[i];
+            if (connection->hostname && connection->port == port && f_strcmp(hostname, connection->hostname) == 0)
+            {
+                if (now - connection->lastUsed < KEEPALIVETIMEOUT && connection->client->getSocket()->checkConnection())
+                {
+                    *reused = true;
+                    return connection;
+                }
+                // expired or closed by the server
+                closeConnection(connection);
+                slot = connection;
+                break;
+            }
+        }
+        
+        // get a free slot, or the least recently used one
+        for (uint32_t i = 0; slot == NULL && i != MAXCONNECTIONS; ++i)
+            if (m_connections[i].hostname == NULL)
+                slot = &m_connections[i];
+        if (slot == NULL)
+        {
+            slot = &m_connections[0];
+            for (uint32_t i = 1; i != MAXCONNECTIONS; ++i)
+                if (now - m_connections[i].lastUsed > now - slot->lastUsed)
+                    slot = &m_connections[i];
+            closeConnection(slot);
+        }
+        
+        // connect
+        IPAddress address = NSLookup::lookup(hostname);
+        if (address == IPAddress())
+            return NULL;
+        TCPClient* client = new TCPClient(address, port);
+        if (!client->getSocket()->isConnected())
+        {
+            delete client;
+            return NULL;
+        }
+        client->getSocket()->setNoDelay(true);
+        client->getSocket()->setTimeOut(TIMEOUT);
+        slot->hostname = f_strdup(hostname);
+        slot->port     = port;
+        slot->host     = (port == 80? f_strdup(hostname) : f_printf(FSTR("%s:%d"), hostname, port));
+        slot->client   = client;
+        slot->lastUsed = now;
+        return slot;
+    }
+    
+    
+    // all strings can stay in RAM or Flash
+    // headers contains additional header lines, each terminated by "\r\n" (can be NULL)
+    // returns the HTTP status code (ex. 200) or 0 on fail (connection, protocol error, or aborted by body callback)
+    int32_t MTD_FLASHMEM HTTPClient::request(char const* method, char const* hostname, uint16_t port, char const* path,
+                                             char const* contentType, void const* body, uint32_t bodyLength, char const* headers)
+    {
+        if (m_headerBuffer.get() == NULL)
+            m_headerBuffer.reset(new char[MAXHEADERSIZE]);
+        bool const headRequest = (f_strcmp(method, FSTR("HEAD")) == 0);
+        
+        // a reused connection may have been closed by the server in the meantime: in this case retry once
+        // with a new connection, but only when nothing has been received
+        for (uint32_t attempt = 0; attempt != 2; ++attempt)
+        {
+            m_headers.clear();
+            m_headerChunks.clear();
+            m_body.clear();
+            m_status      = 0;
+            m_receivedAny = false;
+            
+            bool reused;
+            Connection* connection = getConnection(hostname, port, &reused);
+            if (connection == NULL)
+                return 0;
+            
+            if (sendRequest(connection, method, path, contentType, body, bodyLength, headers) &&
+                receiveResponse(connection->client->getSocket(), headRequest))
+            {
+                if (m_keepAlive && m_bodyComplete)
+                    connection->lastUsed = millis();
+                else
+                    closeConnection(connection);
+                return m_status;
+            }
+            
+            closeConnection(connection);
+            if (!reused || m_receivedAny)
+                break;
+        }
+        return 0;
+    }
+    
+    
+    bool MTD_FLASHMEM HTTPClient::sendRequest(Connection* connection, char const* method, char const* path, char const* contentType, void const* body, uint32_t bodyLength, char const* headers)
+    {
+        Socket* socket = connection->client->getSocket();
+        // request line and headers with a single write
+        if (body)
+            socket->writeFmt(FSTR("%s %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\nContent-Type: %s\r\nContent-Length: %d\r\n%s\r\n"),
+                             method, path, connection->host, contentType? contentType : FSTR("application/octet-stream"), bodyLength, headers? headers : STR_);
+        else
+            socket->writeFmt(FSTR("%s %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n%s\r\n"),
+                             method, path, connection->host, headers? headers : STR_);
+        if (socket->isConnected() && body && bodyLength > 0)
+            return socket->write(body, bodyLength) == (int32_t)bodyLength;
+        return socket->isConnected();
+    }
+    
+    
+    bool MTD_FLASHMEM HTTPClient::receiveResponse(Socket* socket, bool headRequest)
+    {
+        // receive status line and headers (look for 0x0D 0x0A 0x0D 0x0A)
+        char* buffer = m_headerBuffer.get();
+        uint32_t received = 0;
+        char const* headerEnd = NULL;
+        while (headerEnd == NULL)
+        {
+            if (received == MAXHEADERSIZE)
+                return false;   // header too long
+            int32_t bytesRecv = socket->read(buffer + received, MAXHEADERSIZE - received);
+            if (bytesRecv <= 0)
+                return false;
+            m_receivedAny = true;
+            uint32_t searchStart = (received > 3? received - 3 : 0);
+            received += bytesRecv;
+            headerEnd = f_strstr(buffer + searchStart, buffer + received, FSTR("\x0D\x0A\x0D\x0A"));
+        }
+        // move header end after CRLFCRLF
+        headerEnd += 4;
+        
+        // status line (ex. "HTTP/1.1 200 OK")
+        if (headerEnd - buffer < 12 || f_strstr(buffer, buffer + 7, FSTR("HTTP/1.")) != buffer)
+            return false;
+        m_status    = strtol(buffer + 9, NULL, 10);
+        m_keepAlive = (buffer[7] != '0');   // HTTP/1.0 doesn't keep alive by default
+        char const* statusEnd = buffer;
+        while (*statusEnd != 0x0D)
+            ++statusEnd;
+        
+        // extract headers, converting names to lower case
+        m_headerChunks.addChunk(buffer, headerEnd - buffer, false);
+        CharChunksIterator curc = m_headerChunks.getIterator();
+        curc += statusEnd - buffer;
+        HTTPHandler::extractHeaders(curc, CharChunksIterator(), &m_headers);
+        for (uint32_t i = 0; i != m_headers.getItemsCount(); ++i)
+        {
+            Fields::Item* item = m_headers[i];
+            for (CharChunksIterator k = item->key; k != item->keyEnd; ++k)
+                if (isupper(*k))
+                    *k = *k - 'A' + 'a';
+        }
+        
+        char const* connection = m_headers[FSTR("connection")];
+        if (connection && (f_strstr(connection, FSTR("close")) || f_strstr(connection, FSTR("Close"))))
+            m_keepAlive = false;
+        
+        // body length
+        m_chunked      = false;
+        m_bodyComplete = false;
+        char const* transferEncoding = m_headers[FSTR("transfer-encoding")];
+        char const* contentLength    = m_headers[FSTR("content-length")];
+        if (headRequest || m_status < 200 || m_status == 204 || m_status == 304)
+        {
+            // no body
+            m_bodyComplete = true;
+            return true;
+        }
+        else if (transferEncoding && f_strstr(transferEncoding, FSTR("chunked")))
+        {
+            m_chunked    = true;
+            m_chunkState = ChunkSize;
+            m_remaining  = 0;
+        }
+        else if (contentLength)
+        {
+            m_remaining    = strtol(contentLength, NULL, 10);
+            m_bodyComplete = (m_remaining == 0);
+        }
+        else
+        {
+            // body ends when connection is closed
+            m_remaining = UNKNOWNLENGTH;
+            m_keepAlive = false;
+        }
+        
+        // consume body bytes received with the header
+        if (!processBody(headerEnd, buffer + received - headerEnd))
+            return false;
+        
+        // receive remaining body
+        while (!m_bodyComplete)
+        {
+            char readBuffer[READBUFFERSIZE];
+            int32_t bytesRecv = socket->read(readBuffer, READBUFFERSIZE);
+            if (bytesRecv <= 0)
+            {
+                m_bodyComplete = (!m_chunked && m_remaining == UNKNOWNLENGTH);
+                return m_bodyComplete;
+            }
+            if (!processBody(readBuffer, bytesRecv))
+                return false;
+        }
+        return true;
+    }
+    
+    
+    // returns false on chunked encoding errors or when the body callback aborts
+    bool MTD_FLASHMEM HTTPClient::processBody(char const* data, uint32_t length)
+    {
+        if (!m_chunked)
+        {
+            if (m_remaining != UNKNOWNLENGTH)
+            {
+                length = (length < m_remaining? length : m_remaining);
+                m_remaining -= length;
+                m_bodyComplete = (m_remaining == 0);
+            }
+            return length == 0 || deliverBody(data, length);
+        }
+        
+        // chunked transfer encoding
+        while (length > 0 && !m_bodyComplete)
+        {
+            char c = *data;
+            switch (m_chunkState)
+            {
+                case ChunkSize:
+                    if (isxdigit(c))
+                    {
+                        if (m_remaining > 0x0FFFFFFF)
+                            return false;   // chunk too large
+                        m_remaining = m_remaining * 16 + hexDigitToInt(c);
+                    }
+                    else if (c == ';' || c == ' ')
+                        m_chunkState = ChunkExtension;
+                    else if (c == 0x0D)
+                        m_chunkState = ChunkSizeLF;
+                    else
+                        return false;
+                    break;
+                case ChunkExtension:
+                    if (c == 0x0D)
+                        m_chunkState = ChunkSizeLF;
+                    break;
+                case ChunkSizeLF:
+                    if (c != 0x0A)
+                        return false;
+                    m_chunkState = (m_remaining == 0? TrailerStart : ChunkData);
+                    break;
+                case ChunkData:
+                {
+                    // deliver as much chunk data as possible at once
+                    uint32_t dataLength = (length < m_remaining? length : m_remaining);
+                    if (!deliverBody(data, dataLength))
+                        return false;
+                    data        += dataLength;
+                    length      -= dataLength;
+                    m_remaining -= dataLength;
+                    if (m_remaining == 0)
+                        m_chunkState = ChunkDataCR;
+                    continue;
+                }
+                case ChunkDataCR:
+                    if (c != 0x0D)
+                        return false;
+                    m_chunkState = ChunkDataLF;
+                    break;
+                case ChunkDataLF:
+                    if (c != 0x0A)
+                        return false;
+                    m_chunkState = ChunkSize;
+                    break;
+                case TrailerStart:
+                    m_chunkState = (c == 0x0D? TrailerEndLF : Trailer);
+                    break;
+                case Trailer:
+                    if (c == 0x0A)
+                        m_chunkState = TrailerStart;
+                    break;
+                case TrailerEndLF:
+                    if (c != 0x0A)
+                        return false;
+                    m_bodyComplete = true;
+                    break;
+            }
+            ++data;
+            --length;
+        }
+        return true;
+    }
+    
+    
+    bool MTD_FLASHMEM HTTPClient::deliverBody(char const* data, uint32_t length)
+    {
+        if (m_bodyCallback)
+            return m_bodyCallback(data, length, m_bodyCallbackArg);
+        m_body.append(data, length);
+        return true;
+    }
+    
 	
 }	// fdv namespace
 
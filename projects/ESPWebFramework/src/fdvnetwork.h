@@ -209,15 +209,39 @@ namespace fdv
 		
 		static ClientConnectionStatus getClientConnectionStatus();
 		
-		// returns access point list
-		static APInfo* getAPList(uint32_t* count, bool rescan, bool canRetry = true);
+		// returns a copy of the cached access point list, free it using delete[]
+		// If the list is older than max age (see setAPListMaxAge) a background scan is started, but the
+		// cached list is returned immediately. Waits for the scan only when refresh is true or when the
+		// list has never been filled.
+		// Returns NULL and count = 0 when the list is empty or out of memory.
+		static APInfo* getAPList(uint32_t* count, bool refresh = false);
+		
+		// starts a background scan. Concurrent calls share the scan in progress
+		// returns false on failure
+		static bool scan();
+		
+		// maxAge in milliseconds
+		static void setAPListMaxAge(uint32_t maxAge)
+		{
+			s_APListMaxAge = maxAge;
+		}
 
 		static void scanDoneCB(void* arg, STATUS status);
 		
-		// allocateCount >= 0 -> allocate (or reallocate or free) AP info
-		// allocateCount < 0  -> get infos
-		static Queue<bool>* getAPInfo(APInfo** infos = NULL, uint32_t* count = NULL, int32_t allocateCount = -1);
-        
+	private:
+	
+		static uint32_t const DEFAULTAPLISTMAXAGE = 30000;  // ms
+		static uint32_t const SCANTIMEOUT         = 10000;  // ms
+		
+		static void waitScan();
+		
+		static APInfo*       s_APList;
+		static uint32_t      s_APCount;
+		static bool          s_APListValid;     // true after the first completed scan
+		static uint32_t      s_APListTime;      // millis() at last completed scan
+		static uint32_t      s_APListMaxAge;
+		static bool volatile s_scanning;
+		static uint32_t      s_scanStartTime;   // millis() at scan start
 	};
 	
 
@@ -262,23 +286,94 @@ namespace fdv
     //    char const* ipaddr = strdup(lookup.get().get_str());   // ipaddr will contain a string like "149.3.176.24" (zero terminated). Resulting string has the same lifetime as NSLookup object.
     // Second:
     //    IPAddress ipaddr = NSLookup::lookup("www.google.com");
+    //
+    // Resolved names are kept in a small LRU cache (CACHE_SIZE entries). Positive results live CACHE_TTL ms,
+    // failures live NEGATIVE_TTL ms. lwIP doesn't pass the record TTL to the found callback, so CACHE_TTL is fixed.
+    // Concurrent lookups of the same name share one DNS query.
+    //
+    // Non blocking use:
+    //    void resolved(IPAddress address, void* arg) { ... }   // called from lwIP task, keep it short!
+    //    IPAddress ipaddr;
+    //    if (NSLookup::lookupAsync("www.google.com", &ipaddr, resolved, NULL))
+    //      ... ipaddr is already valid (0.0.0.0 on fail), "resolved" will not be called
+    //    else
+    //      ... "resolved" will be called later
 
     
     struct NSLookup
     {
+        static uint32_t const CACHE_SIZE      = 4;
+        static uint32_t const CACHE_TTL       = 300000;  // ms
+        static uint32_t const NEGATIVE_TTL    = 10000;   // ms
+        static uint32_t const PENDING_TIMEOUT = 20000;   // ms, after this time a pending query is considered lost
+        static uint32_t const MAX_WAITERS     = 3;       // max callbacks waiting for the same pending query
+        static uint32_t const DEFAULT_TIMEOUT = 10000;   // ms
+        
+        // address is 0.0.0.0 on fail
+        typedef void (*Callback)(IPAddress address, void* arg);
+        
         NSLookup(char const* hostname);        
         IPAddress get();
         
-        // returns IPAddress(0, 0, 0, 0) on fail
-        static IPAddress lookup(char const* hostname);
+        // hostname can stay in RAM or Flash
+        // returns IPAddress(0, 0, 0, 0) on fail or timeout
+        static IPAddress lookup(char const* hostname, uint32_t timeOut = DEFAULT_TIMEOUT);
+        
+        // hostname can stay in RAM or Flash
+        // returns true when the result is immediately available (cached or numeric address): *address contains it (0.0.0.0 on fail).
+        // returns false when a DNS query is in progress: callback (if not NULL) will be called once with the result.
+        static bool lookupAsync(char const* hostname, IPAddress* address, Callback callback = NULL, void* arg = NULL);
+        
+        // removes all not pending entries
+        static void flushCache();
 
         // configuration
         // num = 0 or 1 (which dns server to set or get)
         static void setDNSServer(uint32_t num, IPAddress server);
         static IPAddress getDNSServer(uint32_t num);
+        
+    private:
+    
+        enum EntryState
+        {
+            Free = 0,
+            Pending,
+            Resolved,
+            Failed
+        };
+        
+        struct Waiter
+        {
+            Callback callback;
+            void*    arg;
+        };
+        
+        // must be POD: static storage is not constructed
+        struct CacheEntry
+        {
+            char*      hostname;    // heap allocated
+            uint32_t   address;     // network order
+            uint32_t   time;        // resolution or query start time (millis)
+            uint32_t   lastUsed;    // millis
+            EntryState state;
+            Waiter     waiters[MAX_WAITERS];
+        };
+        
+        static bool checkCache(char const* hostname, uint32_t now, IPAddress* address, Callback callback, void* arg, bool* result);
+        static CacheEntry* findEntry(char const* hostname);
+        static CacheEntry* getFreeEntry();
+        static bool isExpired(CacheEntry const* entry, uint32_t now);
+        static bool addWaiter(CacheEntry* entry, Callback callback, void* arg);
+        static bool removeWaiter(Callback callback, void* arg, CacheEntry* entry = NULL);
+        static void complete(char const* hostname, ip_addr_t const* ipaddr);
+        static void dnsFoundCB(char const* name, ip_addr_t* ipaddr, void* arg);
+        static void lookupCB(IPAddress address, void* arg);
+        
     private:
                 
         IPAddress m_ipaddr;
+        
+        static CacheEntry s_cache[CACHE_SIZE];
     };
 
     
@@ -387,6 +482,29 @@ namespace fdv
     
     
     
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// TCPClient
+	// Connects to the specified address. Use getSocket()->isConnected() to check the connection.
+    
+    class TCPClient
+    {
+    public:
+        TCPClient(IPAddress remoteAddress, uint16_t remotePort);
+        
+        ~TCPClient();
+        
+        Socket* getSocket()
+        {
+            return &m_socket;
+        }
+        
+    private:
+        Socket m_socket;
+    };
+    
+    
+    
 	//////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////
 	// TCPServer
@@ -548,11 +666,13 @@ namespace fdv
         void processMultipartFormData(CharChunksIterator headerEnd, int32_t contentLength, char const* contentType);
         
 		CharChunksIterator extractURLEncodedFields(CharChunksIterator begin, CharChunksIterator end, Fields* fields);
-		CharChunksIterator extractHeaders(CharChunksIterator begin, CharChunksIterator end, Fields* fields);
 			
 
 	public:
 		
+		// parses "key: value" lines, zero terminating keys and values in place (used also by HTTPClient)
+		static CharChunksIterator extractHeaders(CharChunksIterator begin, CharChunksIterator end, Fields* fields);
+		
 		void setRoutes(Route const* routes, uint32_t routesCount);
 		
 		// valid only inside processRequest()
@@ -581,7 +701,10 @@ namespace fdv
 	{
 	public:
 		typedef IterDict<CharIterator, CharIterator> Fields;
-	
+
+		// flushHeaders() doesn't send Content-Length (content ends when connection is closed)
+		static uint32_t const UNKNOWNLENGTH = 0xFFFFFFFF;
+
 	
 		HTTPResponse(HTTPHandler* httpHandler, char const* status, char const* content = NULL);
 		
@@ -600,6 +723,12 @@ namespace fdv
 		// accept RAM or Flash strings
 		void addHeader(char const* key, char const* value);
 		
+		// headers are "Name: value\r\n" lines, sent after the other headers. RAM or Flash string, not copied.
+		void setRawHeaders(char const* headers)
+		{
+			m_rawHeaders = headers;
+		}
+		
 		// accept RAM or Flash data
 		void addContent(void const* data, uint32_t length, bool freeOnDestroy = false);
 		
@@ -610,6 +739,10 @@ namespace fdv
 		// can be called many times
 		// WARN: src content is not copied! Just data pointers are stored
 		void addContent(LinkedCharChunks* src);
+		
+		// can be called many times
+		// slice data is not copied, the response keeps a reference to it
+		void addContent(CharSlice const& slice);
 				
         // should be called only after setStatus, addHeader
         virtual void flushHeaders(uint32_t contentLength);
@@ -622,6 +755,7 @@ namespace fdv
 		HTTPHandler*     m_httpHandler;
 		char const*      m_status;		
 		Fields           m_headers;
+		char const*      m_rawHeaders;
 		LinkedCharChunks m_content;
         bool             m_headersFlushed;
 	};
@@ -747,6 +881,7 @@ namespace fdv
 		}
 		
 		void addParamStr(char const* key, char const* value);		
+		void addParamStr(char const* key, CharSlice const& value);
 		void addParamInt(char const* key, int32_t value);
 		void addParamFmt(char const* key, char const *fmt, ...);
 		LinkedCharChunks* addParamCharChunks(char const* key);
@@ -768,26 +903,202 @@ namespace fdv
 
 
 
+	//////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////
+	// HTTPClient
+	// Outbound HTTP/1.1 client.
+	// Connections are kept alive and reused by subsequent requests to the same host and port (up to MAXCONNECTIONS
+	// hosts, least recently used is closed). A kept alive connection found closed by the server is reopened once.
+	// Responses can be delimited by Content-Length, chunked transfer encoding or connection close.
+	// Response body is stored (getBody()) or, when a body callback is set, streamed to it without storing.
+	// Response header names are converted to lower case. Example: getHeader(FSTR("content-type"))
+	//
+	// Example:
+	//   HTTPClient client;
+	//   for (...)
+	//     if (client.post(FSTR("api.example.com"), 80, FSTR("/samples"), FSTR("application/json"), json, f_strlen(json)) != 200)
+	//       ...
+	
+	class HTTPClient
+	{
+	public:
+	
+		static uint32_t const MAXCONNECTIONS   = 2;
+		static uint32_t const MAXHEADERSIZE    = 1024;    // max size of response status line and headers
+		static uint32_t const READBUFFERSIZE   = 128;     // body read buffer (allocated on stack)
+		static uint32_t const TIMEOUT          = 5000;    // ms, socket receive timeout
+		static uint32_t const KEEPALIVETIMEOUT = 10000;   // ms, idle connections older than this are not reused
+		static uint32_t const UNKNOWNLENGTH    = 0xFFFFFFFF;
+		
+		typedef HTTPHandler::Fields Fields;
+		
+		// called from request() for each received piece of body
+		// returns false to abort the request (the connection will be closed)
+		typedef bool (*BodyCallback)(void const* data, uint32_t length, void* arg);
+		
+		HTTPClient();
+		~HTTPClient();
+		
+		// all strings can stay in RAM or Flash
+		// headers contains additional header lines, each terminated by "\r\n" (can be NULL)
+		// returns the HTTP status code (ex. 200) or 0 on fail (connection, protocol error, or aborted by body callback)
+		int32_t request(char const* method, char const* hostname, uint16_t port, char const* path,
+		                char const* contentType = NULL, void const* body = NULL, uint32_t bodyLength = 0, char const* headers = NULL);
+		
+		int32_t get(char const* hostname, uint16_t port, char const* path, char const* headers = NULL)
+		{
+			return request(FSTR("GET"), hostname, port, path, NULL, NULL, 0, headers);
+		}
+		
+		int32_t post(char const* hostname, uint16_t port, char const* path, char const* contentType, void const* body, uint32_t bodyLength, char const* headers = NULL)
+		{
+			return request(FSTR("POST"), hostname, port, path, contentType, body, bodyLength, headers);
+		}
+		
+		// callback = NULL stores body into getBody()
+		void setBodyCallback(BodyCallback callback, void* arg = NULL)
+		{
+			m_bodyCallback    = callback;
+			m_bodyCallbackArg = arg;
+		}
+		
+		// valid until next request
+		Fields* getHeaders()
+		{
+			return &m_headers;
+		}
+		
+		// name must be lower case and can stay in RAM or Flash
+		// returns NULL if not found. Valid until next request.
+		char const* getHeader(char const* name)
+		{
+			return m_headers[name];
+		}
+		
+		// valid until next request. Empty when a body callback is set.
+		LinkedCharChunks* getBody()
+		{
+			return &m_body;
+		}
+		
+		// closes all kept alive connections
+		void close();
+		
+	private:
+	
+		// must be POD: m_connections is zero initialized by the constructor
+		struct Connection
+		{
+			char*      hostname;   // NULL = free slot
+			uint16_t   port;
+			char*      host;       // "Host" header value: "hostname" or "hostname:port"
+			TCPClient* client;
+			uint32_t   lastUsed;   // millis
+		};
+		
+		enum ChunkState
+		{
+			ChunkSize,
+			ChunkExtension,
+			ChunkSizeLF,
+			ChunkData,
+			ChunkDataCR,
+			ChunkDataLF,
+			TrailerStart,
+			Trailer,
+			TrailerEndLF
+		};
+		
+		Connection* getConnection(char const* hostname, uint16_t port, bool* reused);
+		void closeConnection(Connection* connection);
+		bool sendRequest(Connection* connection, char const* method, char const* path, char const* contentType, void const* body, uint32_t bodyLength, char const* headers);
+		bool receiveResponse(Socket* socket, bool headRequest);
+		bool processBody(char const* data, uint32_t length);
+		bool deliverBody(char const* data, uint32_t length);
+		
+	private:
+	
+		Connection       m_connections[MAXCONNECTIONS];
+		APtr<char>       m_headerBuffer;     // allocated on first request
+		LinkedCharChunks m_headerChunks;     // references m_headerBuffer, for header parsing
+		Fields           m_headers;
+		LinkedCharChunks m_body;
+		BodyCallback     m_bodyCallback;
+		void*            m_bodyCallbackArg;
+		int32_t          m_status;
+		bool             m_keepAlive;        // connection can be reused after current response
+		bool             m_receivedAny;      // something has been received for current request
+		bool             m_bodyComplete;
+		bool             m_chunked;
+		ChunkState       m_chunkState;
+		uint32_t         m_remaining;        // remaining body bytes (or current chunk bytes), UNKNOWNLENGTH = until close
+	};
+	
+	
+
     ////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////
     // SNTPClient
     // Gets current date/time from a NTP (SNTP) server (default is ntp1.inrim.it).
+    //
+    // query() blocks the calling task until the reply arrives.
+    // request() queries up to MAXSERVERS servers without blocking: replies are collected from lwIP task, then
+    // isCompleted() and getBestSample() return the reply with the lowest round trip delay.
+    // Replies are matched by server address and by the transmit timestamp (a random nonce) echoed back as originate timestamp.
 
     class SNTPClient
     {
 
     public:
 
+        static uint32_t const MAXSERVERS   = 4;
+        static uint32_t const REPLYTIMEOUT = 3000;  // ms
+        
+        // must be POD
+        struct Sample
+        {
+            uint64_t serverTime;      // UTC unix time in ms, estimated at receiveMillis
+            uint32_t receiveMillis;   // millis() when the reply has been received
+            uint32_t delay;           // round trip delay in us, without server processing time
+        };
+
         // default is 193.204.114.232 (ntp1.inrim.it)
         explicit SNTPClient(IPAddress serverIP = IPAddress(193, 204, 114, 232), uint16_t port = 123);
 
         bool query(uint64_t* outValue) const;
+        
+        // doesn't block. Cancels a pending request.
+        // returns false on fail (no memory)
+        static bool request(IPAddress const* servers, uint32_t count);
+        
+        // true when all servers have replied or REPLYTIMEOUT has elapsed
+        static bool isCompleted();
+        
+        // returns false when no server has replied
+        static bool getBestSample(Sample* sample);
 
 
     private:
+    
+        // must be POD
+        struct Request
+        {
+            uint32_t address;        // network order
+            uint32_t nonce[2];       // transmit timestamp sent to the server
+            uint32_t sendMicros;
+            bool     replied;
+            Sample   sample;
+        };
+        
+        static void recvFn(void* arg, udp_pcb* pcb, pbuf* p, ip_addr_t* addr, u16_t port);
 
         IPAddress m_server;
         uint16_t  m_port;
+        
+        static udp_pcb* s_pcb;
+        static Request  s_requests[MAXSERVERS];
+        static uint32_t s_requestsCount;
+        static uint32_t s_requestMillis;
     };
     
     
@@ -795,42 +1106,116 @@ namespace fdv
     ////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////
     // ICMP
+    // Sends ICMP Echo Requests to many targets at once over a single raw PCB.
+    // Replies are matched by identifier (one per ICMP object) and sequence number (round and target index), so
+    // a sweep of all targets completes within one timeout.
+    // Targets cannot be added or cleared while sweep() is running.
+    // warn: the lwIP ARP table limits how many not yet resolved hosts of a local network can be probed at the same time.
+    //
+    // Example:
+    //   ICMP icmp;
+    //   icmp.addTarget(IPAddress(192, 168, 1, 1));
+    //   icmp.addTarget(IPAddress(192, 168, 1, 2));
+    //   for (uint32_t i = 0; i != 3; ++i)
+    //     icmp.sweep();
+    //   ICMP::Stats const* stats = icmp.getStats(1);
     
     class ICMP
     {
                 
     public:
     
+        static uint32_t const MAXTARGETS     = 256;
+        static uint32_t const DEFAULTTIMEOUT = 4000;   // ms
+        
+        // must be POD
+        struct Stats
+        {
+            uint32_t address;       // network order
+            uint32_t sent;
+            uint32_t received;
+            uint32_t minTime;       // us
+            uint32_t maxTime;       // us
+            uint32_t totalTime;     // us
+            int32_t  lastTime;      // us, -1 = last request timed out
+            uint16_t lastBytes;
+            uint16_t lastTTL;
+            
+            uint32_t getAvgTime() const
+            {
+                return received? totalTime / received : 0;
+            }
+            
+            // percentage of lost replies
+            uint32_t getLoss() const
+            {
+                return sent? (sent - received) * 100 / sent : 0;
+            }
+        };
+    
         ICMP();
+        ~ICMP();
+        
+        // returns target index, or -1 when MAXTARGETS has been reached or there is no memory
+        int32_t addTarget(IPAddress const& address);
+        
+        void clearTargets();
+        
+        uint32_t getTargetsCount()
+        {
+            return m_targetsCount;
+        }
+        
+        // warn: this doesn't check "index" range!
+        Stats const* getStats(uint32_t index)
+        {
+            return &m_targets[index].stats;
+        }
+        
+        // sends one Echo Request to each target, then waits until all replied or timeOut (ms)
+        // returns the number of received replies
+        uint32_t sweep(uint32_t timeOut = DEFAULTTIMEOUT);
     
-        // send Echo Request and wait for Echo Reply
+        // send Echo Request and wait for Echo Reply (dest becomes the only target)
         // return "measured" echo time in microseconds. ret -1 on timeout or error
         int32_t ping(IPAddress const& dest);
         
+        // last ping() results
         uint16_t receivedBytes()
         {
-            return m_receivedBytes;
+            return m_targets[0].stats.lastBytes;
         }
         
         uint16_t receivedTTL()
         {
-            return m_receivedTTL;
+            return m_targets[0].stats.lastTTL;
         }
         
         uint16_t receivedSeq()
         {
-            return m_waitingSeq;
+            return m_targets[0].stats.sent;
         }
         
     private:
     
+        // must be POD
+        struct Target
+        {
+            Stats    stats;
+            uint32_t sendMicros;
+            bool     pending;
+        };
+    
         static uint8_t raw_recv_fn(void *arg, raw_pcb *pcb, pbuf *p, ip_addr_t *addr);
 
-        uint16_t        m_waitingID;
-        uint16_t        m_waitingSeq;
-        Queue<uint32_t> m_queue;
-        uint16_t        m_receivedBytes;
-        uint16_t        m_receivedTTL;
+        raw_pcb*        m_pcb;
+        uint16_t        m_id;
+        uint8_t         m_round;
+        Target*         m_targets;
+        uint32_t        m_targetsCount;
+        uint32_t        m_targetsAllocated;
+        uint32_t        m_pendingCount;     // requests of current round still waiting for reply
+        Queue<uint32_t> m_queue;            // signaled when all replies of current round have been received
         
     };
 
@@ -848,6 +1233,225 @@ namespace fdv
     
     
     
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // NAPT
+    // Network Address and Port Translation (source NAT) for TCP, UDP and ICMP Echo.
+    // Used by Router to hide Access Point network behind the Client network IP, so upstream routers don't need a static route.
+    //
+    // Translated ports (or ICMP identifiers) are PORTBASE + table slot, so inbound packets find their entry directly.
+    // Outbound lookup is open addressed with at most MAXPROBES probes: per packet cost is constant also when the table is full.
+    // When all probed slots are alive the least recently used one is recycled.
+    // Table size is TABLESIZE * 20 bytes, allocated at the first enable() and never freed.
+    
+    class NAPT
+    {
+    
+        static uint32_t const TABLESIZE      = 128;       // must be a power of 2
+        static uint32_t const MAXPROBES      = 8;
+        static uint16_t const PORTBASE       = 40000;     // below lwIP local ports (49152...)
+        static uint32_t const TCP_TIMEOUT    = 1800000;   // ms
+        static uint32_t const TCPFIN_TIMEOUT = 20000;     // ms, after FIN or RST
+        static uint32_t const UDP_TIMEOUT    = 60000;     // ms
+        static uint32_t const ICMP_TIMEOUT   = 20000;     // ms
+        static uint8_t const  TCPFLAG_FIN    = 0x01;
+        static uint8_t const  TCPFLAG_RST    = 0x04;
+    
+    public:
+    
+        // returns false on out of memory
+        static bool enable();
+        static void disable();
+        
+        static bool isEnabled()
+        {
+            return s_enabled;
+        }
+        
+        // iphdr points to IP header, len is the contiguous length (header + transport header)
+        // translates source address and port of a packet going out from outIntf
+        // returns false if the packet cannot be translated (should be dropped)
+        static bool translateOutbound(ip_hdr* iphdr, uint32_t len, netif* outIntf);
+        
+        // translates destination address and port of a packet received by the translating interface
+        // returns false if the packet doesn't belong to a translated connection
+        static bool translateInbound(ip_hdr* iphdr, uint32_t len);
+        
+        static uint32_t getActiveCount();
+        
+    private:
+    
+        // proto = 0 means free entry
+        struct Entry
+        {
+            uint32_t srcAddr;       // private address
+            uint32_t dstAddr;
+            uint16_t srcPort;       // private port or ICMP identifier (network order)
+            uint16_t dstPort;       // network order, 0 for ICMP
+            uint32_t lastUsed;      // millis
+            uint8_t  proto;
+            bool     closing;       // TCP FIN or RST seen
+        };
+        
+        static uint8_t* getTransportHeader(ip_hdr* iphdr, uint32_t len);
+        static Entry* getEntry(uint8_t proto, uint32_t srcAddr, uint16_t srcPort, uint32_t dstAddr, uint16_t dstPort, uint32_t now);
+        static bool isAlive(Entry const* entry, uint32_t now);
+        static void adjustChecksum(uint16_t* chksum, uint16_t oldValue, uint16_t newValue);
+        static void adjustChecksum(uint16_t* chksum, uint32_t oldValue, uint32_t newValue);
+        
+        static bool   s_enabled;
+        static Entry* s_table;
+    };
+    
+    
+    
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // RateLimiter
+    // Token buckets for routed traffic, one for each Access Point network client (source IP of
+    // uploaded packets, destination IP of downloaded packets). Used by Router.
+    // Clients table is bounded to MAXCLIENTS: when full the least recently used client is recycled.
+    
+    class RateLimiter
+    {
+    
+        static uint32_t const MAXCLIENTS = 8;
+        
+    public:
+    
+        static uint32_t const MINBURST   = 1500;   // MTU, smaller bursts would drop every full size packet
+    
+        struct ClientStats
+        {
+            uint32_t address;       // network order, 0 = unused
+            uint32_t droppedPackets;
+            uint32_t droppedBytes;
+        };
+        
+        // rate in bytes per second (0 = disabled), burst in bytes (at least MINBURST)
+        static void configure(uint32_t rate, uint32_t burst);
+        
+        static bool isEnabled()
+        {
+            return s_rate != 0;
+        }
+        
+        // returns false if the packet must be dropped
+        static bool consume(uint32_t clientAddr, uint32_t length);
+        
+        // index 0...MAXCLIENTS-1. Returns false if index is out of range
+        static bool getClientStats(uint32_t index, ClientStats* stats);
+        
+    private:
+    
+        struct Bucket
+        {
+            ClientStats stats;
+            uint32_t    tokens;     // bytes
+            uint32_t    lastRefill; // millis
+            uint32_t    lastUsed;   // millis
+        };
+        
+        static Bucket* getBucket(uint32_t clientAddr, uint32_t now);
+    
+        static uint32_t s_rate;
+        static uint32_t s_burst;
+        static Bucket   s_buckets[MAXCLIENTS];
+    };
+
+
+
+    ////////////////////////////////////////////////////////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////////////////
+    // PacketCapture
+    // Copies routed IP packets, truncated to snapLen bytes, into a ring buffer allocated by start().
+    // The ring contains pcap records (LINKTYPE_RAW, microseconds timestamps) which follow the header
+    // returned by getFileHeader(). Used by Router.
+    // When the ring is full new packets are dropped: capture never blocks and never allocates memory.
+    // Only one reader is allowed: start() fails if already started and returns an owner token which
+    // must be passed to read() and stop(). Calls with any other token are ignored.
+
+    class PacketCapture
+    {
+
+    public:
+
+        static uint32_t const DEFAULTBUFFERSIZE = 8192;
+        static uint32_t const DEFAULTSNAPLEN    = 96;
+        static uint32_t const MINSNAPLEN        = 20;     // IP header
+        static uint32_t const MAXSNAPLEN        = 1500;   // MTU
+
+        struct FileHeader
+        {
+            uint32_t magic;
+            uint16_t versionMajor;
+            uint16_t versionMinor;
+            int32_t  thisZone;
+            uint32_t sigFigs;
+            uint32_t snapLen;
+            uint32_t linkType;
+        };
+
+        struct RecordHeader
+        {
+            uint32_t seconds;
+            uint32_t microseconds;
+            uint32_t capturedLength;
+            uint32_t originalLength;
+        };
+
+        // snapLen is adjusted to MINSNAPLEN...MAXSNAPLEN
+        // returns the owner token, 0 if already started or out of memory
+        static uint32_t start(uint32_t bufferSize, uint32_t snapLen);
+
+        static void stop(uint32_t owner);
+
+        static bool isEnabled()
+        {
+            return s_buffer != NULL;
+        }
+
+        static void getFileHeader(FileHeader* header);
+
+        // p->payload must point to the IP header
+        static void capture(pbuf* p);
+
+        // copies only whole records, so maxLength should be at least sizeof(RecordHeader) + MAXSNAPLEN
+        // returns copied bytes (0 = ring is empty or not the owner)
+        static uint32_t read(uint32_t owner, void* buffer, uint32_t maxLength);
+
+        static uint32_t getCapturedPackets()
+        {
+            return s_capturedPackets;
+        }
+
+        static uint32_t getDroppedPackets()
+        {
+            return s_droppedPackets;
+        }
+
+    private:
+
+        static void writeRing(uint32_t pos, void const* data, uint32_t length);
+        static void readRing(uint32_t pos, void* data, uint32_t length);
+
+        static uint8_t* volatile s_buffer;
+        static uint32_t volatile s_owner;             // token returned by start(), 0 = stopped
+        static uint32_t          s_lastOwner;         // last token generated
+        static uint32_t          s_bufferSize;
+        static uint32_t          s_snapLen;
+        static uint32_t          s_head;              // write position
+        static uint32_t          s_tail;              // read position
+        static uint32_t volatile s_used;              // bytes of complete records
+        static uint32_t          s_seconds;           // timestamp of last captured packet
+        static uint32_t          s_microseconds;
+        static uint32_t          s_lastMicros;        // micros() at last captured packet
+        static uint32_t          s_capturedPackets;
+        static uint32_t          s_droppedPackets;
+    };
+
+    
+    
     ////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////
     // Router
@@ -855,19 +1459,52 @@ namespace fdv
     class Router
     {
     
-        static uint32_t const INTFCOUNT = 2;
+        static uint32_t const INTFCOUNT      = 2;
+        static uint32_t const ROUTECACHESIZE = 8;    // must be a power of 2
     
     public:
+    
+        // counters are related to the input interface
+        struct Counters
+        {
+            uint32_t forwardedPackets;
+            uint32_t forwardedBytes;
+            uint32_t droppedPackets;
+            uint32_t droppedBytes;
+        };
         
         static void enable();        
         static void disable();
+        
+        static bool isEnabled()
+        {
+            return s_enabled;
+        }
+        
+        // should be called when IP configuration of an interface changes or interfaces are added/removed
+        static void invalidateRouteCache();
+        
+        static void getCounters(uint32_t intfIndex, Counters* counters);
+        static void resetCounters();
     
     private:
     
+        // direct mapped destination IP -> output interface cache
+        struct RouteCacheEntry
+        {
+            uint32_t dest;
+            netif*   intf;          // NULL = empty
+            uint32_t intfAddr;      // intf->ip_addr at caching time, detects address changes (ie DHCP)
+        };
+    
         static err_t netif_input(pbuf *p, netif *inp);
+        static netif* findRoute(uint32_t dest);
+        static bool isInterfaceValid(netif* intf);
         
-        static bool           s_enabled;
-        static netif_input_fn s_prevInput[INTFCOUNT];
+        static bool            s_enabled;
+        static netif_input_fn  s_prevInput[INTFCOUNT];
+        static RouteCacheEntry s_routeCache[ROUTECACHESIZE];
+        static Counters        s_counters[INTFCOUNT];
     };
     
 
@@ -660,7 +660,10 @@ repeat:
         if (!s) s = FSTR("<NULL>");
         len = f_strnlen(s, precision);
         if (!(flags & LEFT)) while (len < field_width--) *str++ = ' ';
-        for (i = 0; i < len; ++i) *str++ = fdv::getChar(s++);
+        {
+          fdv::FlashReader reader(s);   // one flash dword read every four chars
+          for (i = 0; i < len; ++i) *str++ = reader.read();
+        }
         while (len < field_width--) *str++ = ' ';
         continue;
 
@@ -89,14 +89,14 @@ namespace fdv
 					write(c);
 				if (c == 0x0A || c == 0x0D)
 				{
-					receivedLine->append(0x00, 1);
+					receivedLine->append((char)0x00, 1);
 					c = peek();
 					if (c == 0x0A || c == 0x0D)
 						read();	// discard
 					return true;
 				}
 				else
-					receivedLine->append(c, 16);
+					receivedLine->append(c);
 			}
 			else
 				return false;
@@ -116,8 +116,9 @@ namespace fdv
 	{
 		if (isStoredInFlash(buffer))
 		{
+			FlashReader reader(buffer);
 			for (;bufferLen > 0; --bufferLen)
-				write(getByte(buffer++));
+				write(reader.read());
 		}
 		else
 		{
@@ -132,14 +133,12 @@ namespace fdv
 	{
 		if (isStoredInFlash(str))
 		{
-			while (getChar(str))
-				write(getChar(str++));
+			FlashReader reader(str);
+			for (uint8_t c; (c = reader.read()) != 0; )
+				write(c);
 		}
 		else
-		{
-			while (*str)
-				write(*str++);
-		}
+			write((uint8_t const*)str, strlen(str));	// one bulk write
 	}
 	
 
@@ -190,46 +189,68 @@ namespace fdv
 	
 	
 	// call only from ISR
+	// value is discarded when the ring is full
 	void MTD_FLASHMEM HardwareSerial::put(uint8_t value)
 	{
-		m_queue.sendFromISR(value);
+		m_rxRing.put(value);
+	}
+	
+	
+	// call only from ISR
+	// drains the hardware FIFO in one burst (bytes exceeding ring space are discarded) and signals the reader once
+	void MTD_FLASHMEM HardwareSerial::receiveFromISR()
+	{
+		uint32_t count = (READ_PERI_REG(UART_STATUS(0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+		for (; count > 0; --count)
+			m_rxRing.put(READ_PERI_REG(UART_FIFO(0)) & 0xFF);
+		m_rxEvent.unlockFromISR();
 	}
 	
 	
 	int16_t MTD_FLASHMEM HardwareSerial::peek()
 	{
-		uint8_t ret;
-		if (m_queue.peek(&ret, 0))
-			return ret;
-		return -1;
+		return m_rxRing.peek();
 	}
 	
 	
 	int16_t MTD_FLASHMEM HardwareSerial::read(uint32_t timeOutMs)
 	{
-		uint8_t ret;
-		if (m_queue.receive(&ret, timeOutMs))
-			return ret;
+		if (waitForData(timeOutMs))
+			return m_rxRing.get();
 		return -1;				
 	}
 	
 	
+	// timeOutMs is applied waiting for each block of data
+	uint16_t MTD_FLASHMEM HardwareSerial::read(void* buffer, uint16_t bufferLen, uint32_t timeOutMs)
+	{
+		uint8_t* bbuf = (uint8_t*)buffer;
+		uint16_t ret = 0;
+		while (ret < bufferLen && waitForData(timeOutMs))
+			ret += m_rxRing.get(bbuf + ret, bufferLen - ret);
+		return ret;
+	}
+	
+	
 	uint16_t MTD_FLASHMEM HardwareSerial::available()
 	{
-		return m_queue.available();
+		return m_rxRing.available();
 	}
 	
 	
 	void MTD_FLASHMEM HardwareSerial::flush()
 	{
-		m_queue.clear();
+		m_rxRing.clear();
 	}
 	
 	
+	// m_rxEvent may be already unlocked by a previous interrupt, so it is checked again
 	bool MTD_FLASHMEM HardwareSerial::waitForData(uint32_t timeOutMs)
 	{
-		uint8_t b;
-		return m_queue.peek(&b, timeOutMs);
+		while (m_rxRing.available() == 0)
+			if (!m_rxEvent.lock(timeOutMs))
+				return false;
+		return true;
 	}
 	
 	
@@ -239,14 +260,15 @@ namespace fdv
 
 		while (uart_intr_status != 0) 
 		{
-			if (UART_RXFIFO_FULL_INT_ST == (uart_intr_status & UART_RXFIFO_FULL_INT_ST)) 
+			if (uart_intr_status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) 
 			{
-				while (READ_PERI_REG(UART_STATUS(0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-				{
-					uint8_t recByte = READ_PERI_REG(UART_FIFO(0)) & 0xFF;
-					HardwareSerial::getSerial(0)->put(recByte);
-				}				
-				WRITE_PERI_REG(UART_INT_CLR(0), UART_RXFIFO_FULL_INT_CLR);
+				HardwareSerial::getSerial(0)->receiveFromISR();
+				WRITE_PERI_REG(UART_INT_CLR(0), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
+			}
+			if (uart_intr_status & UART_TXFIFO_EMPTY_INT_ST)
+			{
+				HardwareSerial::getSerial(0)->transmitFromISR();
+				WRITE_PERI_REG(UART_INT_CLR(0), UART_TXFIFO_EMPTY_INT_CLR);
 			}
 			uart_intr_status = READ_PERI_REG(UART_INT_ST(0));
 		}
@@ -255,8 +277,8 @@ namespace fdv
 	
 	void MTD_FLASHMEM HardwareSerial::reconfig(uint32_t baud_rate)
 	{
-		// wait tx fifo empty
-		while (READ_PERI_REG(UART_STATUS(0)) & (UART_TXFIFO_CNT << UART_TXFIFO_CNT_S));
+		// wait tx ring and fifo empty
+		flushTX();
 
 		PIN_PULLUP_DIS(PERIPHS_IO_MUX_U0TXD_U);
 		PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, FUNC_U0RXD);
@@ -276,9 +298,9 @@ namespace fdv
 		SET_PERI_REG_MASK(UART_CONF0(0), UART_RXFIFO_RST | UART_TXFIFO_RST);
 		CLEAR_PERI_REG_MASK(UART_CONF0(0), UART_RXFIFO_RST | UART_TXFIFO_RST);		
 		
-		uint8_t const UART_RX_TimeOutIntrThresh   = 2;
-		uint8_t const UART_TX_FifoEmptyIntrThresh = 20;
-		uint8_t const UART_RX_FifoFullIntrThresh  = 1;
+		uint8_t const UART_RX_TimeOutIntrThresh   = RXTIMEOUT;
+		uint8_t const UART_TX_FifoEmptyIntrThresh = TXFIFO_THRESHOLD;
+		uint8_t const UART_RX_FifoFullIntrThresh  = RXFIFO_THRESHOLD;
 		uint32_t reg_val = 0;		
 		WRITE_PERI_REG(UART_INT_CLR(0), UART_INTR_MASK);		
 		reg_val = READ_PERI_REG(UART_CONF1(0)) & ~((UART_RX_FLOW_THRHD << UART_RX_FLOW_THRHD_S) | UART_RX_FLOW_EN) ;
@@ -288,22 +310,93 @@ namespace fdv
 		WRITE_PERI_REG(UART_CONF1(0), reg_val);
 		
 		CLEAR_PERI_REG_MASK(UART_INT_ENA(0), UART_INTR_MASK);		
-		SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RXFIFO_FULL_INT_ENA);		
+		SET_PERI_REG_MASK(UART_INT_ENA(0), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);		
 		_xt_isr_attach(ETS_UART_INUM, HardwareSerial_rx_handler, NULL);
 		
 		ETS_UART_INTR_ENABLE();		
 	}
 
 	
+	// blocks only when the TX ring is full
 	void MTD_FLASHMEM HardwareSerial::write(uint8_t b)
 	{
+		while (tryWrite(&b, 1) == 0)
+			waitTX(portMAX_DELAY);
+	}
+	
+	
+	// buffer can stay in RAM or Flash
+	// blocks only when the TX ring is full
+	void MTD_FLASHMEM HardwareSerial::write(uint8_t const* buffer, uint16_t bufferLen)
+	{
+		if (isStoredInFlash(buffer))
+		{
+			Serial::write(buffer, bufferLen);
+			return;
+		}
 		while (true)
 		{
-			uint32_t fifo_cnt = READ_PERI_REG(UART_STATUS(0)) & (UART_TXFIFO_CNT << UART_TXFIFO_CNT_S);
-			if ((fifo_cnt >> UART_TXFIFO_CNT_S & UART_TXFIFO_CNT) < 126)
+			uint16_t len = tryWrite(buffer, bufferLen);
+			buffer    += len;
+			bufferLen -= len;
+			if (bufferLen == 0)
 				break;
+			waitTX(portMAX_DELAY);
 		}
-		WRITE_PERI_REG(UART_FIFO(0) , b);
+	}
+	
+	
+	// non blocking write. Buffer must stay in RAM.
+	// returns number of bytes put into the TX ring (less than bufferLen when the ring is full)
+	uint16_t MTD_FLASHMEM HardwareSerial::tryWrite(uint8_t const* buffer, uint16_t bufferLen)
+	{
+		Critical critical;
+		uint16_t len = m_txRing.put(buffer, bufferLen);
+		SET_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
+		return len;
+	}
+	
+	
+	// waits until all bytes have been transmitted
+	// returns false on timeout
+	bool MTD_FLASHMEM HardwareSerial::flushTX(uint32_t timeOutMs)
+	{
+		SoftTimeOut timeout(timeOutMs);
+		while (m_txRing.available() > 0)
+			if (!waitTX(timeOutMs) || timeout)
+				return false;
+		// last bytes in the hardware FIFO: at most FIFO_SIZE bytes time
+		while (READ_PERI_REG(UART_STATUS(0)) & (UART_TXFIFO_CNT << UART_TXFIFO_CNT_S))
+			if (timeout)
+				return false;
+		return true;
+	}
+	
+	
+	// waits for the ISR to move some bytes out of the TX ring
+	// Before the scheduler starts (ie inside user_init()) or when interrupts are masked (ie debug() inside Critical) the
+	// TX interrupt cannot run, so the caller moves bytes by itself, polling the hardware FIFO.
+	bool MTD_FLASHMEM HardwareSerial::waitTX(uint32_t timeOutMs)
+	{
+		if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING && !interruptsMasked())
+			return m_txEvent.lock(timeOutMs);
+		Critical critical;
+		transmitFromISR();
+		return true;
+	}
+	
+	
+	// call only from ISR (or inside Critical)
+	// fills the hardware FIFO from the TX ring, disables TX interrupt when the ring becomes empty
+	void MTD_FLASHMEM HardwareSerial::transmitFromISR()
+	{
+		uint32_t fifoCount = (READ_PERI_REG(UART_STATUS(0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+		uint32_t count = fifoCount < TXFIFO_LIMIT ? TXFIFO_LIMIT - fifoCount : 0;
+		for (int16_t b; count > 0 && (b = m_txRing.get()) > -1; --count)
+			WRITE_PERI_REG(UART_FIFO(0), b);
+		if (m_txRing.available() == 0)
+			CLEAR_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
+		m_txEvent.unlockFromISR();
 	}
 	
 
@@ -56,12 +56,12 @@ namespace fdv
 			virtual uint16_t available() = 0;
 			virtual void flush() = 0;
 			virtual bool waitForData(uint32_t timeOutMs = portMAX_DELAY) = 0;
+			virtual uint16_t read(void* buffer, uint16_t bufferLen, uint32_t timeOutMs = 0);
 								
-			uint16_t read(void* buffer, uint16_t bufferLen, uint32_t timeOutMs = 0);
 			bool readLine(bool echo, LinkedCharChunks* receivedLine, uint32_t timeOutMs = portMAX_DELAY);
 
+			virtual void write(uint8_t const* buffer, uint16_t bufferLen);
 			void writeNewLine();			
-			void write(uint8_t const* buffer, uint16_t bufferLen);
 			void write(char const* str);
 			void writeln(char const* str);
 			uint16_t printf(char const *fmt, ...);						
@@ -79,12 +79,23 @@ namespace fdv
 	// HardwareSerial
 	
 	// only UART0 is supported
+	// Received bytes go into a lock free ring: the interrupt fires when the hardware FIFO reaches RXFIFO_THRESHOLD bytes
+	// or when the line is idle (RX timeout), then it drains the whole FIFO and wakes up the reading task once.
+	// Only one task at a time can read.
+	// Written bytes go into another ring, moved to the hardware FIFO by the TX FIFO empty interrupt. Writing tasks
+	// block (yielding the CPU) only when the TX ring is full. Any task can write.
 	class HardwareSerial : public Serial
 	{
 		public:
 		
-			explicit HardwareSerial(uint32_t baud_rate = 115200, uint32_t rxBufferLength = 128)
-				: m_queue(rxBufferLength)
+			static uint8_t const FIFO_SIZE        = 128;	// hardware RX and TX FIFOs size
+			static uint8_t const RXFIFO_THRESHOLD = 32;
+			static uint8_t const RXTIMEOUT        = 2;	// idle time (in bytes time) before RX timeout interrupt
+			static uint8_t const TXFIFO_THRESHOLD = 20;	// TX interrupt fires when hardware FIFO has less bytes than this
+			static uint8_t const TXFIFO_LIMIT     = 126;	// TX FIFO is filled up to this count
+		
+			explicit HardwareSerial(uint32_t baud_rate = 115200, uint32_t rxBufferLength = 128, uint32_t txBufferLength = 256)
+				: m_rxRing(rxBufferLength), m_txRing(txBufferLength)
 			{		
 				reconfig(baud_rate);
 			}
@@ -93,21 +104,40 @@ namespace fdv
 			
 			using Serial::write;
 			void write(uint8_t b);
+			void write(uint8_t const* buffer, uint16_t bufferLen);
+			uint16_t tryWrite(uint8_t const* buffer, uint16_t bufferLen);
+			bool flushTX(uint32_t timeOutMs = portMAX_DELAY);
 		
 			static HardwareSerial* getSerial(uint32_t uart);
 			
+			// true if the UART has been configured (its pins are in use)
+			static bool isInUse(uint32_t uart)
+			{
+				return s_serials[uart] != NULL;
+			}
+			
 			// call only from ISR
 			void put(uint8_t value);
+			void receiveFromISR();
+			void transmitFromISR();
 			
 			int16_t peek();			
 			int16_t read(uint32_t timeOutMs = 0);			
+			uint16_t read(void* buffer, uint16_t bufferLen, uint32_t timeOutMs = 0);
 			uint16_t available();			
 			void MTD_FLASHMEM flush();			
 			bool MTD_FLASHMEM waitForData(uint32_t timeOutMs = portMAX_DELAY);			
 		
 		private:
 		
-			Queue<uint8_t>         m_queue;
+			bool waitTX(uint32_t timeOutMs);
+			
+		private:
+		
+			ByteRing               m_rxRing;
+			Mutex                  m_rxEvent;	// unlocked by ISR after received bytes are put into m_rxRing
+			ByteRing               m_txRing;	// written only inside Critical (many producers)
+			Mutex                  m_txEvent;	// unlocked by ISR after bytes are moved from m_txRing
 			
 			static HardwareSerial* s_serials[1];	// only one serial is supported
 	};
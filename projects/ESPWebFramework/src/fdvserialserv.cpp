@@ -78,8 +78,17 @@ namespace fdv
              
             {FSTR("free"),       
              STR_, 
-             FSTR("Display amount of free and used memory"), 
+             FSTR("Display amount of free and used memory and slab allocator statistics"), 
              &SerialConsole::cmd_free},
+
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+             // example:
+             //   heap
+            {FSTR("heap"),
+             STR_,
+             FSTR("Display heap usage by allocation call site"),
+             &SerialConsole::cmd_heap},
+#endif
              
              // example:
              //  ifconfig
@@ -133,17 +142,24 @@ namespace fdv
              FSTR("Display how long the system has been running"), 
              &SerialConsole::cmd_uptime},
              
+             // example:
+             //   ping 192.168.1.1
+             //   ping 192.168.1.1 www.google.com
+             //   ping 192.168.1.0/24
             {FSTR("ping"),
-             FSTR("SERVER"),
-             FSTR("Sends ICMP ECHO_REQUEST and waits for ECHO_RESPONSE"),
+             FSTR("SERVER [SERVER...] | NETWORK/BITS"),
+             FSTR("Sends ICMP ECHO_REQUEST and waits for ECHO_RESPONSE\r\n\tmany SERVERs or NETWORK/BITS: 3 rounds, then statistics"),
              &SerialConsole::cmd_ping},
              
              // example:
+             //   router
              //   router on
              //   router off
+             //   router reset
+             //   router napt on
             {FSTR("router"),
-             FSTR("on | off"),
-             FSTR("Enable/disable routing between networks"),
+             FSTR("[on | off | reset | napt on | napt off]"),
+             FSTR("No params: Display routing state and counters\r\n\ton | off: Enable/disable routing between networks\r\n\treset: Reset counters\r\n\tnapt: Enable/disable address translation of Access Point network"),
              &SerialConsole::cmd_router},
              
              // example:
@@ -328,17 +344,64 @@ namespace fdv
         uint32_t const totHeap  = 0x14000;
         uint32_t const freeHeap = getFreeHeap();
         uint32_t const flashDictUsedSpace = FlashDictionary::getUsedSpace();
+        uint32_t const flashDictTotSpace  = FlashDictionary::getTotalSpace();
         uint32_t const fileSystemFree = FlashFileSystem::getFreeSpace();
         uint32_t const fileSystemTot  = FlashFileSystem::getTotalSpace();
         m_serial->printf(FSTR("                     Size      Used    Avail   Use%\r\n"));
         m_serial->printf(FSTR("Heap             : %7d  %7d  %7d  %3d%%\r\n"), totHeap, totHeap - freeHeap, freeHeap, (totHeap - freeHeap) * 100 / totHeap);
-        m_serial->printf(FSTR("Flash Settings   : %7d  %7d  %7d  %3d%%\r\n"), 4096, flashDictUsedSpace, 4096 - flashDictUsedSpace, flashDictUsedSpace * 100 / 4096);
+        m_serial->printf(FSTR("Flash Settings   : %7d  %7d  %7d  %3d%%\r\n"), flashDictTotSpace, flashDictUsedSpace, flashDictTotSpace - flashDictUsedSpace, flashDictUsedSpace * 100 / flashDictTotSpace);
         m_serial->printf(FSTR("File System      : %7d  %7d  %7d  %3d%%\r\n"), fileSystemTot, fileSystemTot - fileSystemFree, fileSystemFree, (fileSystemTot - fileSystemFree) * 100 / fileSystemTot);
+#if (FDV_INCLUDE_MEMPOOL == 1) && (FDV_MEMPOOL_HEAPSIZE > 0)
+        MemPool* memPool = Memory::getMemPool();
+        if (memPool)
+        {
+            // snapshot taken like Memory::malloc() does, all values come from it
+            MemPool::SIZE_T largestFreeBlock, totalFreeSize;
+            {
+                Critical critical;
+                memPool->getStats(&largestFreeBlock, &totalFreeSize);
+            }
+            uint32_t const poolSize = memPool->getSize();
+            m_serial->printf(FSTR("MemPool          : %7d  %7d  %7d  %3d%%  (largest free %d, fragmentation %d%%)\r\n"), poolSize, poolSize - totalFreeSize, totalFreeSize, 
+                             (poolSize - totalFreeSize) * 100 / poolSize, largestFreeBlock, MemPool::getFragmentation(largestFreeBlock, totalFreeSize));
+        }
+#endif
         m_serial->printf(FSTR("Flash            : %7d\r\n"), getFlashSize());
         m_serial->printf(FSTR("Flash (detected) : %7d\r\n"), getActualFlashSize());        
+        m_serial->printf(FSTR("\r\nSlab class  Blocks   InUse    Peak   Fails     Cap\r\n"));
+        for (uint32_t i = 0; i != Slab::CLASSESCOUNT; ++i)
+        {
+            Slab::Stats stats;
+            Slab::getStats(i, &stats);
+            m_serial->printf(FSTR("%10d  %6d  %6d  %6d  %6d  %6d\r\n"), stats.blockSize, stats.blocks, stats.inUse, stats.peak, stats.failures, stats.cap);
+        }
     }
 
 
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+    // sites are displayed in table order. Site "others" collects sites not fitting the table
+    void MTD_FLASHMEM SerialConsole::cmd_heap()
+    {
+        HeapTrace::Stats stats;
+        HeapTrace::getStats(&stats);
+        m_serial->printf(FSTR("Live: %d bytes  High water: %d bytes  Allocations: %d  Sites: %d\r\n"), stats.liveBytes, stats.highWater, stats.allocations, stats.sitesCount);
+        m_serial->printf(FSTR("Call site      Live   Count    Peak    Allocs\r\n"));
+        for (uint32_t i = 0; i != HeapTrace::MAXSITES; ++i)
+        {
+            HeapTrace::Site site;
+            if (HeapTrace::getSite(i, &site))
+            {
+                if (site.address)
+                    m_serial->printf(FSTR("0x%08X "), (uint32_t)site.address);
+                else
+                    m_serial->printf(FSTR("others     "));
+                m_serial->printf(FSTR("%7d  %6d  %6d  %8d\r\n"), site.liveBytes, site.liveCount, site.peakBytes, site.allocations);
+            }
+        }
+    }
+#endif
+
+
     void MTD_FLASHMEM SerialConsole::cmd_ifconfig()
     {
         if (m_paramsCount == 5 && hasParameter(1, FSTR("static")))
@@ -483,7 +546,7 @@ namespace fdv
         m_serial->printf(FSTR("Cells found:\r\n"));
         uint32_t count = 0;
         bool scan = (m_paramsCount == 2 && hasParameter(1, FSTR("scan")));
-        WiFi::APInfo* infos = WiFi::getAPList(&count, scan);
+        APtr<WiFi::APInfo> infos(WiFi::getAPList(&count, scan));
         for (uint32_t i = 0; i != count; ++i)
         {
             m_serial->printf(FSTR("  %2d - Address: %02X:%02X:%02X:%02X:%02X:%02X\r\n"), i, infos[i].BSSID[0], infos[i].BSSID[1], infos[i].BSSID[2], infos[i].BSSID[3], infos[i].BSSID[4], infos[i].BSSID[5]);
@@ -500,6 +563,12 @@ namespace fdv
         char buf[30];
         DateTime::now().format(buf, FSTR("%c"));
         m_serial->writeln(buf);
+        bool synchronized;
+        int32_t drift;
+        uint32_t pollInterval, delay;
+        DateTime::getClockStatus(&synchronized, &drift, &pollInterval, &delay);
+        if (synchronized)
+            m_serial->printf(FSTR("NTP: drift %d ppb, poll interval %d secs, delay %d us\r\n"), drift, pollInterval, delay);
     }
 
 
@@ -548,34 +617,122 @@ namespace fdv
     
     void MTD_FLASHMEM SerialConsole::cmd_ping()
     {
-        if (m_paramsCount != 2)
+        static uint32_t const SWEEPROUNDS = 3;
+        
+        if (m_paramsCount < 2)
         {
             m_serial->writeln(FSTR("Error\r\n"));
             return;
         }
-        APtr<char> server( t_strdup(m_params[1]) );
-        IPAddress serverIP = NSLookup::lookup(server.get());
+        
         ICMP icmp;
-        while (true)
+        bool network = false;
+        for (uint32_t i = 1; i != m_paramsCount; ++i)
         {
-            float r = icmp.ping(serverIP) / 1000.0;
-            m_serial->printf(FSTR("%d bytes from %s: icmp_seq=%d ttl=%d time=%.3f ms\r\n"), icmp.receivedBytes(), (char const*)serverIP.get_str(), icmp.receivedSeq(), icmp.receivedTTL(), r);
-            
-            if (m_serial->available() > 0 && m_serial->read() == 27)
-                break;
-            
-            Task::delay(1000);
+            APtr<char> param( t_strdup(m_params[i]) );
+            char* bitsStr = (char*)f_strstr(param.get(), FSTR("/"));
+            if (bitsStr)
+            {
+                // all hosts of NETWORK/BITS (up to ICMP::MAXTARGETS)
+                network = true;
+                *bitsStr++ = 0;
+                uint32_t bits = strtol(bitsStr, NULL, 10);
+                uint32_t mask = (bits == 0? 0 : (bits >= 32? 0xFFFFFFFF : 0xFFFFFFFF << (32 - bits)));
+                uint32_t net  = ntohl(IPAddress(param.get()).get_in_addr_t()) & mask;
+                uint32_t last = bits >= 31? (net | ~mask) : (net | ~mask) - 1;
+                for (uint32_t host = (bits >= 31? net : net + 1); host <= last && host != 0; ++host)
+                    if (icmp.addTarget(IPAddress((in_addr_t)htonl(host))) < 0)
+                        break;
+            }
+            else
+                icmp.addTarget(NSLookup::lookup(param.get()));
+        }
+        
+        if (icmp.getTargetsCount() == 1)
+        {
+            // single host: repeat until ESC
+            ICMP::Stats const* stats = icmp.getStats(0);
+            IPAddress::IPAddressStr address = IPAddress(stats->address).get_str();
+            while (true)
+            {
+                int32_t r = icmp.ping(IPAddress(stats->address));
+                if (r < 0)
+                    m_serial->printf(FSTR("Request timeout for icmp_seq=%d\r\n"), stats->sent);
+                else
+                    m_serial->printf(FSTR("%d bytes from %s: icmp_seq=%d ttl=%d time=%.3f ms\r\n"), stats->lastBytes, (char const*)address, stats->sent, stats->lastTTL, r / 1000.0);
+                
+                if (m_serial->available() > 0 && m_serial->read() == 27)
+                    break;
+                
+                Task::delay(1000);
+            }
+        }
+        else
+        {
+            // many hosts: all requests of a round are outstanding together
+            for (uint32_t round = 0; round != SWEEPROUNDS; ++round)
+            {
+                if (round > 0)
+                    Task::delay(1000);
+                m_serial->printf(FSTR("round %d: %d/%d replies\r\n"), round + 1, icmp.sweep(), icmp.getTargetsCount());
+                if (m_serial->available() > 0 && m_serial->read() == 27)
+                    break;
+            }
+        }
+        
+        // statistics
+        for (uint32_t i = 0; i != icmp.getTargetsCount(); ++i)
+        {
+            ICMP::Stats const* stats = icmp.getStats(i);
+            if (stats->received > 0)
+                m_serial->printf(FSTR("%-15s  sent=%d received=%d loss=%d%%  min/avg/max=%.3f/%.3f/%.3f ms\r\n"), (char const*)IPAddress(stats->address).get_str(),
+                                 stats->sent, stats->received, stats->getLoss(), stats->minTime / 1000.0, stats->getAvgTime() / 1000.0, stats->maxTime / 1000.0);
+            else if (!network)   // a network sweep shows only the hosts which replied
+                m_serial->printf(FSTR("%-15s  sent=%d received=0 loss=100%%\r\n"), (char const*)IPAddress(stats->address).get_str(), stats->sent);
         }
     }
 
     
     void MTD_FLASHMEM SerialConsole::cmd_router()
     {
-        if (m_paramsCount == 2)
+        if (m_paramsCount == 2 && hasParameter(1, FSTR("reset")))
+        {
+            Router::resetCounters();
+        }
+        else if (m_paramsCount == 3 && hasParameter(1, FSTR("napt")))
+        {
+            ConfigurationManager::setNAPT(hasParameter(2, FSTR("on")));
+            ConfigurationManager::applyRouting();
+        }
+        else if (m_paramsCount == 2)
         {
             ConfigurationManager::setRouting(hasParameter(1, FSTR("on")));
             ConfigurationManager::applyRouting();
         }
+        else
+        {
+            // show info
+            m_serial->printf(FSTR("Routing %s\r\n"), Router::isEnabled()? FSTR("enabled") : FSTR("disabled"));
+            m_serial->printf(FSTR("NAPT %s, %d active connections\r\n"), NAPT::isEnabled()? FSTR("enabled") : FSTR("disabled"), NAPT::getActiveCount());
+            if (PacketCapture::isEnabled())
+                m_serial->printf(FSTR("Capturing, %d captured packets, %d dropped\r\n"), PacketCapture::getCapturedPackets(), PacketCapture::getDroppedPackets());
+            m_serial->printf(FSTR("Input           Forwarded (pkts/bytes)    Dropped (pkts/bytes)\r\n"));
+            for (uint32_t i = 0; i != 2; ++i)
+            {
+                Router::Counters counters;
+                Router::getCounters(i, &counters);
+                m_serial->printf(FSTR("%-14s  %10d %12d    %10d %12d\r\n"), i == 0? FSTR("Client") : FSTR("Access Point"),
+                                 counters.forwardedPackets, counters.forwardedBytes, counters.droppedPackets, counters.droppedBytes);
+            }
+            if (RateLimiter::isEnabled())
+            {
+                m_serial->printf(FSTR("Rate limited client  Dropped (pkts/bytes)\r\n"));
+                RateLimiter::ClientStats stats;
+                for (uint32_t i = 0; RateLimiter::getClientStats(i, &stats); ++i)
+                    if (stats.address != 0)
+                        m_serial->printf(FSTR("%-16s  %10d %12d\r\n"), (char const*)IPAddress((in_addr_t)stats.address).get_str(), stats.droppedPackets, stats.droppedBytes);
+            }
+        }
     }
 
             
@@ -665,29 +822,43 @@ namespace fdv
 
 
     MTD_FLASHMEM SerialBinary::Message::Message()
-        : valid(false), ID(0), command(0), dataSize(0), data(NULL)
+        : valid(false), ID(0), command(0), dataSize(0), data(NULL), buffer(NULL)
     {
     }
     
     
     MTD_FLASHMEM SerialBinary::Message::Message(uint8_t ID_, uint8_t command_, uint16_t dataSize_)
-        : valid(true), ID(ID_), command(command_), dataSize(dataSize_), data(dataSize_? new uint8_t[dataSize_] : NULL)
+        : valid(true), ID(ID_), command(command_), dataSize(dataSize_), data(NULL), buffer(NULL)
     {
+        allocData();
     }
     
     
     MTD_FLASHMEM SerialBinary::Message::Message(uint8_t ID_, uint8_t command_, uint8_t* data_, uint16_t dataSize_)
-        : valid(true), ID(ID_), command(command_), data(data_), dataSize(dataSize_)
+        : valid(true), ID(ID_), command(command_), dataSize(dataSize_), data(data_), buffer(NULL)
+    {
+    }
+    
+    
+    // allocates dataSize bytes
+    // Data is a SharedBuffer, so parts of it can be passed around as CharSlice and survive freeData()
+    void MTD_FLASHMEM SerialBinary::Message::allocData()
     {
+        if (dataSize > 0)
+        {
+            buffer = SharedBuffer::create(dataSize);
+            data   = (uint8_t*)buffer->getData();
+        }
     }
     
 
     void MTD_FLASHMEM SerialBinary::Message::freeData()
     {
-        if (data != NULL)
+        if (buffer != NULL)
         {
-            delete[] data;
-            data = NULL;
+            buffer->release();
+            buffer = NULL;
+            data   = NULL;
         }
     }
 			           
@@ -700,7 +871,6 @@ namespace fdv
         : m_serial(HardwareSerial::getSerial(0)), 
           m_recvID(255), 
           m_sendID(0), 
-          m_recvACKQueue(ACKMSG_QUEUE_LENGTH), 
           m_receiveTask(this, false, 256),
           m_isReady(false),
           m_platform(PLATFORM_BASELINE),
@@ -714,7 +884,13 @@ namespace fdv
     {
         m_receiveTask.terminate();
         delete m_HTTPRoutes;
-        // todo: free pending messages
+        // free pending ACKs
+        while (!m_recvACKQueue.isEmpty())
+        {
+            Message* ack = m_recvACKQueue.pop();
+            ack->freeData();
+            delete ack;
+        }
     }
 
 
@@ -792,7 +968,7 @@ namespace fdv
             // Data			
             if (msg.dataSize > 0 && msg.dataSize < (Task::getFreeHeap() >> 1))
             {
-                msg.data = new uint8_t[msg.dataSize];
+                msg.allocData();
                 if (m_serial->read(msg.data, msg.dataSize, INTRA_MSG_TIMEOUT) < msg.dataSize)
                 {
                     msg.freeData();
@@ -848,13 +1024,23 @@ namespace fdv
         SoftTimeOut timeout(GETACK_TIMEOUT);
         while (!timeout)
         {
-            if (m_recvACKQueue.receive(&msg, GETACK_TIMEOUT))
+            Message* ack;
             {
-                uint8_t msgAckID = msg.data[0];
-                if (msgAckID == ackID)
-                    return msg;
-                msg.freeData();	// discard this ACK
+                Critical critical;
+                ack = m_recvACKQueue.pop();
             }
+            if (ack == NULL)
+            {
+                // wait for receiveTask()
+                m_recvACKEvent.lock(GETACK_TIMEOUT);
+                continue;
+            }
+            msg = *ack;
+            delete ack;
+            uint8_t msgAckID = msg.data[0];
+            if (msgAckID == ackID)
+                return msg;
+            msg.freeData();	// discard this ACK
         }
         msg.valid = false;
         return msg;
@@ -882,7 +1068,7 @@ namespace fdv
             {
                 if (msg.command == CMD_ACK)
                     // if message is an ACK then put it into the ACK message queue, another task will handle it
-                    m_recvACKQueue.send(msg, PUTACK_TIMEOUT);
+                    pushACK(msg);
                 else
                     processMessage(&msg);
             }
@@ -890,6 +1076,27 @@ namespace fdv
     }
     
     
+    // discards the oldest ACK when the queue is full
+    // allocations and frees stay outside of the critical section
+    void MTD_FLASHMEM SerialBinary::pushACK(Message const& msg)
+    {
+        Message* ack = new Message(msg);
+        Message* discarded = NULL;
+        {
+            Critical critical;
+            if (m_recvACKQueue.size() == ACKMSG_QUEUE_LENGTH)
+                discarded = m_recvACKQueue.pop();
+            m_recvACKQueue.push(ack);
+        }
+        m_recvACKEvent.unlock();
+        if (discarded)
+        {
+            discarded->freeData();
+            delete discarded;
+        }
+    }
+    
+    
     // must not process CMD_ACK messages
     void MTD_FLASHMEM SerialBinary::processMessage(SerialBinary::Message* msg)
     {
@@ -910,6 +1117,9 @@ namespace fdv
             case CMD_IOASET:
                 handle_CMD_IOASET(msg);
                 break;
+            case CMD_IOAGET:
+                handle_CMD_IOAGET(msg);
+                break;
             case CMD_STREAMSTART:
                 handle_CMD_STREAMSTART(msg);
                 break;
@@ -949,13 +1159,7 @@ namespace fdv
     void MTD_FLASHMEM SerialBinary::handle_CMD_IOCONF(Message* msg)
     {
         // process message
-        uint8_t pin   = msg->data[0];
-        uint8_t flags = msg->data[1];
-        if (flags & PIN_CONF_OUTPUT)
-            GPIOX(pin).modeOutput();
-        else
-            GPIOX(pin).modeInput();
-        GPIOX(pin).enablePullUp(flags & PIN_CONF_PULLUP);
+        execIOCommand(msg->command, msg->data, NULL);
                     
         // send simple ACK
         sendNoParamsACK(msg->ID);
@@ -965,9 +1169,7 @@ namespace fdv
     void MTD_FLASHMEM SerialBinary::handle_CMD_IOSET(Message* msg)
     {
         // process message
-        uint8_t pin   = msg->data[0];
-        uint8_t state = msg->data[1];
-        GPIOX(pin).write(state);
+        execIOCommand(msg->command, msg->data, NULL);
         
         // send simple ACK
         sendNoParamsACK(msg->ID);
@@ -977,11 +1179,10 @@ namespace fdv
     void MTD_FLASHMEM SerialBinary::handle_CMD_IOGET(Message* msg)
     {
         // process message
-        uint8_t pin = msg->data[0];
-        bool state = GPIOX(pin).read();
+        uint8_t data[2] = {msg->ID};
+        execIOCommand(msg->command, msg->data, data + 1);
         
         // send ACK with parameters
-        uint8_t data[2] = {msg->ID, state};
         send(Message(getNextID(), CMD_ACK, data, sizeof(data)));
     }
     
@@ -997,6 +1198,84 @@ namespace fdv
     }
     
     
+    void MTD_FLASHMEM SerialBinary::handle_CMD_IOAGET(Message* msg)
+    {
+        // process message
+        uint8_t data[3] = {msg->ID};
+        execIOCommand(msg->command, msg->data, data + 1);
+        
+        // send ACK with parameters
+        send(Message(getNextID(), CMD_ACK, data, sizeof(data)));
+    }
+    
+    
+    // returns CMD parameters size of CMD_IOCONF, CMD_IOSET, CMD_IOGET, CMD_IOASET, CMD_IOAGET. -1 for other commands
+    int32_t STC_FLASHMEM SerialBinary::getIOCommandParamsSize(uint8_t command)
+    {
+        switch (command)
+        {
+            case CMD_IOCONF:
+            case CMD_IOSET:
+                return 2;
+            case CMD_IOGET:
+            case CMD_IOAGET:
+                return 1;
+            case CMD_IOASET:
+                return 3;
+            default:
+                return -1;
+        }
+    }
+    
+    
+    // pins 0..16, excluding SPI flash pins (6..11) and UART0 pins (1, 3) when UART0 is used
+    bool STC_FLASHMEM SerialBinary::isIOPinValid(uint8_t pin)
+    {
+        if (pin > 16 || (pin >= 6 && pin <= 11))
+            return false;
+        if ((pin == 1 || pin == 3) && HardwareSerial::isInUse(0))
+            return false;
+        return true;
+    }
+    
+    
+    // params must contain getIOCommandParamsSize() bytes, ackParams must have space for 2 bytes
+    // returns ACK parameters size, -1 if the command is not supported (CMD_IOASET) or the pin is not usable
+    int32_t STC_FLASHMEM SerialBinary::execIOCommand(uint8_t command, uint8_t const* params, uint8_t* ackParams)
+    {
+        uint8_t pin = params[0];
+        if (command != CMD_IOAGET && !isIOPinValid(pin))
+            return -1;
+        switch (command)
+        {
+            case CMD_IOCONF:
+                if (params[1] & PIN_CONF_OUTPUT)
+                    GPIOX(pin).modeOutput();
+                else
+                    GPIOX(pin).modeInput();
+                GPIOX(pin).enablePullUp(params[1] & PIN_CONF_PULLUP);
+                return 0;
+            case CMD_IOSET:
+                GPIOX(pin).write(params[1]);
+                return 0;
+            case CMD_IOGET:
+                ackParams[0] = GPIOX(pin).read();
+                return 1;
+            case CMD_IOAGET:
+            {
+                // there is only one analog input (TOUT), pin is ignored
+                uint16_t state = system_adc_read();
+                ackParams[0] = state & 0xFF;
+                ackParams[1] = state >> 8;
+                return 2;
+            }
+            default:
+                // CMD_IOASET not implemented
+                return -1;
+        }
+    }
+    
+    
     bool MTD_FLASHMEM SerialBinary::send_CMD_READY()
     {
         m_isReady = false;
@@ -1315,7 +1594,7 @@ namespace fdv
                             // Content length and content data
                             uint16_t contentLen = *rpos + (*(rpos + 1) << 8);
                             rpos += 2;
-                            response.addContent(rpos, contentLen);
+                            response.addContent(CharSlice(msg.buffer, (char const*)rpos, contentLen));
                             
                             // flush headers and content
                             response.flush();
@@ -1372,7 +1651,7 @@ namespace fdv
                                     int16_t r = m_serial->read(INTRA_MSG_TIMEOUT);
                                     if (r <= 0) // -1 or 0x00 interrupt
                                         break;
-                                    chunks.append((char)r, 32); // todo: increase?
+                                    chunks.append((char)r);
                                 }
                                 m_receiveTask.resume();
                                 response.addContent(&chunks);
@@ -1395,6 +1674,129 @@ namespace fdv
 
 
 
+#endif
+
+
+
+
+#if (FDV_INCLUDE_UDPBINARY == 1)
+
+
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	// UDPBinary
+
+    MTD_FLASHMEM UDPBinary::UDPBinary(uint16_t port)
+        : m_receiveTask(this, true, 300)
+    {
+        memset(m_clients, 0, sizeof(m_clients));
+        
+        m_socket = lwip_socket(AF_INET, SOCK_DGRAM, 0);
+        if (m_socket < 0)
+            return;     // receive task is not started
+        sockaddr_in localAddress     = {0};
+        localAddress.sin_family      = AF_INET;
+        localAddress.sin_len         = sizeof(sockaddr_in);
+        localAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+        localAddress.sin_port        = htons(port);
+        if (lwip_bind(m_socket, (sockaddr*)&localAddress, sizeof(sockaddr_in)) < 0)
+        {
+            lwip_close(m_socket);
+            m_socket = -1;
+            return;
+        }
+        
+        m_receiveTask.resume();
+    }
+    
+    
+    MTD_FLASHMEM UDPBinary::~UDPBinary()
+    {
+        m_receiveTask.terminate();
+        if (m_socket >= 0)
+            lwip_close(m_socket);
+    }
+    
+    
+    void MTD_FLASHMEM UDPBinary::receiveTask()
+    {
+        uint8_t request[MAXDATAGRAMSIZE];
+        while (true)
+        {
+            sockaddr_in from;
+            socklen_t fromLen = sizeof(sockaddr_in);
+            int32_t size = lwip_recvfrom(m_socket, request, MAXDATAGRAMSIZE, 0, (sockaddr*)&from, &fromLen);
+            if (size < 3 || request[0] != PROTOCOL_VERSION)
+                continue;
+            
+            uint16_t seq = request[1] | (request[2] << 8);
+            Client* client = getClient(from.sin_addr.s_addr, from.sin_port);
+            if (client->replySize == 0 || client->seq != seq)
+            {
+                client->seq       = seq;
+                client->replySize = processRequest(request, size, client->reply);
+            }
+            // otherwise this is a retry: send again the last reply
+            client->lastUsed = millis();
+            
+            lwip_sendto(m_socket, client->reply, client->replySize, 0, (sockaddr*)&from, sizeof(sockaddr_in));
+        }
+    }
+    
+    
+    // finds or recycles (least recently used) a client
+    UDPBinary::Client* MTD_FLASHMEM UDPBinary::getClient(uint32_t address, uint16_t port)
+    {
+        uint32_t now = millis();
+        Client* lru = &m_clients[0];
+        for (uint32_t i = 0; i != MAXCLIENTS; ++i)
+        {
+            Client* client = &m_clients[i];
+            if (client->address == address && client->port == port)
+                return client;
+            if (client->address == 0 || (lru->address != 0 && millisDiff(client->lastUsed, now) > millisDiff(lru->lastUsed, now)))
+                lru = client;
+        }
+        lru->address   = address;
+        lru->port      = port;
+        lru->replySize = 0;
+        return lru;
+    }
+    
+    
+    // returns reply size
+    uint32_t MTD_FLASHMEM UDPBinary::processRequest(uint8_t const* request, uint32_t requestSize, uint8_t* reply)
+    {
+        // protocol version and sequence number
+        memcpy(reply, request, 3);
+        uint32_t replySize = 3;
+        
+        for (uint32_t pos = 3; pos < requestSize; )
+        {
+            uint8_t command = request[pos++];
+            int32_t paramsSize = SerialBinary::getIOCommandParamsSize(command);
+            if (paramsSize < 0 || pos + paramsSize > requestSize)
+            {
+                reply[replySize++] = STATUS_ERROR;
+                break;
+            }
+            uint8_t* status = &reply[replySize++];
+            int32_t ackParamsSize = SerialBinary::execIOCommand(command, request + pos, reply + replySize);
+            if (ackParamsSize < 0)
+            {
+                *status = STATUS_ERROR;     // not supported or invalid pin
+                break;
+            }
+            *status = STATUS_OK;
+            replySize += ackParamsSize;
+            pos += paramsSize;
+        }
+        return replySize;
+    }
+    
+    
+
+
 #endif
 
 
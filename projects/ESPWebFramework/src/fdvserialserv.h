@@ -77,6 +77,9 @@ namespace fdv
 		void cmd_reboot();		
 		void cmd_restore();		
 		void cmd_free();		
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+        void cmd_heap();
+#endif
         void cmd_ifconfig();
         void cmd_iwconfig();
 		void cmd_iwlist();
@@ -281,9 +284,8 @@ namespace fdv
 	
 		static uint32_t const INTRA_MSG_TIMEOUT    = 200;
 		static uint32_t const WAIT_MSG_TIMEOUT     = 2000;
-		static uint32_t const PUTACK_TIMEOUT       = 200;
 		static uint32_t const GETACK_TIMEOUT       = 2000;
-		static uint32_t const ACKMSG_QUEUE_LENGTH  = 2;
+		static uint32_t const ACKMSG_QUEUE_LENGTH  = 2;		// older ACKs are discarded when more are received
 		static uint32_t const MAX_RESEND_COUNT     = 3;
 		
 		// commands
@@ -369,17 +371,20 @@ namespace fdv
 		static uint8_t const PIN_IDENTIFIER_ATMEGA328_PD7  = 7;  // Arduino 7
                 
 		
-		struct Message
+		// "next" links received ACK messages waiting to be handled
+		struct Message : IntrusiveSNode<Message>
 		{
 			bool     valid;
 			uint8_t  ID;
 			uint8_t  command;
 			uint16_t dataSize;
 			uint8_t* data;
+			SharedBuffer* buffer;	// holds "data" when allocated by Message, NULL when "data" is external
 			
 			Message();
 			Message(uint8_t ID_, uint8_t command_, uint16_t dataSize_);
             Message(uint8_t ID_, uint8_t command_, uint8_t* data_, uint16_t dataSize_);
+			void MTD_FLASHMEM allocData();
 			void MTD_FLASHMEM freeData(); // warn: memory must be explicitly deleted using freeData(). Don't create a destructor to free data!
 		};	
 
@@ -404,6 +409,16 @@ namespace fdv
 		bool send_CMD_IOAGET(uint8_t pin, uint16_t* state);
         bool send_CMD_GETHTTPHANDLEDPAGES();
         bool send_CMD_HTTPREQUEST(uint8_t pageIndex, HTTPHandler* handler);
+        
+        // I/O commands execution on this device
+        // returns CMD parameters size of CMD_IOCONF, CMD_IOSET, CMD_IOGET, CMD_IOASET, CMD_IOAGET. -1 for other commands
+        static int32_t getIOCommandParamsSize(uint8_t command);
+        // params must contain getIOCommandParamsSize() bytes, ackParams must have space for 2 bytes
+        // returns ACK parameters size, -1 if the command is not supported (CMD_IOASET) or the pin is not usable
+        static int32_t execIOCommand(uint8_t command, uint8_t const* params, uint8_t* ackParams);
+        
+        // pins 0..16, excluding SPI flash pins (6..11) and UART0 pins (1, 3) when UART0 is used
+        static bool isIOPinValid(uint8_t pin);
 		
 	private:
 						
@@ -414,6 +429,7 @@ namespace fdv
 		Message waitACK(uint8_t ackID);		
 		bool waitNoParamsACK(uint8_t ackID);
 		void receiveTask();						
+		void pushACK(Message const& msg);
 		void processMessage(Message* msg);		
 		
 		void handle_CMD_READY(Message* msg);		
@@ -429,7 +445,8 @@ namespace fdv
 		Serial*                                              m_serial;
 		uint8_t                                              m_recvID;		
 		uint8_t                                              m_sendID;
-		Queue<Message>                                       m_recvACKQueue;
+		IntrusiveFIFO<Message>                               m_recvACKQueue;     // protected by Critical
+		Mutex                                                m_recvACKEvent;     // unlocked when an ACK is pushed
 		MethodTask<SerialBinary, &SerialBinary::receiveTask> m_receiveTask;
 		Mutex                                                m_mutex;    // low level mutex
         Mutex                                                m_himutex;  // high level mutex
@@ -439,6 +456,84 @@ namespace fdv
 	};
 
 #endif // FDV_INCLUDE_SERIALBINARY
+
+
+
+#if (FDV_INCLUDE_UDPBINARY == 1)
+
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////
+	// UDPBinary
+	//
+	// Executes SerialBinary I/O commands (CMD_IOCONF, CMD_IOSET, CMD_IOGET, CMD_IOASET, CMD_IOAGET) received
+	// by UDP, for low latency control of this device GPIOs.
+	// A request datagram contains a sequence number and one or more commands. A reply datagram with the same
+	// sequence number is sent back to the sender.
+	// When no reply arrives the client should resend the request with the same sequence number: commands
+	// are not executed again, just the last reply is resent. Last reply is kept for up to MAXCLIENTS clients.
+	// All values are little-endian.
+	//
+	// Request datagram:
+	//   1 uint8_t  : Protocol version
+	//   1 uint16_t : Sequence number
+	//   for n times [
+	//     1 uint8_t : Command (see SerialBinary commands)
+	//     ? uint8_t : CMD Parameters (see SerialBinary commands)
+	//   ]
+	//
+	// Reply datagram:
+	//   1 uint8_t  : Protocol version
+	//   1 uint16_t : Sequence number of the request
+	//   for n times [
+	//     1 uint8_t : Status (see STATUS_XXX values). Commands following an error are not executed.
+	//     ? uint8_t : ACK Parameters (see SerialBinary commands), only when status is STATUS_OK
+	//   ]
+	//
+	// Example: configures GPIO2 as output and sets it high (sequence number 1)
+	//   request: 01 01 00 02 02 01 03 02 01
+	//   reply  : 01 01 00 00 00
+
+	class UDPBinary
+	{
+
+		static uint8_t const  PROTOCOL_VERSION = 1;
+		static uint32_t const MAXDATAGRAMSIZE  = 128;
+		static uint32_t const MAXREPLYSIZE     = 3 + (MAXDATAGRAMSIZE - 2) / 2 * 3;  // a command has at least 1 parameter and up to 2 ACK parameters
+		static uint32_t const MAXCLIENTS       = 4;
+
+	public:
+
+		// reply status
+		static uint8_t const STATUS_OK    = 0;
+		static uint8_t const STATUS_ERROR = 1;    // unsupported command or missing parameters
+
+		UDPBinary(uint16_t port);
+		~UDPBinary();
+
+	private:
+
+		struct Client
+		{
+			uint32_t address;       // network order, 0 = unused
+			uint16_t port;          // network order
+			uint16_t seq;           // sequence number of last request
+			uint32_t lastUsed;      // millis
+			uint32_t replySize;     // 0 = no reply
+			uint8_t  reply[MAXREPLYSIZE];
+		};
+
+		void receiveTask();
+		Client* getClient(uint32_t address, uint16_t port);
+		uint32_t processRequest(uint8_t const* request, uint32_t requestSize, uint8_t* reply);
+
+	private:
+
+		int                                              m_socket;
+		MethodTask<UDPBinary, &UDPBinary::receiveTask>   m_receiveTask;
+		Client                                           m_clients[MAXCLIENTS];
+	};
+
+#endif // FDV_INCLUDE_UDPBINARY
 	
 }
 
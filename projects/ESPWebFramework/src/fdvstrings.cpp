@@ -31,13 +31,48 @@ namespace fdv
 {
 
 
+    ///////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////
+    // f_* primitives read Flash one aligned dword at the time, consuming all four bytes
+    // (getChar() and CharIterator read a whole dword for every byte)
+    
+    // reads a 32 bit aligned dword from RAM or Flash
+    static inline uint32_t FUNC_FLASHMEM readAlignedDWord(uint32_t const* ptr, bool flash)
+    {
+        return flash ? getFlashAlignedDWord(ptr) : *ptr;
+    }
+    
+    // true if one of the four bytes of "value" is zero
+    static inline bool FUNC_FLASHMEM hasZeroByte(uint32_t value)
+    {
+        return ((value - 0x01010101) & ~value & 0x80808080) != 0;
+    }
+    
+    // four copies of "value"
+    static inline uint32_t FUNC_FLASHMEM repeatByte(uint8_t value)
+    {
+        return value * 0x01010101;
+    }
+    
+
     ///////////////////////////////////////////////////////////////////////////////////////
     ///////////////////////////////////////////////////////////////////////////////////////
     // f_strlen
     // str can be stored in Flash or/and in RAM
     uint32_t FUNC_FLASHMEM f_strlen(char const* str)
     {
-        return t_strlen(CharIterator(str));
+        bool flash = isStoredInFlash(str);
+        uint32_t offset = (uint32_t)str & 0x3;
+        uint32_t const* wptr = (uint32_t const*)((uint32_t)str & 0xFFFFFFFC);
+        // bytes before str are forced to non-zero
+        uint32_t word = readAlignedDWord(wptr, flash) | ((1U << (offset * 8)) - 1);
+        while (!hasZeroByte(word))
+            word = readAlignedDWord(++wptr, flash);
+        uint8_t const* pc = (uint8_t const*)wptr;
+        for (uint32_t i = 0; i != 4; ++i, word >>= 8)
+            if ((word & 0xFF) == 0 && pc + i >= (uint8_t const*)str)
+                return pc + i - (uint8_t const*)str;
+        return 0;   // never reached
     }
 
         
@@ -47,7 +82,10 @@ namespace fdv
     // str can be stored in Flash or/and in RAM
     uint32_t FUNC_FLASHMEM f_strnlen(char const* str, uint32_t maxlen)
     {
-        return t_strnlen(CharIterator(str), maxlen);
+        FlashReader reader(str);
+        uint32_t len = 0;
+        for (; len != maxlen && reader.read(); ++len);
+        return len;
     }
 
 
@@ -57,7 +95,8 @@ namespace fdv
     // source can be stored in Flash or/and in RAM
     char* FUNC_FLASHMEM f_strcpy(char* destination, char const* source)
     {
-        return t_strcpy(destination, CharIterator(source));
+        f_memcpy(destination, source, f_strlen(source) + 1);
+        return destination;
     }
 
 
@@ -68,13 +107,18 @@ namespace fdv
     // str can be stored in Flash or/and in RAM
     char* FUNC_FLASHMEM f_strdup(char const* str)
     {
-        return t_strdup(CharIterator(str));
+        uint32_t len = f_strlen(str) + 1;
+        return (char*)f_memcpy(new char[len], str, len);
     }
 
     // adds automatically ending zero
     char* FUNC_FLASHMEM f_strdup(char const* sourceStart, char const* sourceEnd)
     {
-        return t_strdup(CharIterator(sourceStart), CharIterator(sourceEnd));
+        uint32_t len = sourceEnd - sourceStart;
+        char* result = new char[len + 1];
+        f_memcpy(result, sourceStart, len);
+        result[len] = 0;
+        return result;
     }
 
 
@@ -85,7 +129,7 @@ namespace fdv
     // str can be stored in Flash or/and in RAM
     void* FUNC_FLASHMEM f_memdup(void const* buffer, uint32_t length)
     {
-        return t_memdup(ByteIterator((uint8_t const*)buffer), length);
+        return f_memcpy(new uint8_t[length], buffer, length);
     }
             
 
@@ -95,7 +139,15 @@ namespace fdv
     // both s1 and s2 can be stored in Flash or/and in RAM
     int32_t FUNC_FLASHMEM f_strcmp(char const* s1, char const* s2)
     {
-        return t_strcmp(CharIterator(s1), CharIterator(s2));
+        FlashReader r1(s1);
+        FlashReader r2(s2);
+        uint8_t c1, c2;
+        do
+        {
+            c1 = r1.read();
+            c2 = r2.read();
+        } while (c1 && c1 == c2);
+        return c1 - c2;
     }
 
 
@@ -105,7 +157,18 @@ namespace fdv
     // both s1 and s2 can be stored in Flash or/and in RAM
     int32_t FUNC_FLASHMEM f_memcmp(void const* s1, void const* s2, uint32_t length)
     {
-        return t_memcmp(ByteIterator((uint8_t const*)s1), ByteIterator((uint8_t const*)s2), length);
+        if (!isStoredInFlash(s1) && !isStoredInFlash(s2))
+            return memcmp(s1, s2, length);
+        FlashReader r1(s1);
+        FlashReader r2(s2);
+        while (length--)
+        {
+            uint8_t c1 = r1.read();
+            uint8_t c2 = r2.read();
+            if (c1 != c2)
+                return c1 - c2;
+        }
+        return 0;
     }
 
 
@@ -113,9 +176,77 @@ namespace fdv
     ///////////////////////////////////////////////////////////////////////////////////////
     // f_memcpy
     // source can be stored in Flash or/and in RAM
+    // destination must be in RAM
     void* FUNC_FLASHMEM f_memcpy(void* destination, void const* source, uint32_t length)
     {
-        return t_memcpy(destination, ByteIterator((uint8_t const*)source), length);
+        if (!isStoredInFlash(source))
+            return memcpy(destination, source, length);
+        
+        uint8_t* dest = (uint8_t*)destination;
+        FlashReader reader(source);
+        
+        // unaligned head
+        for (; length > 0 && ((uint32_t)reader.get() & 0x3) != 0; --length)
+            *dest++ = reader.read();
+        
+        // aligned body, one dword at the time
+        uint32_t const* wptr = (uint32_t const*)reader.get();
+        bool destAligned = ((uint32_t)dest & 0x3) == 0;
+        for (; length >= 4; length -= 4)
+        {
+            uint32_t word = getFlashAlignedDWord(wptr++);
+            if (destAligned)
+            {
+                *(uint32_t*)dest = word;
+            }
+            else
+            {
+                dest[0] = word;
+                dest[1] = word >> 8;
+                dest[2] = word >> 16;
+                dest[3] = word >> 24;
+            }
+            dest += 4;
+        }
+        
+        // tail
+        FlashReader tailReader(wptr);
+        while (length--)
+            *dest++ = tailReader.read();
+        
+        return destination;
+    }
+
+
+    ///////////////////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////////////////
+    // f_memchr
+    // buffer can be stored in Flash or/and in RAM
+    // returns NULL if value has not been found
+    void const* FUNC_FLASHMEM f_memchr(void const* buffer, uint8_t value, uint32_t length)
+    {
+        uint8_t const* pc = (uint8_t const*)buffer;
+        uint8_t const* end = pc + length;
+        bool flash = isStoredInFlash(buffer);
+        uint32_t pattern = repeatByte(value);
+        while (pc != end)
+        {
+            uint32_t const* wptr = (uint32_t const*)((uint32_t)pc & 0xFFFFFFFC);
+            uint32_t word = readAlignedDWord(wptr, flash);
+            uint8_t const* wend = (uint8_t const*)(wptr + 1);
+            if (wend > end)
+                wend = end;
+            // skip whole dwords which don't contain value
+            if (pc == (uint8_t const*)wptr && wend == (uint8_t const*)(wptr + 1) && !hasZeroByte(word ^ pattern))
+            {
+                pc = wend;
+                continue;
+            }
+            for (; pc != wend; ++pc)
+                if ((uint8_t)(word >> (((uint32_t)pc & 0x3) * 8)) == value)
+                    return pc;
+        }
+        return NULL;
     }
 
 
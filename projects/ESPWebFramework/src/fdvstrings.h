@@ -136,6 +136,20 @@ bool TMTD_FLASHMEM t_compare(IteratorS1 s1, IteratorS2 s2, IteratorS2 s2End)
 }
 
 
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// t_hash
+// FNV-1a hash. Equal strings have the same hash whatever iterator is used.
+template <typename Iterator>
+uint32_t TMTD_FLASHMEM t_hash(Iterator s, Iterator sEnd)
+{
+	uint32_t hash = 2166136261U;
+	for (; s != sEnd; ++s)
+		hash = (hash ^ (uint8_t)*s) * 16777619U;
+	return hash;
+}
+
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // t_memcmp
@@ -286,6 +300,7 @@ void* f_memdup(void const* buffer, uint32_t length);
 int32_t f_strcmp(char const* s1, char const* s2);
 int32_t f_memcmp(void const* s1, void const* s2, uint32_t length);
 void* f_memcpy(void* destination, void const* source, uint32_t length);
+void const* f_memchr(void const* buffer, uint8_t value, uint32_t length);
 char const* f_strstr(char const* str, char const* substr);
 char const* f_strstr(char const* str, char const* strEnd, char const* substr);
 bool isspace(char c);
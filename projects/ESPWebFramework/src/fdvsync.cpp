@@ -48,6 +48,16 @@ namespace fdv
 	{
 		taskEXIT_CRITICAL();
 	}
+	
+	
+	// true inside critical sections and ISRs (interrupts masked)
+	// checks PS.INTLEVEL (bits 0..3) and PS.EXCM (bit 4)
+	bool ICACHE_FLASH_ATTR interruptsMasked()
+	{
+		uint32_t ps;
+		__asm__ __volatile__("rsr %0, ps" : "=a"(ps));
+		return (ps & 0x1F) != 0;
+	}
     
 	
 	uint32_t FUNC_FLASHMEM millisISR()
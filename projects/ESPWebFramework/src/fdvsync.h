@@ -47,6 +47,9 @@ namespace fdv
 
 	void enterCritical();
 	void exitCritical();
+	
+	// true inside critical sections and ISRs (interrupts masked)
+	bool interruptsMasked();
 
     
 
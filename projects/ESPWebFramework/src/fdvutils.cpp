@@ -44,16 +44,412 @@ namespace fdv
 {
     
     
-	void* STC_FLASHMEM Memory::malloc(uint32_t size)
+#if (FDV_INCLUDE_MEMPOOL == 1) && (FDV_MEMPOOL_HEAPSIZE > 0)
+
+    static MemPool* s_memPool = NULL;
+    
+    
+    // creates the pool (at first call) taking FDV_MEMPOOL_HEAPSIZE bytes from the SDK heap
+    MemPool* STC_FLASHMEM Memory::getMemPool()
+    {
+        if (s_memPool == NULL)
+        {
+            void* buffer = pvPortMalloc(sizeof(MemPool) + FDV_MEMPOOL_HEAPSIZE);
+            if (buffer == NULL)
+                return NULL;
+            bool created = false;
+            {
+                Critical critical;
+                if (s_memPool == NULL)
+                {
+                    s_memPool = new(buffer) MemPool((uint8_t*)buffer + sizeof(MemPool), FDV_MEMPOOL_HEAPSIZE);
+                    created = true;
+                }
+            }
+            if (!created)
+                vPortFree(buffer);  // created by another task meanwhile
+        }
+        return s_memPool;
+    }
+    
+#endif
+
+
+    // when FDV_MEMPOOL_HEAPSIZE > 0 memory is allocated from the MemPool, then from the SDK heap when the pool is full
+	static void* FUNC_FLASHMEM rawMalloc(uint32_t size)
 	{
+#if (FDV_INCLUDE_MEMPOOL == 1) && (FDV_MEMPOOL_HEAPSIZE > 0)
+        MemPool* memPool = Memory::getMemPool();
+        if (memPool)
+        {
+            Critical critical;
+            void* ptr = memPool->malloc(size);
+            if (ptr)
+                return ptr;
+        }
+#endif
 		return pvPortMalloc(size);
 	}
 
     
-	void STC_FLASHMEM Memory::free(void* ptr)
+	static void FUNC_FLASHMEM rawFree(void* ptr)
 	{        
+#if (FDV_INCLUDE_MEMPOOL == 1) && (FDV_MEMPOOL_HEAPSIZE > 0)
+        if (s_memPool && s_memPool->contains(ptr))
+        {
+            Critical critical;
+            s_memPool->free(ptr);
+            return;
+        }
+#endif
         vPortFree(ptr);
 	}
+    
+    
+	void* STC_FLASHMEM Memory::malloc(uint32_t size)
+	{
+		return malloc(size, __builtin_return_address(0));
+	}
+	
+	
+	// callSite is used only when FDV_INCLUDE_HEAPTRACE is enabled
+	// when enabled each block is prefixed by a tag: bits 24..31 = HeapTrace slot, bits 0..23 = requested size
+	void* STC_FLASHMEM Memory::malloc(uint32_t size, void const* callSite)
+	{
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+        uint32_t* tag = (uint32_t*)rawMalloc(sizeof(uint32_t) + size);
+        if (tag == NULL)
+            return NULL;
+        *tag = (HeapTrace::add(callSite, size) << 24) | size;
+        return tag + 1;
+#else
+		return rawMalloc(size);
+#endif
+	}
+
+    
+	void STC_FLASHMEM Memory::free(void* ptr)
+	{        
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+        if (ptr == NULL)
+            return;
+        uint32_t* tag = (uint32_t*)ptr - 1;
+        HeapTrace::remove(*tag >> 24, *tag & 0xFFFFFF);
+        rawFree(tag);
+#else
+        rawFree(ptr);
+#endif
+	}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// HeapTrace
+
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+
+    // global constructors are not called: these are zero initialized PODs
+    static HeapTrace::Site  s_heapTraceSites[HeapTrace::MAXSITES];
+    static HeapTrace::Stats s_heapTraceStats;
+    
+    
+    // returns the slot of callSite. Last slot collects sites not fitting the table
+    uint32_t STC_FLASHMEM HeapTrace::add(void const* callSite, uint32_t size)
+    {
+        Critical critical;
+        uint32_t const hashSlots = MAXSITES - 1;
+        uint32_t slot = ((uint32_t)callSite >> 2) % hashSlots;
+        uint32_t i = 0;
+        for (; i != hashSlots; ++i, slot = (slot + 1) % hashSlots)
+        {
+            if (s_heapTraceSites[slot].address == callSite)
+                break;
+            if (s_heapTraceSites[slot].address == NULL)
+            {
+                s_heapTraceSites[slot].address = callSite;
+                ++s_heapTraceStats.sitesCount;
+                break;
+            }
+        }
+        if (i == hashSlots)
+            slot = MAXSITES - 1;
+        
+        Site* site = &s_heapTraceSites[slot];
+        site->liveBytes += size;
+        ++site->liveCount;
+        ++site->allocations;
+        if (site->liveBytes > site->peakBytes)
+            site->peakBytes = site->liveBytes;
+        
+        s_heapTraceStats.liveBytes += size;
+        ++s_heapTraceStats.allocations;
+        if (s_heapTraceStats.liveBytes > s_heapTraceStats.highWater)
+            s_heapTraceStats.highWater = s_heapTraceStats.liveBytes;
+        return slot;
+    }
+    
+    
+    void STC_FLASHMEM HeapTrace::remove(uint32_t slot, uint32_t size)
+    {
+        Critical critical;
+        s_heapTraceSites[slot].liveBytes -= size;
+        --s_heapTraceSites[slot].liveCount;
+        s_heapTraceStats.liveBytes -= size;
+    }
+    
+    
+    void STC_FLASHMEM HeapTrace::getStats(Stats* stats)
+    {
+        Critical critical;
+        *stats = s_heapTraceStats;
+    }
+    
+    
+    // returns false if the slot is unused
+    bool STC_FLASHMEM HeapTrace::getSite(uint32_t slot, Site* site)
+    {
+        Critical critical;
+        *site = s_heapTraceSites[slot];
+        return site->allocations > 0;
+    }
+    
+#endif
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// Slab
+
+    namespace
+    {
+        struct SlabClass;
+        struct SlabPage;
+        
+        // precedes every block (free or in use) and every heap allocation of Slab::alloc()
+        struct SlabTag
+        {
+            SlabPage* page;     // NULL = allocated by the heap
+        };
+        
+        // a free block
+        struct SlabBlock
+        {
+            SlabBlock* next;
+        };
+        
+        // page header, followed by the blocks (each one preceded by its tag)
+        struct SlabPage
+        {
+            SlabClass* slabClass;
+            SlabPage*  next;        // in SlabClass::partialPages
+            SlabPage*  prev;
+            SlabBlock* freeList;
+            uint16_t   freeBlocks;
+            uint16_t   pageBlocks;
+        };
+        
+        struct SlabClass
+        {
+            uint32_t   blockSize;
+            uint32_t   cap;
+            SlabPage*  partialPages;    // pages with at least one free block and one block in use
+            SlabPage*  emptyPage;       // a completely free page kept to avoid page allocation thrashing
+            uint32_t   blocks;
+            uint32_t   inUse;
+            uint32_t   peak;
+            uint32_t   failures;
+        };
+        
+        // global constructors are not called: this must be a constant initialized POD
+        SlabClass s_slabClasses[Slab::CLASSESCOUNT] = { {16,  Slab::DEFAULTCAPSIZE / 16},
+                                                        {24,  Slab::DEFAULTCAPSIZE / 24},
+                                                        {32,  Slab::DEFAULTCAPSIZE / 32},
+                                                        {48,  Slab::DEFAULTCAPSIZE / 48},
+                                                        {64,  Slab::DEFAULTCAPSIZE / 64},
+                                                        {96,  Slab::DEFAULTCAPSIZE / 96},
+                                                        {128, Slab::DEFAULTCAPSIZE / 128},
+                                                        {Slab::MAXSIZE, Slab::DEFAULTCAPSIZE / Slab::MAXSIZE} };
+        
+        
+        SlabClass* FUNC_FLASHMEM getSlabClass(uint32_t size)
+        {
+            if (size <= Slab::MAXSIZE)
+                for (uint32_t i = 0; i != Slab::CLASSESCOUNT; ++i)
+                    if (size <= s_slabClasses[i].blockSize)
+                        return &s_slabClasses[i];
+            return NULL;
+        }
+        
+        
+        uint32_t FUNC_FLASHMEM getSlabPageBlocks(SlabClass* slabClass)
+        {
+            uint32_t blocks = 256 / slabClass->blockSize;
+            return blocks < 4? 4 : blocks;
+        }
+        
+        
+        // must be called inside a critical section
+        void FUNC_FLASHMEM linkSlabPage(SlabClass* slabClass, SlabPage* page)
+        {
+            page->prev = NULL;
+            page->next = slabClass->partialPages;
+            if (page->next)
+                page->next->prev = page;
+            slabClass->partialPages = page;
+        }
+        
+        
+        // must be called inside a critical section
+        void FUNC_FLASHMEM unlinkSlabPage(SlabClass* slabClass, SlabPage* page)
+        {
+            if (page->prev)
+                page->prev->next = page->next;
+            else
+                slabClass->partialPages = page->next;
+            if (page->next)
+                page->next->prev = page->prev;
+        }
+    }
+    
+    
+    void* STC_FLASHMEM Slab::alloc(uint32_t size)
+    {
+        void const* callSite = __builtin_return_address(0);  // heap allocations are accounted to the caller
+        SlabClass* slabClass = getSlabClass(size);
+        if (slabClass)
+        {
+            uint32_t pageBlocks = getSlabPageBlocks(slabClass);
+            uint32_t stride     = sizeof(SlabTag) + slabClass->blockSize;
+            while (true)
+            {
+                {
+                    Critical critical;
+                    SlabPage* page = slabClass->partialPages;
+                    if (page == NULL && slabClass->emptyPage)
+                    {
+                        // the empty page is used only when partial pages are full, so they are filled first
+                        page = slabClass->emptyPage;
+                        slabClass->emptyPage = NULL;
+                        linkSlabPage(slabClass, page);
+                    }
+                    if (page)
+                    {
+                        SlabBlock* block = page->freeList;
+                        page->freeList = block->next;
+                        if (--page->freeBlocks == 0)
+                            unlinkSlabPage(slabClass, page);
+                        if (++slabClass->inUse > slabClass->peak)
+                            slabClass->peak = slabClass->inUse;
+                        return block;
+                    }
+                    if (slabClass->cap > 0 && slabClass->blocks + pageBlocks > slabClass->cap)
+                    {
+                        ++slabClass->failures;
+                        break;
+                    }
+                }
+                
+                // no free blocks, add a page (memory is never allocated inside critical sections)
+                SlabPage* page = (SlabPage*)Memory::malloc(sizeof(SlabPage) + pageBlocks * stride, callSite);
+                Critical critical;
+                if (page == NULL)
+                {
+                    ++slabClass->failures;
+                    break;
+                }
+                page->slabClass  = slabClass;
+                page->freeList   = NULL;
+                page->freeBlocks = pageBlocks;
+                page->pageBlocks = pageBlocks;
+                uint8_t* p = (uint8_t*)(page + 1);
+                for (uint32_t i = 0; i != pageBlocks; ++i, p += stride)
+                {
+                    ((SlabTag*)p)->page = page;
+                    SlabBlock* block = (SlabBlock*)(p + sizeof(SlabTag));
+                    block->next = page->freeList;
+                    page->freeList = block;
+                }
+                slabClass->blocks += pageBlocks;
+                linkSlabPage(slabClass, page);
+            }
+            
+            // served by the heap, tagged as such
+            SlabTag* tag = (SlabTag*)Memory::malloc(sizeof(SlabTag) + size, callSite);
+            if (tag == NULL)
+                return NULL;
+            tag->page = NULL;
+            return tag + 1;
+        }
+        return Memory::malloc(size, callSite);
+    }
+    
+    
+    // the tag preceding the block tells its page (or the heap), without searching
+    // when a page becomes completely free it is returned to the heap, unless it is the only empty page of its class
+    void STC_FLASHMEM Slab::free(void* ptr, uint32_t size)
+    {
+        if (ptr == NULL)
+            return;
+        if (size > MAXSIZE)
+        {
+            Memory::free(ptr);
+            return;
+        }
+        SlabTag* tag = (SlabTag*)ptr - 1;
+        SlabPage* page = tag->page;
+        if (page == NULL)
+        {
+            Memory::free(tag);
+            return;
+        }
+        SlabBlock* block = (SlabBlock*)ptr;
+        SlabPage* releasedPage = NULL;
+        {
+            Critical critical;
+            SlabClass* slabClass = page->slabClass;
+            block->next = page->freeList;
+            page->freeList = block;
+            --slabClass->inUse;
+            if (page->freeBlocks++ == 0)
+                linkSlabPage(slabClass, page);     // was full
+            if (page->freeBlocks == page->pageBlocks)
+            {
+                unlinkSlabPage(slabClass, page);
+                if (slabClass->emptyPage == NULL)
+                    slabClass->emptyPage = page;
+                else
+                {
+                    slabClass->blocks -= page->pageBlocks;
+                    releasedPage = page;
+                }
+            }
+        }
+        // memory is never freed inside critical sections
+        if (releasedPage)
+            Memory::free(releasedPage);
+    }
+    
+    
+    // maxBlocks = 0 : no limit (default is DEFAULTCAPSIZE bytes)
+    void STC_FLASHMEM Slab::setCap(uint32_t classIndex, uint32_t maxBlocks)
+    {
+        s_slabClasses[classIndex].cap = maxBlocks;
+    }
+    
+    
+    void STC_FLASHMEM Slab::getStats(uint32_t classIndex, Stats* stats)
+    {
+        Critical critical;
+        SlabClass* slabClass = &s_slabClasses[classIndex];
+        stats->blockSize = slabClass->blockSize;
+        stats->blocks    = slabClass->blocks;
+        stats->inUse     = slabClass->inUse;
+        stats->peak      = slabClass->peak;
+        stats->failures  = slabClass->failures;
+        stats->cap       = slabClass->cap;
+    }
 
 }
 
@@ -62,7 +458,7 @@ namespace fdv
 
 void* FUNC_FLASHMEM operator new(size_t size)
 {
-    return fdv::Memory::malloc(size);
+    return fdv::Memory::malloc(size, __builtin_return_address(0));
 }
 
 void* FUNC_FLASHMEM operator new(size_t size, void* ptr)
@@ -72,7 +468,7 @@ void* FUNC_FLASHMEM operator new(size_t size, void* ptr)
 
 void* FUNC_FLASHMEM operator new[](size_t size) 
 {
-    return fdv::Memory::malloc(size);
+    return fdv::Memory::malloc(size, __builtin_return_address(0));
 }
 
 void FUNC_FLASHMEM operator delete(void* ptr) 
@@ -145,122 +541,222 @@ void FUNC_FLASHMEM reboot(uint32_t time)
 
 #if (FDV_INCLUDE_MEMPOOL == 1)
 
-// bufferLength should be a multiple of MemPoolBlock size
+// buffer should be aligned to 4 bytes
 MTD_FLASHMEM MemPool::MemPool(void* buffer, SIZE_T bufferLength)
-    : m_blocks((MemPoolBlock*)buffer)
+    : m_bufferStart((uint8_t*)buffer), m_bufferEnd((uint8_t*)buffer + bufferLength), m_flBitmap(0), m_freeSize(0)
 {
-    // make sure bufferLength is a multiple of sizeof(MemPoolBlock)
-    bufferLength -= bufferLength % sizeof(MemPoolBlock);
+    for (uint32_t fl = 0; fl != FLCOUNT; ++fl)
+    {
+        m_slBitmap[fl] = 0;
+        for (uint32_t sl = 0; sl != SLCOUNT; ++sl)
+            m_freeLists[fl][sl] = NULL;
+    }
     
-    // creates a unique free block having the same size of main buffer
-    m_blocks->next  = NULL;
-    m_blocks->alloc = 0;
-    m_blocks->size  = bufferLength - sizeof(MemPoolBlock);
+    // a unique free block followed by a zero sized allocated block, which stops merges at the end of buffer
+    bufferLength &= ~((1 << ALIGNLOG2) - 1);
+    Block* block = (Block*)buffer;
+    block->prevPhys = NULL;
+    block->size     = bufferLength - 2 * HEADERSIZE;
+    Block* sentinel = getNextPhys(block);
+    sentinel->prevPhys = block;
+    sentinel->size     = 0;
+    insertFreeBlock(block);
 }
 
 
-MemPool::MemPoolBlock* MTD_FLASHMEM MemPool::findFreeBlock(SIZE_T minsize)
+MemPool::SIZE_T MTD_FLASHMEM MemPool::getBlockSize(Block* block)
 {
-    for (MemPoolBlock* curblk = m_blocks; curblk; curblk = curblk->next)
-        if ((curblk->alloc == 0) && curblk->size >= minsize)
-            return curblk;
-    return NULL;
+    return block->size & ~FREEBIT;
 }
 
 
-MemPool::MemPoolBlock* MTD_FLASHMEM MemPool::findBlockFromPtr(void const* ptr)
+bool MTD_FLASHMEM MemPool::isFree(Block* block)
 {
-    for (MemPoolBlock* curblk = m_blocks; curblk; curblk = curblk->next)
-        if (ptr == curblk + 1)
-            return curblk;
-    return NULL;
+    return block->size & FREEBIT;
 }
 
 
-void* MTD_FLASHMEM MemPool::malloc(SIZE_T size)
+MemPool::Block* MTD_FLASHMEM MemPool::getNextPhys(Block* block)
 {
-    // make size a multiple of MemPoolBlock size
-    if (size % sizeof(MemPoolBlock) != 0)
-        size += sizeof(MemPoolBlock) - size % sizeof(MemPoolBlock);
-    
-    MemPoolBlock* freeblk = findFreeBlock(size);
-    if (freeblk)
+    return (Block*)((uint8_t*)block + HEADERSIZE + getBlockSize(block));
+}
+
+
+// list which contains blocks of "size"
+void MTD_FLASHMEM MemPool::mappingInsert(SIZE_T size, uint32_t* fl, uint32_t* sl)
+{
+    if (size < SMALLSIZE)
     {
-        // found a free block
-        uint8_t* ptr = (uint8_t*)(freeblk + 1); // ptr aligned to MemPoolBlock size (hence should be to CPU word size)
-        if (freeblk->size > size + sizeof(MemPoolBlock))    // is there space for another free block?
-        {
-            // split this block
-            MemPoolBlock* newblk = freeblk + 1 + size / sizeof(MemPoolBlock);
-            newblk->next  = freeblk->next;
-            newblk->alloc = 0;
-            newblk->size  = freeblk->size - size - sizeof(MemPoolBlock);
-            freeblk->next = newblk;
-            freeblk->size = size;
-        }
-        freeblk->alloc = 1;
-        
-        return ptr;
+        *fl = 0;
+        *sl = size / (SMALLSIZE / SLCOUNT);
     }
     else
+    {
+        uint32_t msb = 31 - __builtin_clz(size);
+        *sl = (size >> (msb - SLCOUNTLOG2)) ^ SLCOUNT;
+        *fl = msb - (FLSHIFT - 1);
+    }
+}
+
+
+// first list whose blocks are all large enough for "size"
+void MTD_FLASHMEM MemPool::mappingSearch(SIZE_T size, uint32_t* fl, uint32_t* sl)
+{
+    if (size >= SMALLSIZE)
+        size += (1 << (31 - __builtin_clz(size) - SLCOUNTLOG2)) - 1;
+    mappingInsert(size, fl, sl);
+}
+
+
+MemPool::Block* MTD_FLASHMEM MemPool::searchSuitableBlock(uint32_t* fl, uint32_t* sl)
+{
+    if (*fl >= FLCOUNT)
         return NULL;
+    uint32_t slMap = m_slBitmap[*fl] & (~0U << *sl);
+    if (slMap == 0)
+    {
+        // search next first level lists
+        uint32_t flMap = *fl + 1 < 32? m_flBitmap & (~0U << (*fl + 1)) : 0;
+        if (flMap == 0)
+            return NULL;
+        *fl = __builtin_ctz(flMap);
+        slMap = m_slBitmap[*fl];
+    }
+    *sl = __builtin_ctz(slMap);
+    return m_freeLists[*fl][*sl];
 }
 
 
-void MTD_FLASHMEM MemPool::free(void const* ptr)
+void MTD_FLASHMEM MemPool::insertFreeBlock(Block* block)
 {
-    if (ptr)
+    uint32_t fl, sl;
+    mappingInsert(getBlockSize(block), &fl, &sl);
+    block->size    |= FREEBIT;
+    block->prevFree = NULL;
+    block->nextFree = m_freeLists[fl][sl];
+    if (block->nextFree)
+        block->nextFree->prevFree = block;
+    m_freeLists[fl][sl] = block;
+    m_flBitmap     |= 1 << fl;
+    m_slBitmap[fl] |= 1 << sl;
+    m_freeSize     += getBlockSize(block);
+}
+
+
+void MTD_FLASHMEM MemPool::removeFreeBlock(Block* block)
+{
+    uint32_t fl, sl;
+    mappingInsert(getBlockSize(block), &fl, &sl);
+    if (block->prevFree)
+        block->prevFree->nextFree = block->nextFree;
+    else
+        m_freeLists[fl][sl] = block->nextFree;
+    if (block->nextFree)
+        block->nextFree->prevFree = block->prevFree;
+    if (m_freeLists[fl][sl] == NULL)
     {
-        MemPoolBlock* blk = findBlockFromPtr(ptr);
-        if (blk)
-        {
-            blk->alloc = 0;
-            mergeFreeBlocks();
-        }
+        m_slBitmap[fl] &= ~(1 << sl);
+        if (m_slBitmap[fl] == 0)
+            m_flBitmap &= ~(1 << fl);
     }
+    block->size &= ~FREEBIT;
+    m_freeSize  -= block->size;
 }
 
 
-void MTD_FLASHMEM MemPool::mergeFreeBlocks()
+void* MTD_FLASHMEM MemPool::malloc(SIZE_T size)
 {
-    MemPoolBlock* curblk = m_blocks;
-    while (curblk->next)
+    // align size (keeps block headers aligned)
+    size = (size + (1 << ALIGNLOG2) - 1) & ~((1 << ALIGNLOG2) - 1);
+    if (size < MINSIZE)
+        size = MINSIZE;
+    
+    uint32_t fl, sl;
+    mappingSearch(size, &fl, &sl);
+    Block* block = searchSuitableBlock(&fl, &sl);
+    if (block == NULL)
+        return NULL;
+    removeFreeBlock(block);
+    
+    // split when the remaining part can contain another block
+    if (block->size >= size + HEADERSIZE + MINSIZE)
     {
-        if (curblk->alloc == 0 && curblk->next->alloc == 0)
+        Block* remaining = (Block*)((uint8_t*)block + HEADERSIZE + size);
+        remaining->prevPhys = block;
+        remaining->size     = block->size - size - HEADERSIZE;
+        getNextPhys(remaining)->prevPhys = remaining;
+        block->size = size;
+        insertFreeBlock(remaining);
+    }
+    
+    return (uint8_t*)block + HEADERSIZE;
+}
+
+
+void MTD_FLASHMEM MemPool::free(void const* ptr)
+{
+    if (ptr)
+    {
+        Block* block = (Block*)((uint8_t*)ptr - HEADERSIZE);
+        
+        // merge with previous block
+        Block* prev = block->prevPhys;
+        if (prev && isFree(prev))
         {
-            // merge this and next block
-            curblk->size += curblk->next->size + sizeof(MemPoolBlock);
-            curblk->next = curblk->next->next;
+            removeFreeBlock(prev);
+            prev->size += HEADERSIZE + block->size;
+            block = prev;
+            getNextPhys(block)->prevPhys = block;
         }
-        else
+        
+        // merge with next block
+        Block* next = getNextPhys(block);
+        if (isFree(next))
         {
-            curblk = curblk->next;
+            removeFreeBlock(next);
+            block->size += HEADERSIZE + next->size;
+            getNextPhys(block)->prevPhys = block;
         }
+        
+        insertFreeBlock(block);
     }
 }
 
 
+bool MTD_FLASHMEM MemPool::contains(void const* ptr)
+{
+    return (uint8_t const*)ptr >= m_bufferStart && (uint8_t const*)ptr < m_bufferEnd;
+}
+
+
+// lists are ordered by size, so the largest free block is in the highest non empty list
 void MTD_FLASHMEM MemPool::getStats(SIZE_T* largestFreeBlock, SIZE_T* totalFreeSize)
 {
     *largestFreeBlock = 0;
-    *totalFreeSize    = 0;
-    for (MemPoolBlock* blk = m_blocks; blk; blk = blk->next)
+    *totalFreeSize    = m_freeSize;
+    if (m_flBitmap != 0)
     {
-        if (blk->alloc == 0)
+        uint32_t fl = 31 - __builtin_clz(m_flBitmap);
+        uint32_t sl = 31 - __builtin_clz(m_slBitmap[fl]);
+        for (Block* block = m_freeLists[fl][sl]; block; block = block->nextFree)
         {
-            *totalFreeSize += blk->size;
-            if (blk->size > *largestFreeBlock)
-                *largestFreeBlock = blk->size;
+            SIZE_T size = getBlockSize(block);
+            if (size > *largestFreeBlock)
+                *largestFreeBlock = size;
         }
     }
 }
 
 
-MemPool::SIZE_T MTD_FLASHMEM MemPool::getLargestFreeBlock()
+uint32_t STC_FLASHMEM MemPool::getFragmentation(SIZE_T largestFreeBlock, SIZE_T totalFreeSize)
+{
+    return totalFreeSize > 0? 100 - (uint32_t)((uint64_t)largestFreeBlock * 100 / totalFreeSize) : 0;
+}
+
+
+MemPool::SIZE_T MTD_FLASHMEM MemPool::getSize()
 {
-    SIZE_T largestFreeBlock, totalFreeSize;
-    getStats(&largestFreeBlock, &totalFreeSize);
-    return largestFreeBlock;
+    return m_bufferEnd - m_bufferStart;
 }
 
 #endif
@@ -59,28 +59,16 @@ void reboot(uint32_t time);
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 // MemPool
-//
-// Example of malloc/free implementation using MemPool
-//
-// static uint32_t const FDVHEAPSIZE = 16384;
-// static MemPool* s_memPool = NULL;
-//
-// void* malloc(uint32_t size)
-// {
-//     enterCritical();    // or use mutex
-//     if (s_memPool == NULL)
-//         s_memPool = new(pvPortMalloc(sizeof(MemPool))) MemPool(pvPortMalloc(FDVHEAPSIZE), FDVHEAPSIZE);
-//     void* ptr = s_memPool->malloc(size);
-//     exitCritical();
-//     return ptr;
-// }
-//
-// void free(void* ptr)
-// {        
-//     enterCritical();
-//     s_memPool->free(ptr);
-//     exitCritical();
-// }
+// Two level segregated fit allocator (TLSF): malloc() and free() run in constant time.
+// Free blocks are kept in FLCOUNT x SLCOUNT lists: first level is the power of two of the size, second level
+// splits it in SLCOUNT linear ranges. Two bitmaps tell which lists are not empty.
+// Each block starts with a header containing its size and a pointer to the physically previous block (boundary
+// tags), so freed blocks are immediately merged with free neighbours.
+// Block overhead is 8 bytes, sizes are rounded up to 4 bytes (minimum 8).
+// Not thread safe: Memory::malloc() and Memory::free() use it inside a critical section
+// when FDV_MEMPOOL_HEAPSIZE > 0 (see fdvconfig.h), so getStats() must be called inside a critical section too.
+// The free size is kept up to date by insertFreeBlock() and removeFreeBlock(), so getStats() walks only the
+// list of the largest free blocks.
 
 #if (FDV_INCLUDE_MEMPOOL == 1)
 
@@ -88,30 +76,59 @@ class MemPool
 {
 public:
 
-    typedef uint16_t SIZE_T;
+    typedef uint32_t SIZE_T;
     
     MemPool(void* buffer, SIZE_T bufferLength);
     
     void* malloc(SIZE_T size);
     void free(void const* ptr);
+    bool contains(void const* ptr);
     
     void getStats(SIZE_T* largestFreeBlock, SIZE_T* totalFreeSize);
-    SIZE_T getLargestFreeBlock();   // just an helper of getStats()
+    SIZE_T getSize();
+    
+    // 0..100: percentage of free memory not contained in the largest free block (values from getStats())
+    static uint32_t getFragmentation(SIZE_T largestFreeBlock, SIZE_T totalFreeSize);
     
 private:
 
-    struct MemPoolBlock
+    static uint32_t const ALIGNLOG2   = 2;
+    static uint32_t const SLCOUNTLOG2 = 3;
+    static uint32_t const SLCOUNT     = 1 << SLCOUNTLOG2;
+    static uint32_t const FLSHIFT     = SLCOUNTLOG2 + ALIGNLOG2;
+    static uint32_t const SMALLSIZE   = 1 << FLSHIFT;            // below this size only first level 0 is used
+    static uint32_t const FLMAXLOG2   = 17;                      // up to 128KB
+    static uint32_t const FLCOUNT     = FLMAXLOG2 - FLSHIFT + 1;
+
+    struct Block
     {
-        MemPoolBlock* next;
-        SIZE_T        size;  // size not including this structure. This is a multiple of sizeof(MemPoolBlock)
-        uint8_t       alloc; // 0 = free, 1 = allocated
+        Block* prevPhys;    // physically previous block (NULL for the first one)
+        SIZE_T size;        // payload size. Bit 0 set = free
+        // following fields are valid only for free blocks (they overlap the payload)
+        Block* nextFree;
+        Block* prevFree;
     };
     
-    MemPoolBlock* findFreeBlock(SIZE_T minsize);
-    MemPoolBlock* findBlockFromPtr(void const* ptr);
-    void mergeFreeBlocks();
+    static uint32_t const MINSIZE     = sizeof(Block*) * 2;      // nextFree and prevFree must fit into the payload
+    static uint32_t const HEADERSIZE  = sizeof(Block) - MINSIZE;
+    static uint32_t const FREEBIT     = 1;
+    
+    static SIZE_T getBlockSize(Block* block);
+    static bool isFree(Block* block);
+    static Block* getNextPhys(Block* block);
+    static void mappingInsert(SIZE_T size, uint32_t* fl, uint32_t* sl);
+    static void mappingSearch(SIZE_T size, uint32_t* fl, uint32_t* sl);
     
-    MemPoolBlock* m_blocks;
+    Block* searchSuitableBlock(uint32_t* fl, uint32_t* sl);
+    void insertFreeBlock(Block* block);
+    void removeFreeBlock(Block* block);
+    
+    uint8_t* m_bufferStart;
+    uint8_t* m_bufferEnd;
+    uint32_t m_flBitmap;
+    uint32_t m_slBitmap[FLCOUNT];
+    SIZE_T   m_freeSize;        // sum of free blocks payload
+    Block*   m_freeLists[FLCOUNT][SLCOUNT];
 };
 
 #endif
@@ -124,7 +141,114 @@ private:
 struct Memory
 {        
 	static void* malloc(uint32_t size);
+	static void* malloc(uint32_t size, void const* callSite);
 	static void free(void* ptr);
+	
+#if (FDV_INCLUDE_MEMPOOL == 1) && (FDV_MEMPOOL_HEAPSIZE > 0)
+	static MemPool* getMemPool();
+#endif
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// HeapTrace
+// Accounts heap usage to call sites (the caller of Memory::malloc() or new), when FDV_INCLUDE_HEAPTRACE is enabled.
+// Each allocation costs 4 more bytes and a lookup in a fixed table of MAXSITES slots. When the table is full
+// new sites are accounted to the last slot (address = NULL).
+// Call site addresses can be resolved with:
+//   xtensa-lx106-elf-addr2line -f -e app.out ADDRESS
+
+#if (FDV_INCLUDE_HEAPTRACE == 1)
+
+struct HeapTrace
+{
+    static uint32_t const MAXSITES = 32;
+    
+    struct Site
+    {
+        void const* address;
+        uint32_t    liveBytes;
+        uint32_t    liveCount;
+        uint32_t    peakBytes;
+        uint32_t    allocations;
+    };
+    
+    struct Stats
+    {
+        uint32_t liveBytes;
+        uint32_t highWater;
+        uint32_t allocations;
+        uint32_t sitesCount;
+    };
+    
+    static uint32_t add(void const* callSite, uint32_t size);
+    static void remove(uint32_t slot, uint32_t size);
+    
+    static void getStats(Stats* stats);
+    static bool getSite(uint32_t slot, Site* site);
+};
+
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+// Slab
+// Size class allocator for small objects which are allocated and freed very often (dictionary and list items,
+// chunk headers, shared buffers...).
+// Each class gets blocks from pages of at least 4 blocks. Freed blocks go back to their page and are reused only
+// by the same class, filling partially used pages first, so small objects don't fragment the heap.
+// A page which becomes completely free is returned to the heap, except one empty page per class which is kept
+// to avoid allocating and freeing a page at every alloc/free pair.
+// Sizes larger than MAXSIZE go directly to Memory::malloc().
+// Each class is limited to a maximum number of blocks (DEFAULTCAPSIZE bytes, see setCap()). Allocations over the cap,
+// or when a new page cannot be allocated, are served by the heap and counted as failures.
+// Every block is preceded by a tag dword (its page, or NULL when served by the heap), so free() is O(1).
+// Usually classes inherit from SlabAllocated instead of calling alloc/free.
+
+struct Slab
+{
+    static uint32_t const CLASSESCOUNT   = 8;
+    static uint32_t const MAXSIZE        = 192;
+    static uint32_t const DEFAULTCAPSIZE = 2048;   // default cap of each class, in bytes
+    
+    struct Stats
+    {
+        uint16_t blockSize;
+        uint16_t blocks;    // blocks in allocated pages (decreases when pages are released)
+        uint16_t inUse;
+        uint16_t peak;
+        uint16_t failures;  // allocations served by the heap
+        uint16_t cap;       // 0 = no limit
+    };
+    
+    static void* alloc(uint32_t size);
+    static void free(void* ptr, uint32_t size);  // size must be the same specified in alloc()
+    
+    static void setCap(uint32_t classIndex, uint32_t maxBlocks);
+    static void getStats(uint32_t classIndex, Stats* stats);
+};
+
+
+// Classes which inherit from SlabAllocated are allocated by Slab
+struct SlabAllocated
+{
+    static void* operator new(size_t size)
+    {
+        return Slab::alloc(size);
+    }
+    
+    static void* operator new(size_t size, void* ptr)
+    {
+        return ptr;
+    }
+    
+    static void operator delete(void* ptr, size_t size)
+    {
+        Slab::free(ptr, size);
+    }
 };
 
 